@@ -54,14 +54,62 @@
 
 #endif
 
+// How many panels share the SPI bus, one per chip select line: 1 (CE0) or 2 (CE0 and CE1, e.g. one panel per eye).
+// Set with -DSPI_PANELS=2 on the CMake command line.
+#ifndef SPI_PANELS
+#define SPI_PANELS 1
+#endif
+
+// If the TE (tearing effect) output of the panel is wired to a GPIO pin, pass -DGPIO_TFT_TE=<pin> to pace the frames
+// to the panel's refresh instead of a free-running timer. The panel refreshes at TE_REFRESH_RATE (FRCTRL2 0x01 in
+// st7789V.cpp), and a frame is started TE_DELAY_USECS after every (TE_REFRESH_RATE/TARGET_FRAME_RATE)th TE pulse.
+#if defined(GPIO_TFT_TE)
+#ifndef TE_REFRESH_RATE
+#define TE_REFRESH_RATE 111
+#endif
+#ifndef TE_DELAY_USECS
+#define TE_DELAY_USECS 0
+#endif
+#ifndef GPIO_CHIP_DEVICE
+#define GPIO_CHIP_DEVICE "/dev/gpiochip0"
+#endif
+#endif
+
 // If enabled, the source video frame is not scaled to fit to the screen, but instead if the source frame
 // is bigger than the SPI display, then content is cropped away, i.e. the source is displayed "centered"
 // on the SPI screen:
 // #define DISPLAY_CROPPED_INSTEAD_OF_SCALING
 
-// If enabled, the main thread and SPI thread are executed with realtime priority
+// If enabled, the SPI, vsync and render threads are executed with realtime priority (SCHED_FIFO), each pinned to a core of
+// its own, and the process memory is locked. Set with -DREALTIME_THREADS=ON on the CMake command line, see realtime.h.
 // #define RUN_WITH_REALTIME_THREAD_PRIORITY
 
+// If enabled, the stages of every frame are traced, and written out as Chrome trace JSON to TRACE_FILE on SIGUSR2 and at
+// exit. Set with -DFRAME_TRACING=ON on the CMake command line, see trace.h.
+// #define FRAME_TRACING
+
+// If enabled, decoding, rotating and diffing a frame run on threads of their own, with up to PIPELINE_DEPTH frames in
+// flight, instead of one after the other on the render thread. Set with -DPIPELINED_RENDER=ON on the CMake command line.
+// #define PIPELINED_RENDER
+#ifndef PIPELINE_DEPTH
+#define PIPELINE_DEPTH 3
+#endif
+
+// If enabled, every task that the SPI thread sends is recorded to SPI_CAPTURE_FILE, for replaying it with
+// tools/bench/spi_replay. Set with -DSPI_CAPTURE=ON on the CMake command line, see spi_capture.h.
+// #define SPI_CAPTURE
+
+// With -DSPI_TRANSPORT=emulator, the byte stream is drawn into an emulated ST7789 per panel, and at exit what each of
+// them shows is written to EMULATOR_PNG_FILE, with the index of the panel in place of the %d. See st7789_emulator.h.
+#ifndef EMULATOR_PNG_FILE
+#define EMULATOR_PNG_FILE "/tmp/fbcp-panel%d.png"
+#endif
+
+// If enabled, the statistics and metrics are exported on the shared memory page /dev/shm/fbcp-metrics and as
+// Prometheus text on the Unix socket /tmp/fbcp-metrics.sock. Set with -DMETRICS_EXPORT=ON on the CMake command line,
+// see metrics_export.h.
+// #define METRICS_EXPORT
+
 // If defined, progressive updating is always used (at the expense of slowing down refresh rate if it's
 // too much for the display to handle)
 // #define NO_INTERLACING
@@ -208,9 +256,19 @@
 // on some Pis
 #define KEYBOARD_INPUT_FILE "/dev/input/event1"
 
-// If enabled, the display backlight will be turned off after this many usecs of no activity on screen.
+#endif
+
+// If enabled, the panels are put to sleep (and the backlight turned off, with BACKLIGHT_CONTROL) after this many usecs
+// of no activity on screen, and woken up by the first frame that changes enough again. Both go through the SPI control
+// lane, so they do not wait behind the frames that are queued.
+#ifndef TURN_DISPLAY_OFF_AFTER_USECS_OF_INACTIVITY
 #define TURN_DISPLAY_OFF_AFTER_USECS_OF_INACTIVITY (1 * 60 * 1000000)
+#endif
 
+// What the panels' display brightness (WRDISBV, 0-255) is set to when they are turned back on. It dims the backlight
+// on modules that drive it from the controller's LEDPWM output.
+#ifndef DISPLAY_BRIGHTNESS
+#define DISPLAY_BRIGHTNESS 0xFF
 #endif
 
 // If defined, enable a low battery icon triggered by a GPIO pin whose BCM number is given.
@@ -6,17 +6,15 @@
 #include "spi.h"
 #include <cstdio>
 
-Span *spans = 0;
-
 // #ifdef UPDATE_FRAMES_WITHOUT_DIFFING
 // Naive non-diffing functionality: just submit the whole display contents
-void NoDiffChangedRectangle(Span*& head) {
+void NoDiffChangedRectangle(Span*& head, Span *spans, int width, int height) {
   head = spans;
   head->x = 0;
-  head->endX = head->lastScanEndX = gpuFrameWidth;
+  head->endX = head->lastScanEndX = width;
   head->y = 0;
-  head->endY = gpuFrameHeight;
-  head->size = gpuFrameWidth*gpuFrameHeight;
+  head->endY = height;
+  head->size = width*height;
   head->next = 0;
 }
 // #endif
\ No newline at end of file
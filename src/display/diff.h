@@ -10,8 +10,6 @@ struct Span
   Span *next; // Maintain a linked skip list inside the array for fast seek to next active element when pruning
 };
 
-extern Span *spans;
-
 // Looking at SPI communication in a logic analyzer, it is observed that waiting for the finish of an SPI command FIFO causes pretty exactly one byte of delay to the command stream.
 // Therefore the time/bandwidth cost of ending the current span and starting a new span is as follows:
 // 1 byte to wait for the current SPI FIFO batch to finish,
@@ -39,6 +37,7 @@ void DiffFramebuffersToScanlineSpansExact(uint16_t *framebuffer, uint16_t *prevF
 
 void DiffFramebuffersToScanlineSpansFastAndCoarse4Wide(uint16_t *framebuffer, uint16_t *prevFramebuffer, bool interlacedDiff, int interlacedFieldParity, Span *&head);
 
-void NoDiffChangedRectangle(Span *&head);
+// Submits the whole width x height frame as one span, using the first element of the given span array
+void NoDiffChangedRectangle(Span *&head, Span *spans, int width, int height);
 
 void MergeScanlineSpanList(Span *listHead);
@@ -4,7 +4,7 @@
 #include "stdio.h"
 #include <memory.h>
 
-void ClearScreen()
+void ClearScreen(spi_loop *loop)
 {
   printf("DISPLAY_WIDTH = %d DISPLAY_HEIGHT = %d\r\n",DISPLAY_WIDTH,DISPLAY_HEIGHT);
   
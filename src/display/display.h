@@ -100,7 +100,8 @@
 #define OFFLOAD_PIXEL_COPY_TO_DMA_CPP
 #endif
 
-void ClearScreen(void);
+struct spi_loop;
+void ClearScreen(spi_loop *loop);
 
 void TurnBacklightOn(void);
 void TurnBacklightOff(void);
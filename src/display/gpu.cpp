@@ -1,10 +1,14 @@
+#ifdef USE_VIDEOCORE
 #include <bcm_host.h> // bcm_host_init, bcm_host_deinit
+#endif
 
 #include <linux/futex.h> // FUTEX_WAKE
 #include <sys/syscall.h> // SYS_futex
 #include <syslog.h> // syslog, LOG_ERR
 #include <stdio.h> // fprintf
 #include <math.h> // floor
+#include <memory.h> // memcpy
+#include <pthread.h> // pthread_create
 
 #include "config.h"
 #include "gpu.h"
@@ -24,13 +28,11 @@ bool MarkProgramQuitting(void);
 
 #define RANDOM_TEST_PATTERN_FRAME_RATE 120
 
+#ifdef USE_VIDEOCORE
 DISPMANX_DISPLAY_HANDLE_T display;
 DISPMANX_RESOURCE_HANDLE_T screen_resource;
 VC_RECT_T rect;
-
-int frameTimeHistorySize = 0;
-
-FrameHistory frameTimeHistory[FRAME_HISTORY_MAX_SIZE] = {};
+#endif
 
 uint16_t *videoCoreFramebuffer[2] = {};
 volatile int numNewGpuFrames = 0;
@@ -78,7 +80,7 @@ bool SnapshotFramebuffer(uint16_t *destination)
 {
   lastFramePollTime = tick();
 
-#ifdef RANDOM_TEST_PATTERN
+#if defined(RANDOM_TEST_PATTERN) || !defined(USE_VIDEOCORE) // Without VideoCore there is no GPU framebuffer to snapshot
   // Generate random noise that updates each frame
   // uint32_t randomColor = rand() % 65536;
   static int col = 0;
@@ -196,7 +198,7 @@ void *gpu_polling_thread(void*)
     uint64_t earliestNextFrameArrivaltime = lastNewFrameReceivedTime + 1000000/TARGET_FRAME_RATE - earlyFramePrediction;
     uint64_t now = tick();
     if (earliestNextFrameArrivaltime > now)
-      usleep(earliestNextFrameArrivaltime - now);
+      SleepUsecs(earliestNextFrameArrivaltime - now);
 #endif
 
 #if defined(SAVE_BATTERY_BY_PREDICTING_FRAME_ARRIVAL_TIMES) || defined(SAVE_BATTERY_BY_SLEEPING_WHEN_IDLE)
@@ -204,7 +206,7 @@ void *gpu_polling_thread(void*)
     int64_t timeToSleep = nextFrameArrivalTime - tick();
     const int64_t minimumSleepTime = 150; // Don't sleep if the next frame is expected to arrive in less than this much time
     if (timeToSleep > minimumSleepTime)
-      usleep(timeToSleep - minimumSleepTime);
+      SleepUsecs(timeToSleep - minimumSleepTime);
 #endif
 
     uint64_t t0 = tick();
@@ -335,6 +337,8 @@ uint64_t PredictNextFrameArrivalTime()
   else return nextFrameArrivalTime;
 }
 
+#ifdef USE_VIDEOCORE
+
 void InitGPU()
 {
   // Initialize GPU frame grabbing subsystem
@@ -511,3 +515,5 @@ void DeinitGPU()
 
   bcm_host_deinit();
 }
+
+#endif // ~USE_VIDEOCORE
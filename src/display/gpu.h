@@ -24,17 +24,6 @@ extern int excessPixelsRight;
 extern int excessPixelsTop;
 extern int excessPixelsBottom;
 
-#define FRAME_HISTORY_MAX_SIZE 240
-extern int frameTimeHistorySize;
-
-struct FrameHistory
-{
-  uint64_t time;
-  bool interlaced;
-};
-
-extern FrameHistory frameTimeHistory[FRAME_HISTORY_MAX_SIZE];
-
 #define HISTOGRAM_SIZE 240
 extern uint64_t frameArrivalTimes[HISTOGRAM_SIZE];
 extern uint64_t frameArrivalTimesTail;
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "metrics.h"
+#include "util.h"
+
+MetricsHistogram frameIntervalMetric = { "frame_interval_usecs", "Time between frames submitted to the SPI thread", {}, 0, 0 };
+MetricsHistogram frameLatencyMetric = { "frame_latency_usecs", "Time from Gpu::post() to the frame being on the panel", {}, 0, 0 };
+MetricsHistogram frameBytesMetric = { "frame_bytes", "Bytes submitted to the SPI thread per frame", {}, 0, 0 };
+MetricsHistogram frameSpansMetric = { "frame_spans", "Changed spans per frame", {}, 0, 0 };
+MetricsHistogram queueDepthMetric = { "queue_depth_bytes", "Bytes queued for the SPI bus when a frame is posted", {}, 0, 0 };
+
+MetricsHistogram *const allMetrics[] = { &frameIntervalMetric, &frameLatencyMetric, &frameBytesMetric, &frameSpansMetric, &queueDepthMetric };
+const int numMetrics = sizeof(allMetrics) / sizeof(allMetrics[0]);
+
+static int MetricsBucket(uint64_t value)
+{
+  if (value < METRICS_SUB_BUCKETS) return (int)value;
+  int msb = 63 - __builtin_clzll(value);
+  int shift = msb - METRICS_SUB_BUCKET_BITS;
+  return (shift + 1) * METRICS_SUB_BUCKETS + (int)((value >> shift) - METRICS_SUB_BUCKETS);
+}
+
+uint64_t MetricsBucketLowerBound(int bucket)
+{
+  if (bucket < METRICS_SUB_BUCKETS) return bucket;
+  int shift = bucket / METRICS_SUB_BUCKETS - 1;
+  return (uint64_t)(METRICS_SUB_BUCKETS + bucket % METRICS_SUB_BUCKETS) << shift;
+}
+
+uint64_t MetricsBucketUpperBound(int bucket)
+{
+  if (bucket < METRICS_SUB_BUCKETS) return bucket;
+  int shift = bucket / METRICS_SUB_BUCKETS - 1;
+  return MetricsBucketLowerBound(bucket) + (1ULL << shift) - 1;
+}
+
+void MetricsRecord(MetricsHistogram *histogram, uint64_t value)
+{
+  value = MIN(value, (1ULL << METRICS_VALUE_BITS) - 1);
+  __atomic_fetch_add(&histogram->buckets[MetricsBucket(value)], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&histogram->sum, value, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+  while(value > max && !__atomic_compare_exchange_n(&histogram->max, &max, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+// The buckets are read one by one while others may be recording, so the count is summed up from the buckets that were
+// read, to keep the snapshot consistent for percentiles
+void MetricsTakeSnapshot(MetricsHistogram *histogram, MetricsSnapshot *snapshot)
+{
+  snapshot->sum = __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED);
+  snapshot->max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+  snapshot->count = 0;
+  for(int i = 0; i < METRICS_HISTOGRAM_BUCKETS; ++i)
+  {
+    snapshot->buckets[i] = __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+    snapshot->count += snapshot->buckets[i];
+  }
+}
+
+void MetricsSubtract(MetricsSnapshot *to, const MetricsSnapshot *from)
+{
+  to->count = 0;
+  for(int i = 0; i < METRICS_HISTOGRAM_BUCKETS; ++i)
+  {
+    to->buckets[i] -= from->buckets[i];
+    to->count += to->buckets[i];
+  }
+  to->sum -= from->sum;
+}
+
+uint64_t MetricsPercentile(const MetricsSnapshot *snapshot, double percentile)
+{
+  if (snapshot->count == 0) return 0;
+  uint64_t rank = (uint64_t)(snapshot->count * percentile);
+  uint64_t accum = 0;
+  for(int i = 0; i < METRICS_HISTOGRAM_BUCKETS; ++i)
+  {
+    accum += snapshot->buckets[i];
+    if (accum > rank) return MIN(MetricsBucketUpperBound(i), snapshot->max);
+  }
+  return snapshot->max;
+}
+
+void PrintMetrics()
+{
+  for(int i = 0; i < numMetrics; ++i)
+  {
+    MetricsSnapshot s;
+    MetricsTakeSnapshot(allMetrics[i], &s);
+    if (s.count == 0) continue;
+    printf("%-22s %8llu samples, mean %9.1f, p50 %8llu, p99 %8llu, max %8llu\n", allMetrics[i]->name, (unsigned long long)s.count,
+      (double)s.sum / s.count, (unsigned long long)MetricsPercentile(&s, 0.5), (unsigned long long)MetricsPercentile(&s, 0.99), (unsigned long long)s.max);
+  }
+}
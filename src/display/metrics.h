@@ -0,0 +1,56 @@
+#pragma once
+
+#include <inttypes.h>
+
+// Log-linear (HDR style) histograms of the per frame metrics. Values below 2^METRICS_SUB_BUCKET_BITS each have a
+// bucket of their own, and every power of two above that is split into 2^METRICS_SUB_BUCKET_BITS equal buckets, so a
+// percentile is off by at most 1/2^METRICS_SUB_BUCKET_BITS (6%) of its value, over the whole range of a 32 bit value.
+// Recording a value is a few atomic adds, without locks or loops over the samples, so any thread can record.
+//
+// The histograms only count up. A reader that wants the values of a time window, like the statistics overlay, keeps
+// the snapshot of the start of the window and subtracts it from the current one.
+#define METRICS_SUB_BUCKET_BITS 4
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BUCKET_BITS)
+#define METRICS_VALUE_BITS 32 // Larger values are counted as 2^32-1
+#define METRICS_HISTOGRAM_BUCKETS ((METRICS_VALUE_BITS - METRICS_SUB_BUCKET_BITS + 1) * METRICS_SUB_BUCKETS)
+
+struct MetricsHistogram
+{
+  const char *name; // e.g. "frame_interval_usecs"
+  const char *help;
+  volatile uint32_t buckets[METRICS_HISTOGRAM_BUCKETS];
+  volatile uint64_t sum;
+  volatile uint64_t max;
+};
+
+struct MetricsSnapshot
+{
+  uint32_t buckets[METRICS_HISTOGRAM_BUCKETS];
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max; // Of all time, also in a difference of two snapshots
+};
+
+extern MetricsHistogram frameIntervalMetric; // Between frames that were submitted to the SPI thread, in usecs
+extern MetricsHistogram frameLatencyMetric; // From Gpu::post() to the frame being on the panel, in usecs
+extern MetricsHistogram frameBytesMetric; // Bytes submitted to the SPI thread per Gpu::post()
+extern MetricsHistogram frameSpansMetric; // Changed spans per Gpu::post()
+extern MetricsHistogram queueDepthMetric; // Bytes already queued for the SPI bus when a frame is posted
+
+// All of the above, for exporters
+extern MetricsHistogram *const allMetrics[];
+extern const int numMetrics;
+
+void MetricsRecord(MetricsHistogram *histogram, uint64_t value);
+void MetricsTakeSnapshot(MetricsHistogram *histogram, MetricsSnapshot *snapshot);
+// to -= from, to get the samples that were recorded in between two snapshots
+void MetricsSubtract(MetricsSnapshot *to, const MetricsSnapshot *from);
+// The value that the given fraction (0...1) of the samples were at or under, rounded up to the end of its bucket, and
+// never over the max. 0 if there are no samples.
+uint64_t MetricsPercentile(const MetricsSnapshot *snapshot, double percentile);
+// Range of values that are counted in the given bucket
+uint64_t MetricsBucketLowerBound(int bucket);
+uint64_t MetricsBucketUpperBound(int bucket);
+
+// Prints the count, mean, p50, p99 and max of every metric
+void PrintMetrics();
@@ -0,0 +1,317 @@
+#ifdef METRICS_EXPORT
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "metrics_export.h"
+#include "metrics.h"
+#include "spi.h"
+#include "statistics.h"
+#include "tick.h"
+#include "util.h"
+
+// A Prometheus scrape of all metrics fits comfortably
+#define METRICS_TEXT_SIZE 65536
+// How long a client gets to send its (optional) HTTP request, before it is served the plain text
+#define METRICS_CLIENT_TIMEOUT_MSECS 100
+
+static pthread_t metricsThread;
+static int metricsStopFd = -1;
+static int metricsListenFd = -1;
+static int metricsShmFd = -1;
+static MetricsPage *metricsPage = 0;
+
+static char metricsText[METRICS_TEXT_SIZE];
+static int metricsTextSize = 0;
+
+// Fills in the page from the live counters, except the seqlock sequence
+static void FillMetricsPage(MetricsPage *page)
+{
+  page->magic = METRICS_PAGE_MAGIC;
+  page->version = METRICS_PAGE_VERSION;
+  page->updateTimeUsecs = tick();
+
+  page->numPanels = spiBus ? MIN(spiBus->numPanels, METRICS_PAGE_MAX_PANELS) : 0;
+  for(uint32_t i = 0; i < page->numPanels; ++i)
+  {
+    page->panelBytesSent[i] = __atomic_load_n(&spiBus->panels[i]->bytesSent, __ATOMIC_RELAXED);
+    page->panelFramesSent[i] = __atomic_load_n(&spiBus->panels[i]->framesSent, __ATOMIC_RELAXED);
+  }
+
+#ifdef STATISTICS
+  page->progressiveFrames = __atomic_load_n(&statsProgressiveFrames, __ATOMIC_RELAXED);
+  page->interlacedFrames = __atomic_load_n(&statsInterlacedFrames, __ATOMIC_RELAXED);
+  page->skippedFrames = __atomic_load_n(&statsFramesSkipped, __ATOMIC_RELAXED);
+  static_assert(SPI_THREAD_NUM_STATES == METRICS_PAGE_SPI_THREAD_STATES, "The metrics page has a field per SPI thread state");
+  spi_thread_time(page->spiThreadUsecs);
+  page->spiUtilization = spiThreadUtilizationRate;
+  page->spiBusDutyCycle = spiBusDutyCycle;
+  page->spiBusDataRateBitsPerSec = spiBusDataRate;
+  page->cpuTemperatureCelsius = statsCpuTemperature;
+  page->spiBusSpeedMhz = statsSpiBusSpeed;
+  page->cpuFrequencyMhz = statsCpuFrequency;
+  page->coreFrequencyMhz = statsBcmCoreSpeed;
+  page->gpuPollingWastedPercent = statsGpuPollingWasted;
+#endif
+
+  page->numHistograms = MIN(numMetrics, METRICS_PAGE_MAX_HISTOGRAMS);
+  for(uint32_t i = 0; i < page->numHistograms; ++i)
+  {
+    MetricsSnapshot snapshot;
+    MetricsTakeSnapshot(allMetrics[i], &snapshot);
+    MetricsPageHistogram *h = &page->histograms[i];
+    snprintf(h->name, sizeof(h->name), "%s", allMetrics[i]->name);
+    h->count = snapshot.count;
+    h->sum = snapshot.sum;
+    h->p50 = MetricsPercentile(&snapshot, 0.5);
+    h->p90 = MetricsPercentile(&snapshot, 0.9);
+    h->p99 = MetricsPercentile(&snapshot, 0.99);
+    h->p999 = MetricsPercentile(&snapshot, 0.999);
+    h->max = snapshot.max;
+  }
+}
+
+static void UpdateMetricsPage()
+{
+  if (!metricsPage) return;
+  MetricsPage page;
+  memset(&page, 0, sizeof(page));
+  FillMetricsPage(&page);
+
+  // Filled in outside of the write, so that readers spin only for the copy
+  uint32_t sequence = metricsPage->sequence;
+  page.updateCount = metricsPage->updateCount + 1;
+  __atomic_store_n(&metricsPage->sequence, sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  const size_t header = offsetof(MetricsPage, numPanels); // magic, version and sequence
+  memcpy((uint8_t*)metricsPage + header, (uint8_t*)&page + header, sizeof(MetricsPage) - header);
+  __atomic_store_n(&metricsPage->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+static void Append(const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(metricsText + metricsTextSize, METRICS_TEXT_SIZE - metricsTextSize, format, args);
+  va_end(args);
+  if (n > 0) metricsTextSize = MIN(metricsTextSize + n, METRICS_TEXT_SIZE - 1);
+}
+
+static void AppendMetric(const char *name, const char *type, const char *help)
+{
+  Append("# HELP fbcp_%s %s\n# TYPE fbcp_%s %s\n", name, help, name, type);
+}
+
+// The histograms are exported with a bucket per power of two, le = 2^k-1, which are exact bucket boundaries of the
+// log-linear histograms
+static void AppendHistogram(MetricsHistogram *histogram)
+{
+  MetricsSnapshot snapshot;
+  MetricsTakeSnapshot(histogram, &snapshot);
+  AppendMetric(histogram->name, "histogram", histogram->help);
+  uint64_t cumulative = 0;
+  int bucket = 0;
+  for(int k = 0; k <= METRICS_VALUE_BITS; ++k)
+  {
+    uint64_t le = (1ULL << k) - 1;
+    for(; bucket < METRICS_HISTOGRAM_BUCKETS && MetricsBucketUpperBound(bucket) <= le; ++bucket)
+      cumulative += snapshot.buckets[bucket];
+    Append("fbcp_%s_bucket{le=\"%llu\"} %llu\n", histogram->name, (unsigned long long)le, (unsigned long long)cumulative);
+  }
+  Append("fbcp_%s_bucket{le=\"+Inf\"} %llu\n", histogram->name, (unsigned long long)snapshot.count);
+  Append("fbcp_%s_sum %llu\n", histogram->name, (unsigned long long)snapshot.sum);
+  Append("fbcp_%s_count %llu\n", histogram->name, (unsigned long long)snapshot.count);
+}
+
+static void FormatPrometheusText()
+{
+  MetricsPage page;
+  memset(&page, 0, sizeof(page));
+  FillMetricsPage(&page);
+  metricsTextSize = 0;
+
+  AppendMetric("spi_bytes_total", "counter", "Bytes sent to each panel on the SPI bus");
+  for(uint32_t i = 0; i < page.numPanels; ++i) Append("fbcp_spi_bytes_total{panel=\"%u\"} %llu\n", i, (unsigned long long)page.panelBytesSent[i]);
+  AppendMetric("frames_sent_total", "counter", "Frames fully sent to each panel on the SPI bus");
+  for(uint32_t i = 0; i < page.numPanels; ++i) Append("fbcp_frames_sent_total{panel=\"%u\"} %llu\n", i, (unsigned long long)page.panelFramesSent[i]);
+
+#ifdef STATISTICS
+  AppendMetric("frames_total", "counter", "Frames submitted to the SPI thread");
+  Append("fbcp_frames_total{update=\"progressive\"} %llu\n", (unsigned long long)page.progressiveFrames);
+  Append("fbcp_frames_total{update=\"interlaced\"} %llu\n", (unsigned long long)page.interlacedFrames);
+  AppendMetric("frames_skipped_total", "counter", "Source frames that were skipped");
+  Append("fbcp_frames_skipped_total %llu\n", (unsigned long long)page.skippedFrames);
+  AppendMetric("spi_thread_seconds_total", "counter", "Time the SPI thread spent in each state");
+  for(int i = 0; i < SPI_THREAD_NUM_STATES; ++i) Append("fbcp_spi_thread_seconds_total{state=\"%s\"} %.6f\n", spiThreadStateNames[i], page.spiThreadUsecs[i] / 1e6);
+  AppendMetric("spi_utilization_ratio", "gauge", "Fraction of time the SPI thread was transmitting or polling");
+  Append("fbcp_spi_utilization_ratio %g\n", page.spiUtilization);
+  AppendMetric("spi_bus_duty_cycle_ratio", "gauge", "Fraction of time the SPI bus was clocking out bytes");
+  Append("fbcp_spi_bus_duty_cycle_ratio %g\n", page.spiBusDutyCycle);
+  AppendMetric("spi_bus_data_rate_bits_per_second", "gauge", "Data rate on the SPI bus");
+  Append("fbcp_spi_bus_data_rate_bits_per_second %g\n", page.spiBusDataRateBitsPerSec);
+  AppendMetric("gpu_polling_wasted_percent", "gauge", "CPU time wasted polling for new frames");
+  Append("fbcp_gpu_polling_wasted_percent %d\n", page.gpuPollingWastedPercent);
+#ifdef USE_VIDEOCORE // Only the VideoCore mailbox tells these
+  AppendMetric("cpu_temperature_celsius", "gauge", "SoC temperature");
+  Append("fbcp_cpu_temperature_celsius %g\n", page.cpuTemperatureCelsius);
+  AppendMetric("cpu_frequency_megahertz", "gauge", "ARM clock");
+  Append("fbcp_cpu_frequency_megahertz %d\n", page.cpuFrequencyMhz);
+  AppendMetric("core_frequency_megahertz", "gauge", "VideoCore core clock, which the SPI clock is divided from");
+  Append("fbcp_core_frequency_megahertz %d\n", page.coreFrequencyMhz);
+  AppendMetric("spi_bus_speed_megahertz", "gauge", "SPI clock");
+  Append("fbcp_spi_bus_speed_megahertz %g\n", page.spiBusSpeedMhz);
+#endif
+#endif
+
+  for(int i = 0; i < numMetrics; ++i) AppendHistogram(allMetrics[i]);
+}
+
+static void WriteAll(int fd, const char *data, int size)
+{
+  while(size > 0)
+  {
+    ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return;
+    data += n;
+    size -= n;
+  }
+}
+
+// Serves one client. A client that sends an HTTP request gets an HTTP response, anything else gets the plain text.
+static void ServeMetricsClient()
+{
+  int fd = accept4(metricsListenFd, 0, 0, SOCK_CLOEXEC);
+  if (fd < 0) return;
+
+  char request[512];
+  ssize_t requestSize = 0;
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  if (poll(&pfd, 1, METRICS_CLIENT_TIMEOUT_MSECS) > 0) requestSize = recv(fd, request, sizeof(request) - 1, MSG_DONTWAIT);
+  bool http = requestSize >= 4 && !memcmp(request, "GET ", 4);
+
+  FormatPrometheusText();
+  if (http)
+  {
+    char header[128];
+    int headerSize = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\n\r\n", metricsTextSize);
+    WriteAll(fd, header, headerSize);
+  }
+  WriteAll(fd, metricsText, metricsTextSize);
+  close(fd);
+}
+
+static void *MetricsExportThread(void *unused)
+{
+  pthread_setname_np(pthread_self(), "fbcp-metrics");
+  uint64_t nextPageUpdate = 0;
+  for(;;)
+  {
+    uint64_t now = tick();
+    if (now >= nextPageUpdate)
+    {
+      UpdateMetricsPage();
+      nextPageUpdate = now + METRICS_PAGE_INTERVAL_USECS;
+    }
+
+    struct pollfd fds[2] = { { metricsStopFd, POLLIN, 0 }, { metricsListenFd, POLLIN, 0 } };
+    int ret = poll(fds, metricsListenFd >= 0 ? 2 : 1, (int)((nextPageUpdate - now) / 1000) + 1);
+    if (ret < 0 && errno != EINTR) FATAL_ERROR("poll() failed in the metrics export thread!");
+    if (fds[0].revents) break;
+    if (metricsListenFd >= 0 && (fds[1].revents & POLLIN)) ServeMetricsClient();
+  }
+  return 0;
+}
+
+static void CreateMetricsPage()
+{
+  metricsShmFd = shm_open(METRICS_SHM_NAME, O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+  if (metricsShmFd < 0 || ftruncate(metricsShmFd, sizeof(MetricsPage)) < 0)
+  {
+    printf("Metrics: could not create shared memory %s: %s\n", METRICS_SHM_NAME, strerror(errno));
+    return;
+  }
+  void *page = mmap(0, sizeof(MetricsPage), PROT_READ | PROT_WRITE, MAP_SHARED, metricsShmFd, 0);
+  if (page == MAP_FAILED)
+  {
+    printf("Metrics: could not map shared memory %s: %s\n", METRICS_SHM_NAME, strerror(errno));
+    return;
+  }
+  metricsPage = (MetricsPage*)page;
+  memset(metricsPage, 0, sizeof(MetricsPage));
+  metricsPage->magic = METRICS_PAGE_MAGIC;
+  metricsPage->version = METRICS_PAGE_VERSION;
+  printf("Metrics: shared memory page at /dev/shm%s\n", METRICS_SHM_NAME);
+}
+
+static void CreateMetricsSocket()
+{
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  snprintf(address.sun_path, sizeof(address.sun_path), "%s", METRICS_SOCKET_PATH);
+  unlink(METRICS_SOCKET_PATH); // Left behind if the previous run did not quit gracefully
+
+  metricsListenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (metricsListenFd < 0 || bind(metricsListenFd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(metricsListenFd, 4) < 0)
+  {
+    printf("Metrics: could not listen on %s: %s\n", METRICS_SOCKET_PATH, strerror(errno));
+    if (metricsListenFd >= 0) close(metricsListenFd);
+    metricsListenFd = -1;
+    return;
+  }
+  printf("Metrics: Prometheus text on %s\n", METRICS_SOCKET_PATH);
+}
+
+void StartMetricsExport()
+{
+  metricsStopFd = eventfd(0, EFD_CLOEXEC);
+  if (metricsStopFd < 0) FATAL_ERROR("Failed to create an eventfd for the metrics export thread!");
+  CreateMetricsPage();
+  CreateMetricsSocket();
+  int rc = pthread_create(&metricsThread, NULL, MetricsExportThread, NULL);
+  if (rc != 0) FATAL_ERROR("Failed to create the metrics export thread!");
+}
+
+void StopMetricsExport()
+{
+  if (metricsStopFd < 0) return;
+  uint64_t one = 1;
+  if (write(metricsStopFd, &one, sizeof(one)) != sizeof(one)) FATAL_ERROR("Failed to stop the metrics export thread!");
+  pthread_join(metricsThread, NULL);
+  close(metricsStopFd);
+  metricsStopFd = -1;
+
+  if (metricsListenFd >= 0)
+  {
+    close(metricsListenFd);
+    unlink(METRICS_SOCKET_PATH);
+    metricsListenFd = -1;
+  }
+  if (metricsPage)
+  {
+    munmap(metricsPage, sizeof(MetricsPage));
+    metricsPage = 0;
+  }
+  if (metricsShmFd >= 0)
+  {
+    close(metricsShmFd);
+    shm_unlink(METRICS_SHM_NAME);
+    metricsShmFd = -1;
+  }
+}
+
+#endif
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <inttypes.h>
+
+// Exports the statistics and the metrics (metrics.h) for monitoring tools, without drawing them into the frames that
+// are being measured. With METRICS_EXPORT (-DMETRICS_EXPORT=ON on the CMake command line), a thread of its own:
+//
+//   - keeps a MetricsPage up to date in the POSIX shared memory object METRICS_SHM_NAME (/dev/shm/fbcp-metrics) every
+//     METRICS_PAGE_INTERVAL_USECS. Readers map it read only and copy it out with ReadMetricsPage(), without syscalls.
+//   - serves the same numbers in the Prometheus text format on the Unix socket METRICS_SOCKET_PATH, to every client
+//     that connects, e.g. curl --unix-socket /tmp/fbcp-metrics.sock http://localhost/metrics
+//
+// The page has no pointers and only fixed size fields, so that readers do not need the rest of this source tree.
+#ifndef METRICS_SHM_NAME
+#define METRICS_SHM_NAME "/fbcp-metrics"
+#endif
+#ifndef METRICS_SOCKET_PATH
+#define METRICS_SOCKET_PATH "/tmp/fbcp-metrics.sock"
+#endif
+#ifndef METRICS_PAGE_INTERVAL_USECS
+#define METRICS_PAGE_INTERVAL_USECS 1000000
+#endif
+
+#define METRICS_PAGE_MAGIC 0x70636266 // "fbcp"
+#define METRICS_PAGE_VERSION 2
+#define METRICS_PAGE_MAX_PANELS 2
+#define METRICS_PAGE_MAX_HISTOGRAMS 8
+#define METRICS_PAGE_SPI_THREAD_STATES 4 // Transmitting, polling, stalled and sleeping, see SpiThreadState in spi.h
+
+struct MetricsPageHistogram
+{
+  char name[32];
+  uint64_t count;
+  uint64_t sum;
+  uint64_t p50;
+  uint64_t p90;
+  uint64_t p99;
+  uint64_t p999;
+  uint64_t max;
+};
+
+struct MetricsPage
+{
+  uint32_t magic;
+  uint32_t version;
+  // Seqlock: odd while the page is being written. A copy is consistent if the sequence was even and the same before
+  // and after it was taken.
+  volatile uint32_t sequence;
+  uint32_t numPanels;
+  uint64_t updateCount;
+  uint64_t updateTimeUsecs; // tick()
+
+  // Counters since the start
+  uint64_t panelBytesSent[METRICS_PAGE_MAX_PANELS];
+  uint64_t panelFramesSent[METRICS_PAGE_MAX_PANELS];
+  uint64_t progressiveFrames;
+  uint64_t interlacedFrames;
+  uint64_t skippedFrames;
+  uint64_t spiThreadUsecs[METRICS_PAGE_SPI_THREAD_STATES];
+
+  // Gauges, as of the last refresh of the statistics overlay. 0 without STATISTICS, or where the hardware does not tell.
+  double spiUtilization; // 0...1
+  double spiBusDutyCycle; // 0...1
+  double spiBusDataRateBitsPerSec;
+  double cpuTemperatureCelsius;
+  double spiBusSpeedMhz;
+  int32_t cpuFrequencyMhz;
+  int32_t coreFrequencyMhz;
+  int32_t gpuPollingWastedPercent;
+
+  uint32_t numHistograms;
+  MetricsPageHistogram histograms[METRICS_PAGE_MAX_HISTOGRAMS];
+};
+
+// Copies a consistent snapshot of the page out, retrying while the page is being written
+static inline bool ReadMetricsPage(const volatile MetricsPage *page, MetricsPage *copy)
+{
+  for(int attempt = 0; attempt < 1000; ++attempt)
+  {
+    uint32_t sequence = __atomic_load_n(&page->sequence, __ATOMIC_ACQUIRE);
+    if (sequence & 1) continue;
+    for(unsigned i = 0; i < sizeof(MetricsPage); ++i)
+      ((uint8_t*)copy)[i] = ((const volatile uint8_t*)page)[i];
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&page->sequence, __ATOMIC_RELAXED) == sequence) return copy->magic == METRICS_PAGE_MAGIC && copy->version == METRICS_PAGE_VERSION;
+  }
+  return false;
+}
+
+#ifdef METRICS_EXPORT
+void StartMetricsExport(void);
+void StopMetricsExport(void);
+#endif
@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "png_writer.h"
+
+static uint32_t crcTable[256];
+
+static void InitCrcTable()
+{
+  for(uint32_t n = 0; n < 256; ++n)
+  {
+    uint32_t c = n;
+    for(int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+    crcTable[n] = c;
+  }
+}
+
+static uint32_t UpdateCrc(uint32_t crc, const uint8_t *bytes, uint32_t size)
+{
+  for(uint32_t i = 0; i < size; ++i) crc = crcTable[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+  return crc;
+}
+
+static void PutBigEndian32(uint8_t *out, uint32_t value)
+{
+  out[0] = (uint8_t)(value >> 24);
+  out[1] = (uint8_t)(value >> 16);
+  out[2] = (uint8_t)(value >> 8);
+  out[3] = (uint8_t)value;
+}
+
+// A chunk is its length, type, data and the CRC of the type and the data. The data is written in parts, so the CRC
+// is kept running across them.
+struct PngChunk
+{
+  FILE *handle;
+  uint32_t crc;
+};
+
+static void BeginChunk(PngChunk *chunk, FILE *handle, const char *type, uint32_t size)
+{
+  uint8_t header[8];
+  PutBigEndian32(header, size);
+  memcpy(header + 4, type, 4);
+  fwrite(header, 1, 8, handle);
+  chunk->handle = handle;
+  chunk->crc = UpdateCrc(0xFFFFFFFFU, header + 4, 4);
+}
+
+static void ChunkData(PngChunk *chunk, const uint8_t *bytes, uint32_t size)
+{
+  fwrite(bytes, 1, size, chunk->handle);
+  chunk->crc = UpdateCrc(chunk->crc, bytes, size);
+}
+
+static void EndChunk(PngChunk *chunk)
+{
+  uint8_t crc[4];
+  PutBigEndian32(crc, chunk->crc ^ 0xFFFFFFFFU);
+  fwrite(crc, 1, 4, chunk->handle);
+}
+
+bool WritePng(const char *path, int width, int height, const uint8_t *rgb)
+{
+  if (!crcTable[1]) InitCrcTable();
+  FILE *handle = fopen(path, "wb");
+  if (!handle) return false;
+
+  static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+  fwrite(signature, 1, 8, handle);
+
+  PngChunk chunk;
+  uint8_t ihdr[13] = {};
+  PutBigEndian32(ihdr, width);
+  PutBigEndian32(ihdr + 4, height);
+  ihdr[8] = 8; // Bit depth
+  ihdr[9] = 2; // Color type: RGB
+  BeginChunk(&chunk, handle, "IHDR", sizeof(ihdr));
+  ChunkData(&chunk, ihdr, sizeof(ihdr));
+  EndChunk(&chunk);
+
+  // The zlib stream: a header, the scanlines (each prefixed with filter type 0) in stored blocks of at most 65535
+  // bytes, and the Adler-32 of the uncompressed data
+  const uint32_t rawSize = (uint32_t)height * (1 + width * 3);
+  const uint32_t maxBlock = 65535;
+  const uint32_t numBlocks = (rawSize + maxBlock - 1) / maxBlock;
+  BeginChunk(&chunk, handle, "IDAT", 2 + numBlocks * 5 + rawSize + 4);
+  const uint8_t zlibHeader[2] = { 0x78, 0x01 };
+  ChunkData(&chunk, zlibHeader, 2);
+
+  uint32_t adlerA = 1, adlerB = 0;
+  uint32_t blockLeft = 0, written = 0;
+  for(int y = 0; y < height; ++y)
+  {
+    const uint8_t filter = 0;
+    const uint8_t *row = rgb + (size_t)y * width * 3;
+    for(uint32_t i = 0; i < (uint32_t)(1 + width * 3); ++i)
+    {
+      if (blockLeft == 0)
+      {
+        blockLeft = rawSize - written < maxBlock ? rawSize - written : maxBlock;
+        uint8_t blockHeader[5] = { (uint8_t)(written + blockLeft == rawSize ? 1 : 0), (uint8_t)blockLeft, (uint8_t)(blockLeft >> 8), (uint8_t)~blockLeft, (uint8_t)(~blockLeft >> 8) };
+        ChunkData(&chunk, blockHeader, 5);
+      }
+      const uint8_t *byte = i == 0 ? &filter : row + i - 1;
+      ChunkData(&chunk, byte, 1);
+      adlerA = (adlerA + *byte) % 65521;
+      adlerB = (adlerB + adlerA) % 65521;
+      --blockLeft;
+      ++written;
+    }
+  }
+  uint8_t adler[4];
+  PutBigEndian32(adler, (adlerB << 16) | adlerA);
+  ChunkData(&chunk, adler, 4);
+  EndChunk(&chunk);
+
+  BeginChunk(&chunk, handle, "IEND", 0);
+  EndChunk(&chunk);
+  bool ok = !ferror(handle);
+  return fclose(handle) == 0 && ok;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <inttypes.h>
+
+// Writes an 8 bit RGB image to a PNG file. The image data is stored without compression (deflate "stored" blocks),
+// so that no zlib is needed on the Pi. That makes a 240x320 image about 230KB, which is fine for the debug dumps that
+// this is for. Returns false if the file could not be written.
+bool WritePng(const char *path, int width, int height, const uint8_t *rgb);
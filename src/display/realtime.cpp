@@ -0,0 +1,77 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "config.h"
+#include "realtime.h"
+#include "util.h"
+
+SchedLatency spiThreadLatency = { "spi", {}, 0, 0 };
+SchedLatency vsyncThreadLatency = { "vsync", {}, 0, 0 };
+SchedLatency renderThreadLatency = { "render", {}, 0, 0 };
+
+void SetThreadScheduling(const char *name, int policy, int priority, int cpu)
+{
+  pthread_t self = pthread_self();
+  pthread_setname_np(self, name);
+
+  struct sched_param param;
+  memset(&param, 0, sizeof(param));
+  param.sched_priority = (policy == SCHED_FIFO || policy == SCHED_RR) ? priority : 0;
+  int ret = pthread_setschedparam(self, policy, &param);
+  if (ret != 0) printf("Could not set scheduling policy %d priority %d for thread %s: %s\n", policy, priority, name, strerror(ret));
+
+  if (cpu >= 0)
+  {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    ret = pthread_setaffinity_np(self, sizeof(cpus), &cpus);
+    if (ret != 0) printf("Could not pin thread %s to CPU %d: %s\n", name, cpu, strerror(ret));
+  }
+  printf("Thread %s: policy %s, priority %d, CPU %d\n", name, policy == SCHED_FIFO ? "SCHED_FIFO" : (policy == SCHED_RR ? "SCHED_RR" : "SCHED_OTHER"), param.sched_priority, cpu);
+}
+
+void LockProcessMemory()
+{
+#ifdef RUN_WITH_REALTIME_THREAD_PRIORITY
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) printf("Could not lock memory: %s\n", strerror(errno));
+  else printf("Locked process memory\n");
+#endif
+}
+
+void AddSchedLatencySample(SchedLatency *latency, uint64_t usecs)
+{
+  uint64_t bucket = MIN(usecs / SCHED_LATENCY_BUCKET_USECS, (uint64_t)SCHED_LATENCY_HISTOGRAM_SIZE - 1);
+  __atomic_fetch_add(&latency->histogram[bucket], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&latency->samples, 1, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&latency->maxUsecs, __ATOMIC_RELAXED);
+  while (usecs > max && !__atomic_compare_exchange_n(&latency->maxUsecs, &max, usecs, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+uint64_t SchedLatencyPercentile(SchedLatency *latency, double percentile)
+{
+  uint64_t samples = __atomic_load_n(&latency->samples, __ATOMIC_RELAXED);
+  uint64_t threshold = (uint64_t)(samples * percentile);
+  uint64_t accum = 0;
+  for(int i = 0; i < SCHED_LATENCY_HISTOGRAM_SIZE; ++i)
+  {
+    accum += latency->histogram[i];
+    if (accum > threshold) return (i + 1) * SCHED_LATENCY_BUCKET_USECS;
+  }
+  return SCHED_LATENCY_HISTOGRAM_SIZE * SCHED_LATENCY_BUCKET_USECS;
+}
+
+void PrintSchedLatencies()
+{
+  SchedLatency *latencies[] = { &spiThreadLatency, &vsyncThreadLatency, &renderThreadLatency };
+  for(SchedLatency *l : latencies)
+  {
+    if (!l->samples) continue;
+    printf("Scheduling latency of %s thread: %llu wakeups, p50 <%lluus, p99 <%lluus, p99.9 <%lluus, max %lluus\n", l->name, (unsigned long long)l->samples,
+      (unsigned long long)SchedLatencyPercentile(l, 0.5), (unsigned long long)SchedLatencyPercentile(l, 0.99),
+      (unsigned long long)SchedLatencyPercentile(l, 0.999), (unsigned long long)l->maxUsecs);
+  }
+}
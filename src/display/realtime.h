@@ -0,0 +1,80 @@
+#pragma once
+
+#include <inttypes.h>
+#include <sched.h>
+
+// Scheduling of the threads that are on the path from a vsync tick to the panel. With RUN_WITH_REALTIME_THREAD_PRIORITY
+// (-DREALTIME_THREADS=ON on the CMake command line) they run under SCHED_FIFO, each pinned to its own core, and all
+// memory is locked so that page faults do not stall them. Each thread's policy, priority and core can be overridden
+// with the macros below, e.g. -DSPI_THREAD_CPU=3. A CPU of -1 leaves the thread free to move between cores.
+#ifdef RUN_WITH_REALTIME_THREAD_PRIORITY
+#define DEFAULT_THREAD_POLICY SCHED_FIFO
+#define DEFAULT_SPI_THREAD_CPU 3
+#define DEFAULT_VSYNC_THREAD_CPU 2
+#define DEFAULT_RENDER_THREAD_CPU 1
+#else
+#define DEFAULT_THREAD_POLICY SCHED_OTHER
+#define DEFAULT_SPI_THREAD_CPU -1
+#define DEFAULT_VSYNC_THREAD_CPU -1
+#define DEFAULT_RENDER_THREAD_CPU -1
+#endif
+
+#ifndef SPI_THREAD_POLICY
+#define SPI_THREAD_POLICY DEFAULT_THREAD_POLICY
+#endif
+#ifndef SPI_THREAD_PRIORITY
+#define SPI_THREAD_PRIORITY 80
+#endif
+#ifndef SPI_THREAD_CPU
+#define SPI_THREAD_CPU DEFAULT_SPI_THREAD_CPU
+#endif
+
+#ifndef VSYNC_THREAD_POLICY
+#define VSYNC_THREAD_POLICY DEFAULT_THREAD_POLICY
+#endif
+#ifndef VSYNC_THREAD_PRIORITY
+#define VSYNC_THREAD_PRIORITY 70
+#endif
+#ifndef VSYNC_THREAD_CPU
+#define VSYNC_THREAD_CPU DEFAULT_VSYNC_THREAD_CPU
+#endif
+
+#ifndef RENDER_THREAD_POLICY
+#define RENDER_THREAD_POLICY DEFAULT_THREAD_POLICY
+#endif
+#ifndef RENDER_THREAD_PRIORITY
+#define RENDER_THREAD_PRIORITY 60
+#endif
+#ifndef RENDER_THREAD_CPU
+#define RENDER_THREAD_CPU DEFAULT_RENDER_THREAD_CPU
+#endif
+
+// Width of a bucket of the scheduling latency histograms, and how many there are. The last bucket counts all longer
+// latencies.
+#define SCHED_LATENCY_BUCKET_USECS 10
+#define SCHED_LATENCY_HISTOGRAM_SIZE 2000
+
+// How late a thread runs after it should have: after the deadline it slept until, or after it was woken up
+struct SchedLatency
+{
+  const char *name;
+  volatile uint32_t histogram[SCHED_LATENCY_HISTOGRAM_SIZE];
+  volatile uint64_t samples;
+  volatile uint64_t maxUsecs;
+};
+
+extern SchedLatency spiThreadLatency;
+extern SchedLatency vsyncThreadLatency;
+extern SchedLatency renderThreadLatency;
+
+// Applies the policy, priority and CPU to the calling thread, and names it. Failures (e.g. no CAP_SYS_NICE for
+// SCHED_FIFO) are reported and leave the thread as it was.
+void SetThreadScheduling(const char *name, int policy, int priority, int cpu);
+
+// Locks the current and future memory of the process in RAM, if RUN_WITH_REALTIME_THREAD_PRIORITY is defined
+void LockProcessMemory();
+
+void AddSchedLatencySample(SchedLatency *latency, uint64_t usecs);
+// Latency in usecs that the given fraction of the samples were at or under
+uint64_t SchedLatencyPercentile(SchedLatency *latency, double percentile);
+void PrintSchedLatencies();
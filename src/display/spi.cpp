@@ -3,51 +3,33 @@
 #include <fcntl.h> // open, O_RDWR, O_SYNC
 #include <sys/mman.h> // mmap, munmap
 #include <pthread.h> // pthread_create
+#include <memory.h> // memcpy
+#ifdef USE_VIDEOCORE
 #include <bcm_host.h> // bcm_host_get_peripheral_address, bcm_host_get_peripheral_size, bcm_host_get_sdram_address
+#endif
 
 #include "config.h"
 #include "spi.h"
-#include "spi_utils.h"
+#include "spi_transport.h"
 #include "util.h"
 #include "mailbox.h"
 #include "mem_alloc.h"
 #include "st7789V.h"
-#include "gpio_utils.h"
-
-// Uncomment this to print out all bytes sent to the SPI bus
-// #define DEBUG_SPI_BUS_WRITES
-
-#ifdef DEBUG_SPI_BUS_WRITES
-#define DEBUG_PRINT_WRITTEN_BYTE(byte) do { \
-  printf("%02X", byte); \
-  if ((writeCounter & 3) == 0) printf("\n"); \
-  } while(0)
-#else
-#define DEBUG_PRINT_WRITTEN_BYTE(byte) ((void)0)
-#endif
-
-
-static uint32_t writeCounter = 0;
+#include "statistics.h"
+#include "realtime.h"
+#include "trace.h"
+#include "metrics.h"
+#include "spi_capture.h"
 
 int mem_fd = -1;
 volatile void *bcm2835 = 0;
 volatile GPIORegisterFile *gpio = 0;
 volatile SPIRegisterFile *spi = 0;
 
-// Points to the system timer register. N.B. spec sheet says this is two low and high parts, in an 32-bit aligned (but not 64-bit aligned) address. Profiling shows
-// that Pi 3 Model B does allow reading this as a u64 load, and even when unaligned, it is around 30% faster to do so compared to loading in parts "lo | (hi << 32)".
-volatile TIMER_TYPE *systemTimerRegister = 0;
-
-// Errata to BCM2835 behavior: documentation states that the SPI0 DLEN register is only used for DMA. However, even when DMA is not being utilized, setting it from
-// a value != 0 or 1 gets rid of an excess idle clock cycle that is present when transmitting each byte. (by default in Polled SPI Mode each 8 bits transfer in 9 clocks)
-// With DLEN=2 each byte is clocked to the bus in 8 cycles, observed to improve max throughput from 56.8mbps to 63.3mbps (+11.4%, quite close to the theoretical +12.5%)
-// https://www.raspberrypi.org/forums/viewtopic.php?f=44&t=181154
-#define UNLOCK_FAST_8_CLOCKS_SPI() (spi->dlen = 2)
-
 SPITask* spi_create_task(spi_loop* loop, uint32_t bytes) {
   // printf("SPI Task allocated with number of bytes %d: \n", bytes);
   uint32_t bytesToAllocate = sizeof(SPITask) + bytes;// + totalBytesFor9BitTask;
-  uint32_t tail = spiTaskMemory->queueTail;
+  uint32_t tail = loop->taskMemory->queueTail;
   uint32_t newTail = tail + bytesToAllocate;
   // Is the new task too large to write contiguously into the ring buffer, that it's split into two parts? We never split,
   // but instead write a sentinel at the end of the ring buffer, and jump the tail back to the beginning of the buffer and
@@ -55,146 +37,416 @@ SPITask* spi_create_task(spi_loop* loop, uint32_t bytes) {
   if (newTail + sizeof(SPITask)/*Add extra SPITask size so that there will always be room for eob marker*/ >= SPI_QUEUE_SIZE)
   {
     printf("SPI Task allocated with overhead!\n");
-    uint32_t head = spiTaskMemory->queueHead;
+    uint32_t head = loop->taskMemory->queueHead;
     // Write a sentinel, but wait for the head to advance first so that it is safe to write.
-    while(head > tail || head == 0/*Head must move > 0 so that we don't stomp on it*/)
+    if (head > tail || head == 0)
     {
-      head = spiTaskMemory->queueHead;
+      TRACE_SCOPE("spi ring wrap wait");
+      while(head > tail || head == 0/*Head must move > 0 so that we don't stomp on it*/)
+      {
+        head = loop->taskMemory->queueHead;
+      }
     }
-    SPITask *endOfBuffer = (SPITask*)(spiTaskMemory->buffer + tail);
+    SPITask *endOfBuffer = (SPITask*)(loop->taskMemory->buffer + tail);
     endOfBuffer->cmd = 0; // Use cmd=0x00 to denote "end of buffer, wrap to beginning"
     __sync_synchronize();
-    spiTaskMemory->queueTail = 0;
+    loop->taskMemory->queueTail = 0;
     __sync_synchronize();
-    if (spiTaskMemory->queueHead == tail) syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAKE, 1, 0, 0, 0); // Wake the SPI thread if it was sleeping to get new tasks
+    if (loop->taskMemory->queueHead == tail) spi_wake_thread(loop->bus); // Wake the SPI thread if it was sleeping to get new tasks
     tail = 0;
     newTail = bytesToAllocate;
   }
 
   // If the SPI task queue is full, wait for the SPI thread to process some tasks. This throttles the main thread to not run too fast.
-  uint32_t head = spiTaskMemory->queueHead;
-  while(head > tail && head <= newTail)
+  uint32_t head = loop->taskMemory->queueHead;
+  if (head > tail && head <= newTail)
   {
-    usleep(100); // Since the SPI queue is full, we can afford to sleep a bit on the main thread without introducing lag.
-    head = spiTaskMemory->queueHead;
+    TRACE_SCOPE_ARG("spi ring full", bytes);
+    while(head > tail && head <= newTail)
+    {
+      usleep(100); // Since the SPI queue is full, we can afford to sleep a bit on the main thread without introducing lag.
+      head = loop->taskMemory->queueHead;
+    }
   }
 
-  SPITask *task = (SPITask*)(spiTaskMemory->buffer + tail);
+  SPITask *task = (SPITask*)(loop->taskMemory->buffer + tail);
   task->size = bytes;
+  task->flags = 0;
+  task->fence = 0;
   return task;
 }
 
+void spi_wake_thread(spi_bus* bus) {
+  uint64_t noWakeTime = 0;
+  __atomic_compare_exchange_n(&bus->wakeTime, &noWakeTime, tick(), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  __atomic_fetch_add(&bus->wakeups, 1, __ATOMIC_SEQ_CST);
+  syscall(SYS_futex, &bus->wakeups, FUTEX_WAKE, 1, 0, 0, 0);
+}
+
 //TODO: Remove unnessery synchr code
 void spi_commit_task(spi_loop* loop, SPITask *task) {
-  lock_guard<mutex> guard(loop->mutex);
+  unique_lock<mutex> guard(loop->mutex, try_to_lock);
+  if (!guard.owns_lock())
+  {
+    TRACE_SCOPE("spi_commit_task lock wait");
+    guard.lock();
+  }
   __sync_synchronize();
-  uint32_t tail = spiTaskMemory->queueTail;
-  spiTaskMemory->queueTail = (uint32_t)((uint8_t*)task - spiTaskMemory->buffer) + sizeof(SPITask) + task->size;
-  __atomic_fetch_add(&spiTaskMemory->spiBytesQueued, task->PayloadSize()+1, __ATOMIC_RELAXED);
+  uint32_t tail = loop->taskMemory->queueTail;
+  loop->taskMemory->queueTail = (uint32_t)((uint8_t*)task - loop->taskMemory->buffer) + sizeof(SPITask) + task->size;
+  __atomic_fetch_add(&loop->taskMemory->spiBytesQueued, task->BusBytes(), __ATOMIC_RELAXED);
   __sync_synchronize();
-  if (spiTaskMemory->queueHead == tail) syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAKE, 1, 0, 0, 0); // Wake the SPI thread if it was sleeping to get new tasks
+  if (loop->taskMemory->queueHead == tail) spi_wake_thread(loop->bus); // Wake the SPI thread if it was sleeping to get new tasks
 }
 
-void WaitForPolledSPITransferToFinish()
-{
-  uint32_t cs;
-  while (!(((cs = spi->cs) ^ BCM2835_SPI0_CS_TA) & (BCM2835_SPI0_CS_DONE | BCM2835_SPI0_CS_TA))) // While TA=1 and DONE=0
-    if ((cs & (BCM2835_SPI0_CS_RXR | BCM2835_SPI0_CS_RXF)))
-      spi->cs = BCM2835_SPI0_CS_CLEAR_RX | BCM2835_SPI0_CS_TA;
+#ifdef STATISTICS
+const char *const spiThreadStateNames[SPI_THREAD_NUM_STATES] = { "transmitting", "polling", "stalled", "sleeping" };
+
+// Written only by the SPI thread, under a seqlock so that spi_thread_time() sees the totals and the state underway
+// together
+static volatile uint32_t spiThreadTimeSequence = 0;
+static volatile uint64_t spiThreadStateUsecs[SPI_THREAD_NUM_STATES] = {};
+static volatile uint64_t spiThreadStateStart = 0;
+static volatile int spiThreadState = SPI_THREAD_TRANSMITTING;
+
+static void spi_thread_enter(SpiThreadState state) {
+  uint64_t now = tick();
+  uint32_t sequence = spiThreadTimeSequence;
+  __atomic_store_n(&spiThreadTimeSequence, sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  spiThreadStateUsecs[spiThreadState] += now - spiThreadStateStart;
+  spiThreadStateStart = now;
+  spiThreadState = state;
+  __atomic_store_n(&spiThreadTimeSequence, sequence + 2, __ATOMIC_RELEASE);
+}
 
-  if ((cs & BCM2835_SPI0_CS_RXD)) spi->cs = BCM2835_SPI0_CS_CLEAR_RX | BCM2835_SPI0_CS_TA;
+static void spi_thread_time_reset() {
+  for(int i = 0; i < SPI_THREAD_NUM_STATES; ++i) spiThreadStateUsecs[i] = 0;
+  spiThreadStateStart = tick();
+  spiThreadState = SPI_THREAD_TRANSMITTING;
 }
 
-void spi_run_task(spi_loop* loop, SPITask *task) {
-  WaitForPolledSPITransferToFinish();
+void spi_thread_time(uint64_t usecs[SPI_THREAD_NUM_STATES]) {
+  uint32_t sequence;
+  do
+  {
+    sequence = __atomic_load_n(&spiThreadTimeSequence, __ATOMIC_ACQUIRE);
+    for(int i = 0; i < SPI_THREAD_NUM_STATES; ++i) usecs[i] = spiThreadStateUsecs[i];
+    if (!spiThreadStateStart) return; // The SPI thread has not started
+    usecs[spiThreadState] += tick() - spiThreadStateStart;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while((sequence & 1) || __atomic_load_n(&spiThreadTimeSequence, __ATOMIC_RELAXED) != sequence);
+}
+
+void PrintSpiThreadTime() {
+  uint64_t usecs[SPI_THREAD_NUM_STATES];
+  spi_thread_time(usecs);
+  double total = 0;
+  for(int i = 0; i < SPI_THREAD_NUM_STATES; ++i) total += usecs[i];
+  if (total <= 0) return;
+  printf("SPI thread:");
+  for(int i = 0; i < SPI_THREAD_NUM_STATES; ++i) printf(" %.1f%% %s%s", usecs[i] * 100.0 / total, spiThreadStateNames[i], i + 1 < SPI_THREAD_NUM_STATES ? "," : "");
+  uint64_t bytesSent = 0;
+  for(int i = 0; spiBus && i < spiBus->numPanels; ++i) bytesSent += spiBus->panels[i]->bytesSent;
+  printf(". Bus duty cycle %.1f%%\n", bytesSent * spiUsecsPerByte * 100.0 / total);
+}
+
+#define SPI_THREAD_ENTER(state) spi_thread_enter(state)
+#else
+#define SPI_THREAD_ENTER(state) ((void)0)
+#endif
+
+// Waits for the written bytes to leave the bus, see SPI_THREAD_POLLING
+static void spi_flush(spi_loop* loop) {
+  SPI_THREAD_ENTER(SPI_THREAD_POLLING);
+  loop->transport->flush();
+  SPI_THREAD_ENTER(SPI_THREAD_TRANSMITTING);
+}
+
+static void spi_end(spi_loop* loop) {
+  SPI_THREAD_ENTER(SPI_THREAD_POLLING);
+  loop->transport->end();
+  SPI_THREAD_ENTER(SPI_THREAD_TRANSMITTING);
+}
+
+static void spi_end_mid_frame(spi_loop* loop) {
+  SPI_THREAD_ENTER(SPI_THREAD_POLLING);
+  loop->transport->endMidFrame();
+  SPI_THREAD_ENTER(SPI_THREAD_TRANSMITTING);
+}
+
+// Writes one command byte followed by the given data bytes to the display. The SPI transfer must be active.
+static void spi_write_command(spi_loop* loop, uint8_t cmd, const uint8_t *tStart, const uint8_t *tEnd) {
+  loop->transport->command(cmd);
+  if (tEnd > tStart) loop->transport->data(tStart, tEnd - tStart);
+}
+
+// Writes a CASET/RASET command of a fused window task. The bytes must have left the bus before the
+// D/C line is flipped back to command mode.
+static void spi_write_window_command(spi_loop* loop, uint8_t cmd, const uint8_t *data, uint8_t size) {
+  spi_write_command(loop, cmd, data, data + size);
+  spi_flush(loop);
+#ifdef DISPLAY_NEEDS_CHIP_SELECT_SIGNAL
+  spi_end(loop);
+  loop->transport->begin();
+#endif
+}
+
+// Sends one command byte followed by the given data bytes to the display
+static void spi_run_command(spi_loop* loop, uint8_t cmd, const uint8_t *tStart, const uint8_t *tEnd) {
+  spi_flush(loop);
 
   // The Adafruit 1.65" 240x240 ST7789 based display is unique compared to others that it does want to see the Chip Select line go
   // low and high to start a new command. For that display we let hardware SPI toggle the CS line, and actually run TA<-0 and TA<-1
   // transitions to let the CS line live. For most other displays, we just set CS line always enabled for the display throughout fbcp-ili9341 lifetime,
   // which is a tiny bit faster.
-  // printf("SPI Running Task BEGIN SPI COMMUNICATION!");
-  begin_spi_communication(spi);
-
-  uint8_t *tStart = task->PayloadStart();
-  uint8_t *tEnd = task->PayloadEnd();
-  const uint32_t payloadSize = tEnd - tStart;
-  uint8_t *tPrefillEnd = tStart + MIN(15, payloadSize);
-
-  // An SPI transfer to the display always starts with one control (command) byte, followed by N data bytes.
-  clear_gpio(gpio, GPIO_TFT_DATA_CONTROL);
+  loop->transport->begin();
+  spi_write_command(loop, cmd, tStart, tEnd);
+  spi_end(loop);
+}
 
-  // printf("DISPLAY SPI BuS IS NOT 16BITS WIDE!");
-  spi_write_fifo(loop, task->cmd);
+void spi_run_task(spi_loop* loop, SPITask *task) {
+  spi_flush(loop);
+  loop->transport->begin();
+  if (task->flags & SPI_TASK_WINDOW) {
+    // Fused window update: CASET, RASET and the pixel write run back to back under a single transfer
+    SPIWindow *window = task->Window();
+    if (window->casetSize) spi_write_window_command(loop, DISPLAY_SET_CURSOR_X, window->caset, window->casetSize);
+    if (window->rasetSize) spi_write_window_command(loop, DISPLAY_SET_CURSOR_Y, window->raset, window->rasetSize);
+  }
+  spi_write_command(loop, task->cmd, task->PayloadStart(), task->PayloadEnd());
 
-  while(!(spi->cs & (BCM2835_SPI0_CS_RXD|BCM2835_SPI0_CS_DONE))) /*nop*/;
+  // The pixel writes of a frame follow each other, so only the last one has to wait for its bytes to leave the bus
+  if (task->cmd == DISPLAY_WRITE_PIXELS && !(task->flags & SPI_TASK_FRAME_END)) spi_end_mid_frame(loop);
+  else spi_end(loop);
+}
 
-  set_gpio(gpio, GPIO_TFT_DATA_CONTROL);
+void spi_post_control_task(spi_loop* loop, uint8_t cmd, const uint8_t *data, uint32_t size, uint8_t flags) {
+  if (size > SPI_CONTROL_TASK_MAX_SIZE) FATAL_ERROR("Control task payload is too large!");
 
+  // The room is checked under the same lock as the push, so that producers on several threads cannot overrun the lane
+  // together. If the lane is full, wait for the SPI thread to drain it. This should practically never happen.
+  for(;;)
   {
-    while(tStart < tPrefillEnd) spi_write_fifo(loop, *tStart++);
-    while(tStart < tEnd)
+    unique_lock<mutex> guard(loop->mutex);
+    if (loop->controlTail - loop->controlHead >= SPI_CONTROL_QUEUE_SIZE)
     {
-      uint32_t cs = spi->cs;
-      if ((cs & BCM2835_SPI0_CS_TXD)) spi_write_fifo(loop, *tStart++);
-// TODO:      else asm volatile("yield");
-      if ((cs & (BCM2835_SPI0_CS_RXR|BCM2835_SPI0_CS_RXF))) spi->cs = BCM2835_SPI0_CS_CLEAR_RX | BCM2835_SPI0_CS_TA;
+      guard.unlock();
+      usleep(100);
+      continue;
     }
+    SPIControlTask *task = &loop->controlTasks[loop->controlTail % SPI_CONTROL_QUEUE_SIZE];
+    task->cmd = cmd;
+    task->flags = flags;
+    task->size = (uint8_t)size;
+    memcpy(task->data, data, size);
+    task->postTime = tick();
+    __sync_synchronize();
+    ++loop->controlTail;
+    break;
   }
+  spi_wake_thread(loop->bus); // Wake the SPI thread if it was sleeping
+}
+
+bool spi_has_control_tasks(spi_loop* loop) {
+  return loop->controlHead != loop->controlTail;
+}
+
+void spi_run_control_tasks(spi_loop* loop) {
+  while(spi_has_control_tasks(loop))
+  {
+    SPIControlTask *task = &loop->controlTasks[loop->controlHead % SPI_CONTROL_QUEUE_SIZE];
+    // Keep the lane in FIFO order: a task that waits for a frame boundary also holds back all tasks behind it.
+    if ((task->flags & SPI_CONTROL_AT_FRAME_BOUNDARY) && loop->midFrame)
+      break;
+
+#ifdef SPI_CAPTURE
+    uint64_t start = tick();
+#endif
+    spi_run_command(loop, task->cmd, task->data, task->data + task->size);
+#ifdef SPI_CAPTURE
+    CaptureSpiTask(loop->chipSelect, task->cmd, SPI_CAPTURE_CONTROL, task->data, task->size, start, tick() - start);
+#endif
+
+#ifdef STATISTICS
+    uint64_t latency = tick() - task->postTime;
+    __atomic_fetch_add(&statsControlLatencyTotalUsecs, latency, __ATOMIC_RELAXED);
+    if (latency > statsControlLatencyMaxUsecs) statsControlLatencyMaxUsecs = latency;
+    __atomic_fetch_add(&statsControlTasksRun, 1, __ATOMIC_RELAXED);
+#endif
+
+    lock_guard<mutex> guard(loop->mutex);
+    ++loop->controlHead;
+  }
+}
+
+uint32_t spi_issue_fence(spi_loop* loop, uint64_t submitTime) {
+  uint32_t fence = loop->lastIssuedFence + 1;
+  if (fence == 0) fence = 1; // Skip over the always signaled fence 0 on wraparound
+  loop->fenceSubmitTime[fence % SPI_FENCE_HISTORY_SIZE] = submitTime;
+  loop->lastIssuedFence = fence;
+  return fence;
+}
+
+void spi_signal_fence(spi_loop* loop, uint32_t fence) {
+  // Called after the transport has ended the transfer and waited for all of its bytes to leave the bus, so the frame is now fully on the panel.
+  uint64_t now = tick();
+  loop->fenceSignalTime[fence % SPI_FENCE_HISTORY_SIZE] = now;
+  __atomic_store_n(&loop->signaledFence, fence, __ATOMIC_SEQ_CST);
+  syscall(SYS_futex, &loop->signaledFence, FUTEX_WAKE, INT32_MAX, 0, 0, 0);
+  MetricsRecord(&frameLatencyMetric, now - loop->fenceSubmitTime[fence % SPI_FENCE_HISTORY_SIZE]);
+}
+
+bool spi_fence_signaled(spi_loop* loop, uint32_t fence) {
+  return (int32_t)(__atomic_load_n(&loop->signaledFence, __ATOMIC_SEQ_CST) - fence) >= 0;
+}
+
+uint64_t spi_fence_timestamp(spi_loop* loop, uint32_t fence) {
+  if (fence == 0 || !spi_fence_signaled(loop, fence)) return 0;
+  uint64_t time = loop->fenceSignalTime[fence % SPI_FENCE_HISTORY_SIZE];
+  __sync_synchronize();
+  // If the SPI thread has signaled a full round of newer fences in the meanwhile, the slot was recycled.
+  if (__atomic_load_n(&loop->signaledFence, __ATOMIC_SEQ_CST) - fence >= SPI_FENCE_HISTORY_SIZE) return 0;
+  return time;
+}
 
-  end_spi_communication(spi);
+extern volatile bool programRunning;
+
+uint64_t spi_fence_wait(spi_loop* loop, uint32_t fence) {
+  // Wake up periodically to check if the program is quitting, in which case the SPI thread might never signal.
+  const struct timespec timeout = { 0, 100 * 1000 * 1000 };
+  uint32_t signaled;
+  while(programRunning && (int32_t)((signaled = __atomic_load_n(&loop->signaledFence, __ATOMIC_SEQ_CST)) - fence) < 0)
+    syscall(SYS_futex, &loop->signaledFence, FUTEX_WAIT, signaled, &timeout, 0, 0);
+  return spi_fence_timestamp(loop, fence);
 }
 
-SharedMemory *spiTaskMemory = 0;
-volatile uint64_t spiThreadIdleUsecs = 0;
-volatile uint64_t spiThreadSleepStartTime = 0;
-volatile int spiThreadSleeping = 0;
+volatile uint64_t statsControlLatencyTotalUsecs = 0;
+volatile uint64_t statsControlLatencyMaxUsecs = 0;
+volatile uint32_t statsControlTasksRun = 0;
 double spiUsecsPerByte;
-spi_loop* loop = nullptr;
+spi_bus* spiBus = nullptr;
 
 static SPITask* spi_front_task(spi_loop* loop) {
   lock_guard<mutex> guard(loop->mutex);
-  uint32_t head = spiTaskMemory->queueHead;
-  uint32_t tail = spiTaskMemory->queueTail;
+  uint32_t head = loop->taskMemory->queueHead;
+  uint32_t tail = loop->taskMemory->queueTail;
   if (head == tail) return 0;
-  SPITask *task = (SPITask*)(spiTaskMemory->buffer + head);
+  SPITask *task = (SPITask*)(loop->taskMemory->buffer + head);
   if (task->cmd == 0) // Wrapped around?
   {
-    spiTaskMemory->queueHead = 0;
+    loop->taskMemory->queueHead = 0;
     __sync_synchronize();
     if (tail == 0) return 0;
-    task = (SPITask*)spiTaskMemory->buffer;
+    task = (SPITask*)loop->taskMemory->buffer;
   }
   return task;
 }
 
 void spi_pop_task(spi_loop* loop, SPITask* task) {
   lock_guard<mutex> guard(loop->mutex);
-  __atomic_fetch_sub(&spiTaskMemory->spiBytesQueued, task->PayloadSize()+1, __ATOMIC_RELAXED);
-  spiTaskMemory->queueHead = (uint32_t)((uint8_t*)task - spiTaskMemory->buffer) + sizeof(SPITask) + task->size;
+  __atomic_fetch_sub(&loop->taskMemory->spiBytesQueued, task->BusBytes(), __ATOMIC_RELAXED);
+  loop->taskMemory->queueHead = (uint32_t)((uint8_t*)task - loop->taskMemory->buffer) + sizeof(SPITask) + task->size;
   __sync_synchronize();
 }
 
-extern volatile bool programRunning;
+static bool spi_has_pixel_tasks(spi_loop* loop) {
+  return loop->taskMemory->queueTail != loop->taskMemory->queueHead;
+}
+
+static bool spi_bus_has_work(spi_bus* bus) {
+  for(int i = 0; i < bus->numPanels; ++i)
+    if (spi_has_pixel_tasks(bus->panels[i]) || spi_has_control_tasks(bus->panels[i])) return true;
+  return false;
+}
+
+static bool spi_bus_has_pixel_tasks(spi_bus* bus) {
+  for(int i = 0; i < bus->numPanels; ++i)
+    if (spi_has_pixel_tasks(bus->panels[i])) return true;
+  return false;
+}
 
-void spi_run_tasks(spi_loop* loop) {
-  begin_spi_communication(spi);
+uint32_t spi_bus_bytes_queued(spi_bus* bus) {
+  uint32_t bytes = 0;
+  for(int i = 0; i < bus->numPanels; ++i) bytes += bus->panels[i]->taskMemory->spiBytesQueued;
+  return bytes;
+}
+
+void spi_select_panel(spi_loop* loop) {
+  spi_bus *bus = loop->bus;
+  if (bus->selectedChip == loop->chipSelect) return;
+  bus->transport->selectChip(loop->chipSelect);
+  bus->selectedChip = loop->chipSelect;
+}
+
+// Gives one panel its turn on the bus: its control tasks, and pixel tasks up to its share of SPI_ARBITER_QUANTUM_BYTES.
+static void spi_run_panel_tasks(spi_loop* loop) {
+  if (!spi_has_pixel_tasks(loop) && !spi_has_control_tasks(loop))
   {
-    while(programRunning && spiTaskMemory->queueTail != spiTaskMemory->queueHead)
+    loop->deficitBytes = 0; // A panel that has nothing to send does not save up turns
+    return;
+  }
+
+  spi_select_panel(loop);
+  loop->deficitBytes += SPI_ARBITER_QUANTUM_BYTES;
+#ifdef FRAME_TRACING
+  // A frame can take thousands of tasks, so the tasks of a turn are traced together
+  TRACE_BEGIN(turnStart);
+  uint32_t turnBytes = 0;
+#endif
+  while(programRunning)
+  {
+    spi_run_control_tasks(loop);
+
+    SPITask *task = spi_front_task(loop);
+    if (!task)
     {
-      SPITask *task = spi_front_task(loop);
-      if (task)
-      {
-        spi_run_task(loop, task);
-        spi_pop_task(loop, task);
-      }
+      loop->deficitBytes = 0;
+      break;
     }
+    uint32_t bytes = task->BusBytes();
+    if (bytes > loop->deficitBytes) break; // Continues on the next turn
+
+#ifdef SPI_CAPTURE
+    uint64_t start = tick();
+#endif
+    spi_run_task(loop, task);
+#ifdef SPI_CAPTURE
+    CaptureSpiTask(loop->chipSelect, task->cmd, task->flags, task->data, task->size, start, tick() - start);
+#endif
+#ifdef FRAME_TRACING
+    turnBytes += bytes;
+#endif
+    loop->deficitBytes -= bytes;
+    loop->midFrame = !(task->flags & SPI_TASK_FRAME_END);
+    uint32_t fence = task->fence;
+    spi_pop_task(loop, task);
+    __atomic_fetch_add(&loop->bytesSent, bytes, __ATOMIC_RELAXED);
+    if (fence) spi_signal_fence(loop, fence);
+    if (!loop->midFrame) __atomic_fetch_add(&loop->framesSent, 1, __ATOMIC_RELAXED);
   }
-  end_spi_communication(spi);
+#ifdef FRAME_TRACING
+  if (turnBytes) TRACE_END(turnStart, "spi_run_task", turnBytes);
+#endif
 }
 
-void spi_write_fifo(spi_loop* loop, uint8_t word) {
-  loop->spi->fifo = word;
-  DEBUG_PRINT_WRITTEN_BYTE(w);
+// Every task begins and ends its own transfer, so in between tasks the bus is idle and the arbiter is free to switch
+// the chip select over to another panel.
+void spi_run_tasks(spi_bus* bus) {
+  while(programRunning && spi_bus_has_work(bus))
+  {
+    for(int i = 0; i < bus->numPanels; ++i)
+      spi_run_panel_tasks(bus->panels[i]);
+
+    if (!spi_bus_has_pixel_tasks(bus) && spi_bus_has_work(bus))
+    {
+      // Only control tasks that wait for the frame boundary are left, and the rest of their frame has not been
+      // produced yet. Don't spin at full speed waiting for it.
+      SPI_THREAD_ENTER(SPI_THREAD_STALLED);
+      usleep(100);
+      SPI_THREAD_ENTER(SPI_THREAD_TRANSMITTING);
+    }
+  }
 }
 
 pthread_t spiThread;
@@ -203,22 +455,40 @@ pthread_t spiThread;
 void *spi_thread(void *unused)
 {
   printf("SPI Worket Thread is created!\n");
+  SetThreadScheduling("fbcp-spi", SPI_THREAD_POLICY, SPI_THREAD_PRIORITY, SPI_THREAD_CPU);
+#ifdef STATISTICS
+  spi_thread_time_reset(); // Of the transfers of the display init, which ran on the main thread
+#endif
   while(programRunning)
   {
-    if (spiTaskMemory->queueTail != spiTaskMemory->queueHead)
+    // Snapshot the wakeup counter before checking for work, so that a task posted in between the check and
+    // the futex wait makes the wait return immediately instead of being missed.
+    uint32_t wakeups = __atomic_load_n(&spiBus->wakeups, __ATOMIC_SEQ_CST);
+    if (spi_bus_has_work(spiBus))
     {
-      spi_run_tasks(loop);
+      spi_run_tasks(spiBus);
     }
     else
     {
-      if (programRunning) syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAIT, spiTaskMemory->queueHead, 0, 0, 0); // Start sleeping until we get new tasks
+      // Wake ups from while the thread was busy do not count towards its latency
+      __atomic_store_n(&spiBus->wakeTime, 0, __ATOMIC_SEQ_CST);
+      SPI_THREAD_ENTER(SPI_THREAD_SLEEPING);
+      if (programRunning) syscall(SYS_futex, &spiBus->wakeups, FUTEX_WAIT, wakeups, 0, 0, 0); // Start sleeping until we get new tasks
+      SPI_THREAD_ENTER(SPI_THREAD_TRANSMITTING);
+      uint64_t wakeTime = __atomic_exchange_n(&spiBus->wakeTime, 0, __ATOMIC_SEQ_CST);
+      if (wakeTime) AddSchedLatencySample(&spiThreadLatency, tick() - wakeTime);
     }
   }
   pthread_exit(0);
 }
 
-int InitSPI()
+int InitSPI(int numPanels, SpiTransport *(*createTransport)())
 {
+  if (numPanels < 1 || numPanels > SPI_MAX_PANELS) FATAL_ERROR("Unsupported number of panels on the SPI bus!");
+
+#ifdef USE_VIDEOCORE
+  OpenMailbox();
+
   // Userland version
   // Memory map GPIO and SPI peripherals for direct access
   mem_fd = open("/dev/mem", O_RDWR|O_SYNC);
@@ -233,53 +503,51 @@ int InitSPI()
 
     printf("Timer is not 32 bit mode\n");
     systemTimerRegister = (volatile TIMER_TYPE*)((uintptr_t)bcm2835 + BCM2835_TIMER_BASE + 0x04); // Generates an unaligned 64-bit pointer, but seems to be fine.
+  if (tickClock != TICK_CLOCK_VIRTUAL) SetTickClock(TICK_CLOCK_BCM2835_TIMER);
 
   // TODO: On graceful shutdown, (ctrl-c signal?) close(mem_fd)
 
   uint32_t currentBcmCoreSpeed = MailboxRet2(0x00030002/*Get Clock Rate*/, 0x4/*CORE*/);
   uint32_t maxBcmCoreTurboSpeed = MailboxRet2(0x00030004/*Get Max Clock Rate*/, 0x4/*CORE*/);
+#else
+  uint32_t currentBcmCoreSpeed = SPI_NOMINAL_CORE_FREQUENCY;
+  uint32_t maxBcmCoreTurboSpeed = SPI_NOMINAL_CORE_FREQUENCY;
+#endif
 
   // Estimate how many microseconds transferring a single byte over the SPI bus takes?
   spiUsecsPerByte = 1000000.0 * 8.0/*bits/byte*/ * SPI_BUS_CLOCK_DIVISOR / maxBcmCoreTurboSpeed;
 
   printf("BCM core speed: current: %uhz, max turbo: %uhz. SPI CDIV: %d, SPI max frequency: %.0fhz\n", currentBcmCoreSpeed, maxBcmCoreTurboSpeed, SPI_BUS_CLOCK_DIVISOR, (double)maxBcmCoreTurboSpeed / SPI_BUS_CLOCK_DIVISOR);
 
-  // By default all GPIO pins are in input mode (0x00), initialize them for SPI and GPIO writes
-  set_gpio_mode(gpio, GPIO_TFT_DATA_CONTROL, 0x01); // Data/Control pin to output (0x01)
-  set_gpio_mode(gpio, GPIO_SPI0_MISO, 0x04);
-  set_gpio_mode(gpio, GPIO_SPI0_MOSI, 0x04);
-  set_gpio_mode(gpio, GPIO_SPI0_CLK, 0x04);
-  // The Adafruit 1.65" 240x240 ST7789 based display is unique compared to others that it does want to see the Chip Select line go
-  // low and high to start a new command. For that display we let hardware SPI toggle the CS line, and actually run TA<-0 and TA<-1
-  // transitions to let the CS line live. For most other displays, we just set CS line always enabled for the display throughout
-  // fbcp-ili9341 lifetime, which is a tiny bit faster.
-  set_gpio_mode(gpio, GPIO_SPI0_CE0, 0x04);
-
-  spi->cs = BCM2835_SPI0_CS_CLEAR; // Initialize the Control and Status register to defaults: CS=0 (Chip Select), CPHA=0 (Clock Phase), CPOL=0 (Clock Polarity), CSPOL=0 (Chip Select Polarity), TA=0 (Transfer not active), and reset TX and RX queues.
-  spi->clk = SPI_BUS_CLOCK_DIVISOR; // Clock Divider determines SPI bus speed, resulting speed=256MHz/clk
-
-  // Initialize SPI thread task buffer memory
-
-  spiTaskMemory = (SharedMemory*)Malloc(SHARED_MEMORY_SIZE, "spi.cpp shared task memory");
-  spiTaskMemory->queueHead = spiTaskMemory->queueTail = spiTaskMemory->spiBytesQueued = 0;
-  printf("SPI Loop is under creating!\n");
-  loop = new spi_loop(); //(spi_loop*)Malloc(sizeof(spi_loop), "spi loop");
-  loop->spi = spi;
-  printf("SPI LOOP is created\n");
-  if (loop == nullptr) {
-    printf("SPI LOOP IS NOT CREATED!\n");
-  }
-
-  // Enable fast 8 clocks per byte transfer mode, instead of slower 9 clocks per byte.
-  UNLOCK_FAST_8_CLOCKS_SPI();
+  spiBus = new spi_bus();
+  spiBus->transport = createTransport(); // Takes over the SPI and GPIO pins
+  spiBus->selectedChip = 0;
 
-  printf("Initializing display\n");
+  // Initialize a task buffer for each panel
+  for(int i = 0; i < numPanels; ++i)
+  {
+    spi_loop *loop = new spi_loop();
+    loop->bus = spiBus;
+    loop->transport = spiBus->transport;
+    loop->chipSelect = i;
+    loop->taskMemory = (SharedMemory*)Malloc(SHARED_MEMORY_SIZE, "spi.cpp shared task memory");
+    loop->taskMemory->queueHead = loop->taskMemory->queueTail = loop->taskMemory->spiBytesQueued = 0;
+    spiBus->panels[spiBus->numPanels++] = loop;
+  }
 
-  init_st7789V();
-  // InitSPIDisplay();
+  // The panels share the reset line, so reset them all at once before initializing any of them
+  spiBus->transport->resetDisplay();
+  for(int i = 0; i < spiBus->numPanels; ++i)
+  {
+    printf("Initializing display on chip select %d\n", i);
+    init_st7789V(spiBus->panels[i]);
+  }
 
   // Create a dedicated thread to feed the SPI bus. While this is fast, it consumes a lot of CPU. It would be best to replace
   // this thread with a kernel module that processes the created SPI task queue using interrupts. (while juggling the GPIO D/C line as well)
+#ifdef SPI_CAPTURE
+  StartSpiCapture(SPI_CAPTURE_FILE, spiBus->numPanels); // Of the tasks of the SPI thread, the display init above is not captured
+#endif
   printf("Creating SPI task thread\n");
   int rc = pthread_create(&spiThread, NULL, spi_thread, NULL); // After creating the thread, it is assumed to have ownership of the SPI bus, so no SPI chat on the main thread after this.
   if (rc != 0) FATAL_ERROR("Failed to create SPI thread!");
@@ -293,21 +561,28 @@ void DeinitSPI()
   // printf("Deinit SPI Thread is called!\n");
   pthread_join(spiThread, NULL);
   spiThread = (pthread_t)0;
+#ifdef SPI_CAPTURE
+  StopSpiCapture();
+#endif
+#ifdef SPI_TRANSPORT_EMULATOR
+  DumpEmulatedPanels(EMULATOR_PNG_FILE); // Now that the SPI thread is gone, GRAM holds whatever it sent
+#endif
   // DeinitSPIDisplay();
 
-  spi->cs = BCM2835_SPI0_CS_CLEAR;
-
-#ifdef GPIO_TFT_DATA_CONTROL
-  set_gpio_mode(gpio, GPIO_TFT_DATA_CONTROL, 0);
-#endif
-  set_gpio_mode(gpio, GPIO_SPI0_CE1, 0);
-  set_gpio_mode(gpio, GPIO_SPI0_CE0, 0);
-  set_gpio_mode(gpio, GPIO_SPI0_MISO, 0);
-  set_gpio_mode(gpio, GPIO_SPI0_MOSI, 0);
-  set_gpio_mode(gpio, GPIO_SPI0_CLK, 0);
+  delete spiBus->transport; // Releases the SPI and GPIO pins
+  for(int i = 0; i < spiBus->numPanels; ++i)
+  {
+    free(spiBus->panels[i]->taskMemory);
+    delete spiBus->panels[i];
+  }
+  delete spiBus;
+  spiBus = 0;
 
+#ifdef USE_VIDEOCORE
   if (bcm2835)
   {
+    if (tickClock == TICK_CLOCK_BCM2835_TIMER) SetTickClock(TICK_CLOCK_MONOTONIC);
+    systemTimerRegister = 0;
     munmap((void*)bcm2835, bcm_host_get_peripheral_size());
     bcm2835 = 0;
   }
@@ -317,8 +592,6 @@ void DeinitSPI()
     close(mem_fd);
     mem_fd = -1;
   }
-
-
-  free(spiTaskMemory);
-  spiTaskMemory = 0;
+  CloseMailbox();
+#endif
 }
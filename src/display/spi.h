@@ -8,7 +8,7 @@
 
 #include "display.h"
 #include "tick.h"
-#include "display.h"
+#include "spi_transport.h"
 #include <mutex>
 
 using namespace std;
@@ -77,6 +77,10 @@ typedef struct SPIRegisterFile
 } SPIRegisterFile;
 extern volatile SPIRegisterFile *spi;
 
+// Nominal VideoCore core clock that SPI_BUS_CLOCK_DIVISOR divides down to the SPI bus speed (core_freq=400 on Pi 3B). Only used
+// to convert the divisor to a bus speed when the actual core clock can not be queried from the VideoCore mailbox.
+#define SPI_NOMINAL_CORE_FREQUENCY 400000000
+
 // Defines the size of the SPI task memory buffer in bytes. This memory buffer can contain two frames worth of tasks at maximum,
 // so for best performance, should be at least ~DISPLAY_WIDTH*DISPLAY_HEIGHT*BYTES_PER_PIXEL*2 bytes in size, plus some small
 // amount for structuring each SPITask command. Technically this can be something very small, like 4096b, and not need to contain
@@ -89,30 +93,116 @@ extern volatile SPIRegisterFile *spi;
 // Defines the maximum size of a single SPI task, in bytes. This excludes the command byte. If MAX_SPI_TASK_SIZE
 // is not defined, there is no length limit that applies. (In ALL_TASKS_SHOULD_DMA version of DMA transfer,
 // there is DMA chaining, so SPI tasks can be arbitrarily long)
-#define MAX_SPI_TASK_SIZE 65528
+// The SPI thread only services the control command lane in between tasks, so this is also the upper bound on how
+// many bytes a control command may have to wait behind: 8KB is ~3.3msecs at CDIV=20 on a 400MHz core.
+#define MAX_SPI_TASK_SIZE 8192
+
+// SPITask::flags
+#define SPI_TASK_FRAME_END 0x01 // This is the last task of a frame, after it the display contents are consistent
+#define SPI_TASK_WINDOW    0x02 // The task data starts with an SPIWindow header that is sent before the command
+
+// Column/row address window update that is fused in front of a pixel write task, so that a span costs one task
+// (and one pass through the ring) instead of up to three separate CASET, RASET and RAMWR tasks.
+typedef struct __attribute__((packed)) SPIWindow
+{
+  uint8_t casetSize; // 0: column window is not changed, 2: only the start column is set, 4: start and end columns are set
+  uint8_t rasetSize; // 0: row window is not changed, 2: only the start row is set, 4: start and end rows are set
+  uint8_t caset[4];
+  uint8_t raset[4];
+} SPIWindow;
 
 typedef struct __attribute__((packed)) SPITask
 {
-  uint32_t size; // Size, including both 8-bit and 9-bit tasks
+  uint32_t size; // Size, including both 8-bit and 9-bit tasks, and the SPIWindow header if present
   uint8_t cmd;
+  uint8_t flags;
+  uint32_t fence; // If SPI_TASK_FRAME_END is set, the fence that is signaled once this task has left the FIFO
   uint32_t dmaSpiHeader;
   uint8_t data[]; // Contains both 8-bit and 9-bit tasks back to back, 8-bit first, then 9-bit.
-  inline uint8_t *PayloadStart() { return data; }
+  inline uint32_t HeaderSize() const { return (flags & SPI_TASK_WINDOW) ? sizeof(SPIWindow) : 0; }
+  inline SPIWindow *Window() { return (SPIWindow*)data; }
+  inline uint8_t *PayloadStart() { return data + HeaderSize(); }
   inline uint8_t *PayloadEnd() { return data + size; }
-  inline uint32_t PayloadSize() const { return size; }
+  inline uint32_t PayloadSize() const { return size - HeaderSize(); }
+  // Number of bytes this task puts on the bus, including the command bytes
+  inline uint32_t BusBytes() { return PayloadSize() + 1 + ((flags & SPI_TASK_WINDOW) ? (Window()->casetSize ? 1 + Window()->casetSize : 0) + (Window()->rasetSize ? 1 + Window()->rasetSize : 0) : 0); }
   inline uint32_t *DmaSpiHeaderAddress() { return &dmaSpiHeader; }
 } SPITask;
 
+// Control commands (sleep in/out, brightness, MADCTL, ...) do not go through the pixel task ring, but through
+// a small high priority lane that the SPI thread drains in between pixel tasks, so that they do not need to wait
+// behind several frames worth of pixel data.
+#define SPI_CONTROL_QUEUE_SIZE 16
+#define SPI_CONTROL_TASK_MAX_SIZE 16
+
+// SPIControlTask::flags
+#define SPI_CONTROL_ASAP 0x00              // Run at the next task boundary, possibly in the middle of a frame
+#define SPI_CONTROL_AT_FRAME_BOUNDARY 0x01 // Run only after the frame currently being transmitted has been finished
+
+// How many of the most recent fences remember their submit and on-glass timestamps
+#define SPI_FENCE_HISTORY_SIZE 16
+
+// Most panels that can share the SPI bus, one per chip select line
+#define SPI_MAX_PANELS SPI_NUM_CHIP_SELECTS
+
+// When several panels share the bus, the SPI thread serves them in turns, giving each panel up to this many bus bytes
+// per turn (deficit round robin: a task that does not fit in the rest of the turn waits for the panel's next turn,
+// and the unused credit carries over). One task's worth keeps the panels evenly interleaved, while the chip select
+// switches between them stay rare compared to the bytes sent.
+#define SPI_ARBITER_QUANTUM_BYTES MAX_SPI_TASK_SIZE
+
+typedef struct SPIControlTask
+{
+  uint8_t cmd;
+  uint8_t flags;
+  uint8_t size;
+  uint8_t data[SPI_CONTROL_TASK_MAX_SIZE];
+  uint64_t postTime; // tick() when the task was posted, for measuring command to bus latency
+} SPIControlTask;
+
+struct spi_bus;
+
+// One panel on the SPI bus: its pixel task ring, control lane and frame fences. Each panel has its own producer (a Gpu),
+// and the SPI thread of the bus is the consumer of all of them.
 struct spi_loop {
   std::mutex mutex;
-  volatile SPIRegisterFile* spi;
+  spi_bus *bus;
+  SpiTransport *transport; // The transport of the bus, shared by all panels on it
+  struct SharedMemory *taskMemory; // The pixel task ring of this panel
+  uint8_t chipSelect; // 0: CE0, 1: CE1
+  uint32_t deficitBytes; // SPI thread only: bus bytes that the panel may still send in its current turn
+
+  SPIControlTask controlTasks[SPI_CONTROL_QUEUE_SIZE];
+  volatile uint32_t controlHead; // Free running indices, task i lives at controlTasks[i % SPI_CONTROL_QUEUE_SIZE]
+  volatile uint32_t controlTail;
+  bool midFrame; // SPI thread only: true if some, but not all of the tasks of the current frame have been sent
+
+  // Frame completion fences. Fence IDs increase monotonically starting from 1, and fence 0 is always signaled.
+  uint32_t lastIssuedFence;
+  volatile uint32_t signaledFence; // Futex word: the most recent fence whose frame has fully left the FIFO
+  uint64_t fenceSubmitTime[SPI_FENCE_HISTORY_SIZE];
+  uint64_t fenceSignalTime[SPI_FENCE_HISTORY_SIZE];
+
+  // Running totals of what the SPI thread has sent to this panel, for the per panel statistics
+  volatile uint64_t bytesSent;
+  volatile uint32_t framesSent;
+};
+
+// The SPI bus and the panels that share it. A single SPI thread drains the rings of all panels.
+struct spi_bus {
+  SpiTransport *transport; // All bytes to the displays go through this
+  spi_loop *panels[SPI_MAX_PANELS];
+  int numPanels;
+  int selectedChip; // SPI thread only: chip select of the panel that the transport currently talks to
+  volatile uint32_t wakeups; // Futex word that the SPI thread sleeps on, bumped by spi_wake_thread()
+  volatile uint64_t wakeTime; // tick() of the first wake up since the SPI thread went to sleep, for its scheduling latency
 };
-extern spi_loop* loop;
+extern spi_bus *spiBus;
 
 
-// A convenience for defining and dispatching SPI task bytes inline
+// A convenience for defining and dispatching SPI task bytes inline, to the panel of the spi_loop *loop in scope
 #define SPI_TRANSFER(command, ...) do { \
-    char data_buffer[] = { __VA_ARGS__ }; \
+    uint8_t data_buffer[] = { __VA_ARGS__ }; \
     SPITask *t = spi_create_task(loop, sizeof(data_buffer)); \
     t->cmd = (command); \
     memcpy(t->data, data_buffer, sizeof(data_buffer)); \
@@ -122,13 +212,19 @@ extern spi_loop* loop;
   } while(0)
 
 #define QUEUE_SPI_TRANSFER(command, ...) do { \
-    char data_buffer[] = { __VA_ARGS__ }; \
+    uint8_t data_buffer[] = { __VA_ARGS__ }; \
     SPITask *t = spi_create_task(loop, sizeof(data_buffer)); \
     t->cmd = (command); \
     memcpy(t->data, data_buffer, sizeof(data_buffer)); \
     spi_commit_task(loop, t); \
   } while(0)
 
+// Like QUEUE_SPI_TRANSFER, but posts the command to the high priority control lane
+#define QUEUE_CONTROL_SPI_TRANSFER(flags, command, ...) do { \
+    uint8_t data_buffer[] = { __VA_ARGS__ }; \
+    spi_post_control_task(loop, (command), data_buffer, sizeof(data_buffer), (flags)); \
+  } while(0)
+
 typedef struct SharedMemory
 {
   volatile uint32_t queueHead;
@@ -139,27 +235,61 @@ typedef struct SharedMemory
   volatile uint8_t buffer[];
 } SharedMemory;
 
-extern SharedMemory *spiTaskMemory;
 extern double spiUsecsPerByte;
 
 extern SharedMemory *dmaSourceMemory; // TODO: Optimize away the need to have this at all, instead DMA directly from SPI ring buffer if possible
 
 #ifdef STATISTICS
-extern volatile uint64_t spiThreadIdleUsecs;
-extern volatile uint64_t spiThreadSleepStartTime;
-extern volatile int spiThreadSleeping;
+// Where the time of the SPI thread goes. TRANSMITTING covers running tasks, including waits for room in the FIFO
+// while writing bytes, which cannot be told apart from the writes without a tick() per byte. POLLING is waiting for
+// the written bytes to leave the bus before the D/C line may flip or the transfer may end. STALLED is waiting for the
+// rest of a frame that a control task is held back for, and SLEEPING is waiting for new tasks.
+enum SpiThreadState
+{
+  SPI_THREAD_TRANSMITTING,
+  SPI_THREAD_POLLING,
+  SPI_THREAD_STALLED,
+  SPI_THREAD_SLEEPING,
+  SPI_THREAD_NUM_STATES
+};
+extern const char *const spiThreadStateNames[SPI_THREAD_NUM_STATES];
+
+// Usecs that the SPI thread has spent in each state since it started, counting in the state it is in now
+void spi_thread_time(uint64_t usecs[SPI_THREAD_NUM_STATES]);
+// Prints the share of each state of the SPI thread, and the share of the time that the bus was clocking out bytes
+void PrintSpiThreadTime();
+extern volatile uint64_t statsControlLatencyTotalUsecs;
+extern volatile uint64_t statsControlLatencyMaxUsecs;
+extern volatile uint32_t statsControlTasksRun;
 #endif
 
 extern int mem_fd;
 
 SPITask* spi_create_task(spi_loop* loop, uint32_t bytes);
+void spi_wake_thread(spi_bus* bus);
 void spi_commit_task(spi_loop* loop, SPITask *task); // Advertises the given SPI task from main thread to worker, called on main thread
-void spi_run_tasks(spi_loop* loop);
-static SPITask* spi_front_task(spi_loop* loop);
+void spi_run_tasks(spi_bus* bus); // Called on the SPI thread, serves the panels in turns until all of them are out of work
 void spi_run_task(spi_loop* loop, SPITask *task);
 void spi_pop_task(spi_loop* loop, SPITask *task);
+// Points the transport to the panel of the given loop. Called in between transfers.
+void spi_select_panel(spi_loop* loop);
+// Payload bytes queued on all panels of the bus, i.e. how far behind the bus is
+uint32_t spi_bus_bytes_queued(spi_bus* bus);
+
+// Posts a control command to the high priority lane. May be called from any thread. Blocks only if the lane is full.
+void spi_post_control_task(spi_loop* loop, uint8_t cmd, const uint8_t *data, uint32_t size, uint8_t flags);
+bool spi_has_control_tasks(spi_loop* loop);
+void spi_run_control_tasks(spi_loop* loop); // Called on the SPI thread in between pixel tasks
 
-void spi_write_fifo(spi_loop* loop, uint8_t word);
+// Allocates the fence for a frame that was submitted at the given time. The producer attaches the fence to the last task
+// of the frame, and the SPI thread signals it after the last byte of that task has left the FIFO.
+uint32_t spi_issue_fence(spi_loop* loop, uint64_t submitTime);
+void spi_signal_fence(spi_loop* loop, uint32_t fence); // Called on the SPI thread
+bool spi_fence_signaled(spi_loop* loop, uint32_t fence);
+// Blocks until the fence is signaled, and returns the tick() time when its frame was fully on the bus (0 if no longer known)
+uint64_t spi_fence_wait(spi_loop* loop, uint32_t fence);
+// Returns the on-glass timestamp of a signaled fence, or 0 if the fence has not been signaled yet (or is too old to remember)
+uint64_t spi_fence_timestamp(spi_loop* loop, uint32_t fence);
 
 #define IN_SINGLE_THREADED_MODE_RUN_TASK() ((void)0)
 
@@ -169,6 +299,9 @@ void spi_write_fifo(spi_loop* loop, uint8_t word);
 //   DoneTask(t); \
 // }
 
-int InitSPI(void);
+// Creates the SPI transport, initializes numPanels displays on chip selects 0...numPanels-1 and starts the SPI thread.
+// The panels are then available as spiBus->panels[i]. The transport is created with the given function after the
+// BCM2835 peripherals have been mapped, so the bench tools can swap in their own transports.
+int InitSPI(int numPanels = 1, SpiTransport *(*createTransport)() = CreateSpiTransport);
 uint8_t st7789_interface_spi_init();
 void DeinitSPI(void);
@@ -0,0 +1,247 @@
+#include <linux/futex.h> // FUTEX_WAIT, FUTEX_WAKE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/syscall.h> // SYS_futex
+#include <unistd.h>
+#include <thread>
+
+#include "config.h"
+#include "display.h"
+#include "spi_capture.h"
+#include "tick.h"
+#include "util.h"
+
+static bool ReadVarint(FILE *handle, uint64_t *value)
+{
+  *value = 0;
+  for(int shift = 0; shift < 64; shift += 7)
+  {
+    int c = fgetc(handle);
+    if (c == EOF) return false;
+    *value |= (uint64_t)(c & 0x7F) << shift;
+    if (!(c & 0x80)) return true;
+  }
+  return false;
+}
+
+bool ReadSpiCaptureHeader(FILE *handle, SpiCaptureHeader *header)
+{
+  if (fread(header, sizeof(SpiCaptureHeader), 1, handle) != 1) return false;
+  return !memcmp(header->magic, SPI_CAPTURE_MAGIC, sizeof(SPI_CAPTURE_MAGIC)) && header->version == SPI_CAPTURE_VERSION;
+}
+
+bool ReadSpiCaptureRecord(FILE *handle, SpiCaptureRecord *record, uint8_t *data)
+{
+  int flags = fgetc(handle);
+  int cmd = fgetc(handle);
+  uint64_t startDelta, duration, size;
+  if (flags == EOF || cmd == EOF || !ReadVarint(handle, &startDelta) || !ReadVarint(handle, &duration) || !ReadVarint(handle, &size)) return false;
+  record->flags = (uint8_t)flags;
+  record->cmd = (uint8_t)cmd;
+  record->chipSelect = (flags & SPI_CAPTURE_CHIP_SELECT_1) ? 1 : 0;
+  record->start += startDelta;
+  record->duration = duration;
+  record->size = (uint32_t)size;
+  if (flags & SPI_CAPTURE_GAP) return true;
+  if (size > SPI_CAPTURE_MAX_DATA_SIZE) return false;
+  return fread(data, 1, size, handle) == size;
+}
+
+#ifdef SPI_CAPTURE
+
+// Two buffers are passed between the SPI thread and the writer thread without a lock: the SPI thread appends to
+// captureFilling and publishes its size after each record. When the buffer is full, it hands it over in captureFull
+// and goes on with the other one, which the writer gave back by clearing captureFull. A handover wakes the writer through
+// a futex, like new tasks wake the SPI thread.
+struct CaptureBuffer
+{
+  uint8_t *data;
+  uint32_t size; // Bytes of whole records, written by the SPI thread only while the buffer is being filled
+};
+
+static FILE *captureFile = 0;
+static std::thread captureWriter;
+static CaptureBuffer captureBuffers[2];
+static CaptureBuffer *captureFilling = 0; // Written by the SPI thread
+static CaptureBuffer *captureFull = 0; // Set by the SPI thread, cleared by the writer once it has written the buffer out
+static bool captureStopping = false;
+static uint32_t captureWakeups = 0; // Futex that the writer sleeps on, bumped on every handover and on stop
+static uint64_t captureStartTime = 0;
+static uint64_t capturePreviousStart = 0; // Of the previous record, relative to captureStartTime
+static uint32_t captureDropped = 0;
+static uint64_t captureTotalDropped = 0;
+
+static uint8_t *WriteVarint(uint8_t *out, uint64_t value)
+{
+  while(value >= 0x80)
+  {
+    *out++ = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  *out++ = (uint8_t)value;
+  return out;
+}
+
+static uint8_t *WriteRecordHeader(uint8_t *out, uint8_t flags, uint8_t cmd, uint64_t startDelta, uint64_t duration, uint32_t size)
+{
+  *out++ = flags;
+  *out++ = cmd;
+  out = WriteVarint(out, startDelta);
+  out = WriteVarint(out, duration);
+  return WriteVarint(out, size);
+}
+
+static void WriteCapture(const uint8_t *data, uint32_t size)
+{
+  if (size == 0) return;
+  if (fwrite(data, 1, size, captureFile) != size) printf("SPI capture: write failed\n");
+  fflush(captureFile);
+}
+
+static void WakeCaptureWriter()
+{
+  __atomic_fetch_add(&captureWakeups, 1, __ATOMIC_SEQ_CST);
+  syscall(SYS_futex, &captureWakeups, FUTEX_WAKE, 1, 0, 0, 0);
+}
+
+// Writes out the full buffers. When idle, it also writes out the records that are already in the buffer being filled
+// once a second, as those are never changed again, so that a capture of a process that is killed loses at most a
+// second's worth of tasks.
+static void CaptureWriterThread()
+{
+  pthread_setname_np(pthread_self(), "fbcp-capture");
+  CaptureBuffer *partial = 0; // The buffer of which the first partialSize bytes have been written already
+  uint32_t partialSize = 0;
+  for(;;)
+  {
+    uint32_t wakeups = __atomic_load_n(&captureWakeups, __ATOMIC_SEQ_CST);
+    // DeinitSPI() joins the SPI thread before stopping the capture, so once this is seen, the buffers are final
+    bool stopping = __atomic_load_n(&captureStopping, __ATOMIC_ACQUIRE);
+
+    CaptureBuffer *full = __atomic_load_n(&captureFull, __ATOMIC_ACQUIRE);
+    if (full)
+    {
+      uint32_t written = (full == partial) ? partialSize : 0;
+      WriteCapture(full->data + written, full->size - written);
+      partial = 0;
+      full->size = 0;
+      __atomic_store_n(&captureFull, (CaptureBuffer*)0, __ATOMIC_RELEASE);
+    }
+
+    if (!full || stopping)
+    {
+      // The buffer being filled cannot be handed over and recycled meanwhile, as only this thread gives buffers back.
+      // If a buffer was partially written and is now full, it is written out on the next round first.
+      CaptureBuffer *filling = __atomic_load_n(&captureFilling, __ATOMIC_ACQUIRE);
+      if (!partial || partial == filling)
+      {
+        uint32_t size = __atomic_load_n(&filling->size, __ATOMIC_ACQUIRE);
+        uint32_t written = (filling == partial) ? partialSize : 0;
+        WriteCapture(filling->data + written, size - written);
+        partial = filling;
+        partialSize = size;
+      }
+    }
+
+    if (stopping) break;
+    // If a handover or the stop came after wakeups was read, the wait returns immediately instead of being missed
+    if (!__atomic_load_n(&captureFull, __ATOMIC_ACQUIRE))
+    {
+      struct timespec timeout = { 1, 0 };
+      syscall(SYS_futex, &captureWakeups, FUTEX_WAIT, wakeups, &timeout, 0, 0);
+    }
+  }
+}
+
+void StartSpiCapture(const char *path, int numPanels)
+{
+  captureFile = fopen(path, "wb");
+  if (!captureFile)
+  {
+    printf("SPI capture: could not open %s for writing\n", path);
+    return;
+  }
+  for(int i = 0; i < 2; ++i)
+  {
+    captureBuffers[i].data = (uint8_t*)malloc(SPI_CAPTURE_BUFFER_SIZE);
+    if (!captureBuffers[i].data) FATAL_ERROR("Failed to allocate the SPI capture buffers!");
+    captureBuffers[i].size = 0;
+  }
+  captureFilling = &captureBuffers[0];
+  captureFull = 0;
+  captureStopping = false;
+  captureWakeups = 0;
+  captureStartTime = tick();
+  capturePreviousStart = 0;
+  captureDropped = 0;
+  captureTotalDropped = 0;
+
+  SpiCaptureHeader header = {};
+  memcpy(header.magic, SPI_CAPTURE_MAGIC, sizeof(SPI_CAPTURE_MAGIC));
+  header.version = SPI_CAPTURE_VERSION;
+  header.displayWidth = DISPLAY_WIDTH;
+  header.displayHeight = DISPLAY_HEIGHT;
+  header.busClockDivisor = SPI_BUS_CLOCK_DIVISOR;
+  header.numPanels = (uint8_t)numPanels;
+  header.startTime = captureStartTime;
+  fwrite(&header, sizeof(header), 1, captureFile);
+
+  captureWriter = std::thread(CaptureWriterThread);
+  printf("SPI capture: recording the command stream to %s\n", path);
+}
+
+void StopSpiCapture()
+{
+  if (!captureFile) return;
+  __atomic_store_n(&captureStopping, true, __ATOMIC_RELEASE);
+  WakeCaptureWriter();
+  captureWriter.join();
+  fclose(captureFile);
+  captureFile = 0;
+  for(int i = 0; i < 2; ++i)
+  {
+    free(captureBuffers[i].data);
+    captureBuffers[i].data = 0;
+  }
+  if (captureTotalDropped) printf("SPI capture: dropped %llu tasks, the disk could not keep up\n", (unsigned long long)captureTotalDropped);
+}
+
+#define MAX_RECORD_HEADER_SIZE (2 + 3*10)
+
+void CaptureSpiTask(uint8_t chipSelect, uint8_t cmd, uint8_t flags, const uint8_t *data, uint32_t size, uint64_t start, uint64_t duration)
+{
+  if (!captureFile) return;
+  CaptureBuffer *filling = captureFilling;
+  if (filling->size + 2 * MAX_RECORD_HEADER_SIZE + size > SPI_CAPTURE_BUFFER_SIZE)
+  {
+    if (__atomic_load_n(&captureFull, __ATOMIC_ACQUIRE))
+    {
+      // The writer is still busy with the previous buffer
+      ++captureDropped;
+      ++captureTotalDropped;
+      return;
+    }
+    __atomic_store_n(&captureFull, filling, __ATOMIC_RELEASE);
+    filling = (filling == &captureBuffers[0]) ? &captureBuffers[1] : &captureBuffers[0];
+    __atomic_store_n(&captureFilling, filling, __ATOMIC_RELEASE);
+    WakeCaptureWriter();
+  }
+
+  uint8_t *out = filling->data + filling->size;
+  if (captureDropped)
+  {
+    out = WriteRecordHeader(out, SPI_CAPTURE_GAP, 0, 0, 0, captureDropped);
+    captureDropped = 0;
+  }
+  start -= captureStartTime;
+  if (chipSelect) flags |= SPI_CAPTURE_CHIP_SELECT_1;
+  out = WriteRecordHeader(out, flags, cmd, start - capturePreviousStart, duration, size);
+  capturePreviousStart = start;
+  memcpy(out, data, size);
+  __atomic_store_n(&filling->size, (uint32_t)(out + size - filling->data), __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stdio.h>
+
+// Capture of the SPI command stream. With SPI_CAPTURE (-DSPI_CAPTURE=ON on the CMake command line), the SPI thread
+// appends every task that it runs, pixel and control tasks alike, to SPI_CAPTURE_FILE in the order that they went to
+// the bus: the panel, the command byte, the flags, the payload (with the SPIWindow header of fused window tasks), when
+// the task started and how long it took. tools/bench/spi_replay feeds a capture back through the task rings and the
+// SPI thread, at the original pace or as fast as the transport goes.
+//
+// The SPI thread only copies the task into one of two in-memory buffers, and never takes a lock: a full buffer is
+// handed to a writer thread of its own through an atomic pointer, and the SPI thread goes on with the other one. The
+// writer sleeps until a buffer is handed over, and when idle, writes out the records already in the buffer being filled
+// once a second. If
+// the disk falls behind by more than a buffer, tasks are dropped and a SPI_CAPTURE_GAP record tells how many.
+//
+// File format, all little endian: a SpiCaptureHeader, followed by records of
+//   uint8 flags, uint8 cmd, varint usecs since the start of the previous record, varint duration in usecs,
+//   varint size, size bytes of data
+// where a varint is 7 bits per byte, low bits first, with the top bit set on all but the last byte.
+#ifndef SPI_CAPTURE_FILE
+#define SPI_CAPTURE_FILE "/tmp/fbcp-capture.bin"
+#endif
+#ifndef SPI_CAPTURE_BUFFER_SIZE
+#define SPI_CAPTURE_BUFFER_SIZE (4*1024*1024)
+#endif
+
+#define SPI_CAPTURE_MAGIC "FBCPCAP"
+#define SPI_CAPTURE_VERSION 1
+#define SPI_CAPTURE_MAX_DATA_SIZE 65536 // Largest task the reader accepts, well over MAX_SPI_TASK_SIZE
+
+typedef struct __attribute__((packed)) SpiCaptureHeader
+{
+  char magic[8]; // SPI_CAPTURE_MAGIC, zero terminated
+  uint32_t version;
+  uint16_t displayWidth; // DISPLAY_WIDTH and DISPLAY_HEIGHT of the build that captured
+  uint16_t displayHeight;
+  uint32_t busClockDivisor; // SPI_BUS_CLOCK_DIVISOR of the build that captured
+  uint8_t numPanels;
+  uint8_t reserved[3];
+  uint64_t startTime; // tick() when the capture was started
+} SpiCaptureHeader;
+
+// Record flags. The low bits are the SPITask flags (SPI_TASK_FRAME_END, SPI_TASK_WINDOW).
+#define SPI_CAPTURE_CHIP_SELECT_1 0x20 // The task went to the panel on CE1 instead of CE0
+#define SPI_CAPTURE_CONTROL 0x40 // A task of the control lane
+#define SPI_CAPTURE_GAP 0x80 // Not a task: size is the number of tasks that were dropped here
+
+typedef struct SpiCaptureRecord
+{
+  uint8_t flags;
+  uint8_t cmd;
+  uint8_t chipSelect;
+  uint64_t start; // Usecs since the start of the capture
+  uint64_t duration;
+  uint32_t size;
+} SpiCaptureRecord;
+
+// Reads the header of a capture, false if the file is not a capture of this version
+bool ReadSpiCaptureHeader(FILE *handle, SpiCaptureHeader *header);
+// Reads the next record, and its data to data, which must have room for SPI_CAPTURE_MAX_DATA_SIZE bytes.
+// start accumulates over the records, so record must be zeroed before the first call. false at the end of the file.
+bool ReadSpiCaptureRecord(FILE *handle, SpiCaptureRecord *record, uint8_t *data);
+
+#ifdef SPI_CAPTURE
+// Started by InitSPI() before the SPI thread, and stopped by DeinitSPI() after it
+void StartSpiCapture(const char *path, int numPanels);
+void StopSpiCapture();
+// Appends a task that started at the given tick(), SPI thread only
+void CaptureSpiTask(uint8_t chipSelect, uint8_t cmd, uint8_t flags, const uint8_t *data, uint32_t size, uint64_t start, uint64_t duration);
+#endif
@@ -16,6 +16,7 @@
 #include "util.h"
 #include "mailbox.h"
 #include "mem_alloc.h"
+#include "metrics.h"
 
 volatile uint64_t timeWastedPollingGPU = 0;
 volatile float statsSpiBusSpeed = 0;
@@ -24,33 +25,49 @@ volatile int statsCpuFrequency = 0;
 volatile double statsCpuTemperature = 0;
 double spiThreadUtilizationRate;
 double spiBusDataRate;
+double spiBusDutyCycle;
+uint64_t spiThreadTimeInInterval[SPI_THREAD_NUM_STATES];
+static uint64_t spiThreadTimeAtLastPrint[SPI_THREAD_NUM_STATES];
+static uint64_t spiBytesSentAtLastPrint = 0;
 int statsGpuPollingWasted = 0;
 uint64_t statsBytesTransferred = 0;
 
-int frameSkipTimeHistorySize = 0;
-uint64_t frameSkipTimeHistory[FRAME_HISTORY_MAX_SIZE] = {};
+volatile uint32_t statsProgressiveFrames = 0;
+volatile uint32_t statsInterlacedFrames = 0;
+volatile uint32_t statsFramesSkipped = 0;
+static uint32_t progressiveFramesAtLastPrint = 0;
+static uint32_t interlacedFramesAtLastPrint = 0;
+static uint32_t framesSkippedAtLastPrint = 0;
+
+// Metrics at the previous refresh of the overlay, to show the values of the last refresh interval
+static MetricsSnapshot frameIntervalsAtLastPrint;
+static MetricsSnapshot frameLatenciesAtLastPrint;
 
 #ifdef FRAME_COMPLETION_TIME_STATISTICS
 
+// Ring buffer of the most recent frame submit times, newest at frameCompletionTimeHistory[frameCompletionTimeHistoryHead-1]
 #define FRAME_COMPLETION_HISTORY_MAX_SIZE 480
 uint64_t frameCompletionTimeHistory[FRAME_COMPLETION_HISTORY_MAX_SIZE] = {};
+int frameCompletionTimeHistoryHead = 0;
 int frameCompletionTimeHistorySize = 0;
+#define FRAME_COMPLETION_TIME(i) frameCompletionTimeHistory[(frameCompletionTimeHistoryHead - 1 - (i) + FRAME_COMPLETION_HISTORY_MAX_SIZE) % FRAME_COMPLETION_HISTORY_MAX_SIZE]
 
-int statsFrameIntervalsY[FRAME_COMPLETION_HISTORY_MAX_SIZE] = {};
+// Frame intervals in usecs, clamped to statsMaxFrameInterval. Mapped to graph coordinates when drawn, since each
+// panel draws the graph to its own framebuffer.
+uint64_t statsFrameIntervals[FRAME_COMPLETION_HISTORY_MAX_SIZE] = {};
 int statsFrameIntervalsSize = 0;
-int statsTargetFrameRateY = 0;
-int statsAvgFrameRateIntervalY = 0;
+uint64_t statsMaxFrameInterval = 1;
+uint64_t statsAvgFrameInterval = 0;
 
-void AddFrameCompletionTimeMarker()
+void AddFrameCompletionTimeMarker(uint64_t time)
 {
-  for(int i = frameCompletionTimeHistorySize; i >= 1; --i)
-    frameCompletionTimeHistory[i] = frameCompletionTimeHistory[i-1];
-  frameCompletionTimeHistory[0] = tick();
-  if (frameCompletionTimeHistorySize+1 < FRAME_COMPLETION_HISTORY_MAX_SIZE)
+  frameCompletionTimeHistory[frameCompletionTimeHistoryHead] = time;
+  frameCompletionTimeHistoryHead = (frameCompletionTimeHistoryHead + 1) % FRAME_COMPLETION_HISTORY_MAX_SIZE;
+  if (frameCompletionTimeHistorySize < FRAME_COMPLETION_HISTORY_MAX_SIZE)
     ++frameCompletionTimeHistorySize;
 }
 #else
-void AddFrameCompletionTimeMarker() {}
+void AddFrameCompletionTimeMarker(uint64_t) {}
 #endif
 
 char dmaChannelsText[32] = {};
@@ -65,6 +82,11 @@ char cpuTemperatureText[32] = {};
 uint16_t cpuTemperatureColor = 0;
 char gpuPollingWastedText[32] = {};
 uint16_t gpuPollingWastedColor = 0;
+char controlLatencyText[32] = {};
+char glassLatencyText[32] = {};
+char panelStatsText[SPI_MAX_PANELS][32] = {};
+static uint64_t panelBytesSentAtLastPrint[SPI_MAX_PANELS] = {};
+static uint32_t panelFramesSentAtLastPrint[SPI_MAX_PANELS] = {};
 
 char cpuMemoryUsedText[32] = {};
 char gpuMemoryUsedText[32] = {};
@@ -73,6 +95,7 @@ uint64_t statsLastPrint = 0;
 
 void UpdateStatisticsNumbers()
 {
+#ifdef USE_VIDEOCORE // The numbers below are only available from the VideoCore mailbox
   // BCM core and SPI bus speed
   int freq = (int)MailboxRet2(0x00030002/*Get Clock Rate*/, 0x4/*CORE*/);
   statsBcmCoreSpeed = freq/1000000;
@@ -83,52 +106,85 @@ void UpdateStatisticsNumbers()
 
   // Raspberry pi main CPU speed
   statsCpuFrequency = (int)MailboxRet2(0x00030002/*Get Clock Rate*/, 0x3/*ARM*/) / 1000000;
+#endif
 }
 
-void DrawStatisticsOverlay(uint16_t *framebuffer)
+// Bumped by every refresh of the overlay text, which is when the overlay layers need to be rasterised again
+static uint32_t statsOverlayGeneration = 1;
+
+// A run of pixels that the overlay covers, at offset pixels from the start of the framebuffer
+typedef struct OverlayRun
+{
+  uint32_t offset;
+  uint32_t length;
+} OverlayRun;
+
+// The overlay of a panel, rasterised once per refresh of the overlay text and copied over every frame after that. Only
+// the pixels that the text and the graph cover are kept, so the frame shows through everywhere else.
+typedef struct StatisticsOverlayLayer
+{
+  uint32_t generation; // statsOverlayGeneration that the layer was rasterised at, 0 if never
+  int width, scanlineStrideBytes, height;
+  OverlayRun *runs;
+  int numRuns;
+  uint16_t *pixels; // The colors of the covered pixels, run after run
+} StatisticsOverlayLayer;
+
+static StatisticsOverlayLayer overlayLayers[SPI_MAX_PANELS] = {};
+
+static void DrawStatisticsOverlayPixels(uint16_t *framebuffer, int width, int scanlineStrideBytes, int height, int panel)
 {
-  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, fpsText, 1, 1, fpsColor, 0);
-  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, statsFrameSkipText, strlen(fpsText)*6, 1, RGB565(31,0,0), 0);
+  DrawText(framebuffer, width, scanlineStrideBytes, height, fpsText, 1, 1, fpsColor, 0);
+  DrawText(framebuffer, width, scanlineStrideBytes, height, statsFrameSkipText, strlen(fpsText)*6, 1, RGB565(31,0,0), 0);
 
 #if DISPLAY_DRAWABLE_WIDTH > 130
 #ifdef USE_DMA_TRANSFERS
-  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, dmaChannelsText, 1, 10, RGB565(31, 44, 8), 0);
+  DrawText(framebuffer, width, scanlineStrideBytes, height, dmaChannelsText, 1, 10, RGB565(31, 44, 8), 0);
+#else
+  DrawText(framebuffer, width, scanlineStrideBytes, height, controlLatencyText, 1, 10, RGB565(20, 40, 31), 0);
 #endif
 #ifdef USE_SPI_THREAD
-  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, spiUsagePercentageText, 75, 10, spiUsageColor, 0);
+  DrawText(framebuffer, width, scanlineStrideBytes, height, spiUsagePercentageText, 75, 10, spiUsageColor, 0);
 #endif
-  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, spiBusDataRateText, 60, 1, 0xFFFF, 0);
+  DrawText(framebuffer, width, scanlineStrideBytes, height, spiBusDataRateText, 60, 1, 0xFFFF, 0);
 #endif
 
 #if DISPLAY_DRAWABLE_WIDTH > 180
-  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, spiSpeedText, 120, 1, RGB565(31,14,20), 0);
-  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, spiSpeedText2, 120, 10, RGB565(10,24,31), 0);
-  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, cpuTemperatureText, 190, 1, cpuTemperatureColor, 0);
-  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, gpuPollingWastedText, 222, 1, gpuPollingWastedColor, 0);
+  DrawText(framebuffer, width, scanlineStrideBytes, height, spiSpeedText, 120, 1, RGB565(31,14,20), 0);
+  DrawText(framebuffer, width, scanlineStrideBytes, height, spiSpeedText2, 120, 10, RGB565(10,24,31), 0);
+  DrawText(framebuffer, width, scanlineStrideBytes, height, cpuTemperatureText, 190, 1, cpuTemperatureColor, 0);
+  DrawText(framebuffer, width, scanlineStrideBytes, height, gpuPollingWastedText, 222, 1, gpuPollingWastedColor, 0);
 #endif
 
 #if (defined(DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE) && DISPLAY_DRAWABLE_HEIGHT >= 290) || (!defined(DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE) && DISPLAY_DRAWABLE_WIDTH >= 290)
-  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, cpuMemoryUsedText, 250, 1, RGB565(31,50,21), 0);
-  DrawText(framebuffer, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, gpuFrameHeight, gpuMemoryUsedText, 250, 10, RGB565(31,50,31), 0);
+  DrawText(framebuffer, width, scanlineStrideBytes, height, cpuMemoryUsedText, 250, 1, RGB565(31,50,21), 0);
+  DrawText(framebuffer, width, scanlineStrideBytes, height, gpuMemoryUsedText, 250, 10, RGB565(31,50,31), 0);
+#endif
+#if ((defined(DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE) && DISPLAY_DRAWABLE_HEIGHT >= 290) || (!defined(DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE) && DISPLAY_DRAWABLE_WIDTH >= 290)) && !defined(USE_DMA_TRANSFERS)
+  DrawText(framebuffer, width, scanlineStrideBytes, height, glassLatencyText, 250, 10, RGB565(31,50,31), 0);
 #endif
+  if (spiBus && spiBus->numPanels > 1) DrawText(framebuffer, width, scanlineStrideBytes, height, panelStatsText[panel], 1, 19, RGB565(31,63,31), 0);
 
 #ifdef FRAME_COMPLETION_TIME_STATISTICS
 
 #ifdef DISPLAY_FLIP_ORIENTATION_IN_SOFTWARE
-#define FRAMERATE_GRAPH_WIDTH gpuFrameHeight
+#define FRAMERATE_GRAPH_WIDTH height
 #define FRAMERATE_GRAPH_MIN_Y 20
-#define FRAMERATE_GRAPH_MAX_Y (gpuFrameWidth - 10)
-#define AT(x,y) ((x)*(gpuFramebufferScanlineStrideBytes>>1)+(y))
+#define FRAMERATE_GRAPH_MAX_Y (width - 10)
+#define AT(x,y) ((x)*(scanlineStrideBytes>>1)+(y))
 #else
-#define FRAMERATE_GRAPH_WIDTH gpuFrameWidth
+#define FRAMERATE_GRAPH_WIDTH width
 #define FRAMERATE_GRAPH_MIN_Y 20
-#define FRAMERATE_GRAPH_MAX_Y (gpuFrameHeight - 10)
-#define AT(x,y) ((y)*(gpuFramebufferScanlineStrideBytes>>1)+(x))
+#define FRAMERATE_GRAPH_MAX_Y (height - 10)
+#define AT(x,y) ((y)*(scanlineStrideBytes>>1)+(x))
 #endif
+#define GRAPH_Y(interval) (FRAMERATE_GRAPH_MAX_Y - (int)((FRAMERATE_GRAPH_MAX_Y - FRAMERATE_GRAPH_MIN_Y) * (interval) / statsMaxFrameInterval))
+  int statsTargetFrameRateY = GRAPH_Y(1000000/TARGET_FRAME_RATE);
+  int statsAvgFrameRateIntervalY = GRAPH_Y(statsAvgFrameInterval);
   for(int i = 0; i < MIN(statsFrameIntervalsSize, FRAMERATE_GRAPH_WIDTH); ++i)
   {
     int x = FRAMERATE_GRAPH_WIDTH-1-i;
-    int y = statsFrameIntervalsY[i];
+    int y = GRAPH_Y(statsFrameIntervals[i]);
     framebuffer[AT(x, FRAMERATE_GRAPH_MIN_Y)] = RGB565(31,0,0);
     framebuffer[AT(x, FRAMERATE_GRAPH_MIN_Y+1)] = RGB565(0,0,0);
     framebuffer[AT(x, statsTargetFrameRateY-1)] = RGB565(0,0,0);
@@ -150,11 +206,74 @@ void DrawStatisticsOverlay(uint16_t *framebuffer)
 #endif
 }
 
+static void RasteriseStatisticsOverlay(StatisticsOverlayLayer *layer, int width, int scanlineStrideBytes, int height, int panel)
+{
+  // Drawn once over black and once over white: the pixels that the overlay covers are those that did not keep the
+  // background color in either, since no pixel can be drawn both black and white
+  size_t numPixels = (size_t)(scanlineStrideBytes >> 1) * height;
+  uint16_t *black = (uint16_t*)malloc(numPixels * sizeof(uint16_t));
+  uint16_t *white = (uint16_t*)malloc(numPixels * sizeof(uint16_t));
+  if (!black || !white) FATAL_ERROR("Failed to allocate the statistics overlay layer");
+  memset(black, 0, numPixels * sizeof(uint16_t));
+  memset(white, 0xFF, numPixels * sizeof(uint16_t));
+  DrawStatisticsOverlayPixels(black, width, scanlineStrideBytes, height, panel);
+  DrawStatisticsOverlayPixels(white, width, scanlineStrideBytes, height, panel);
+
+  int numRuns = 0, numCovered = 0;
+  for(size_t i = 0; i < numPixels; ++i)
+    if (black[i] != 0 || white[i] != 0xFFFF)
+    {
+      if (i == 0 || (black[i-1] == 0 && white[i-1] == 0xFFFF)) ++numRuns;
+      ++numCovered;
+    }
+
+  free(layer->runs);
+  free(layer->pixels);
+  layer->runs = (OverlayRun*)malloc(MAX(numRuns, 1) * sizeof(OverlayRun));
+  layer->pixels = (uint16_t*)malloc(MAX(numCovered, 1) * sizeof(uint16_t));
+  if (!layer->runs || !layer->pixels) FATAL_ERROR("Failed to allocate the statistics overlay layer");
+  layer->numRuns = 0;
+  uint16_t *out = layer->pixels;
+  for(size_t i = 0; i < numPixels; ++i)
+    if (black[i] != 0 || white[i] != 0xFFFF)
+    {
+      if (i == 0 || (black[i-1] == 0 && white[i-1] == 0xFFFF))
+      {
+        layer->runs[layer->numRuns].offset = (uint32_t)i;
+        layer->runs[layer->numRuns++].length = 0;
+      }
+      ++layer->runs[layer->numRuns-1].length;
+      *out++ = black[i];
+    }
+  free(black);
+  free(white);
+
+  layer->generation = statsOverlayGeneration;
+  layer->width = width;
+  layer->scanlineStrideBytes = scanlineStrideBytes;
+  layer->height = height;
+}
+
+void DrawStatisticsOverlay(uint16_t *framebuffer, int width, int scanlineStrideBytes, int height, int panel)
+{
+  StatisticsOverlayLayer *layer = &overlayLayers[panel];
+  if (layer->generation != statsOverlayGeneration || layer->width != width || layer->scanlineStrideBytes != scanlineStrideBytes || layer->height != height)
+    RasteriseStatisticsOverlay(layer, width, scanlineStrideBytes, height, panel);
+
+  const uint16_t *pixels = layer->pixels;
+  for(int i = 0; i < layer->numRuns; ++i)
+  {
+    memcpy(framebuffer + layer->runs[i].offset, pixels, layer->runs[i].length * sizeof(uint16_t));
+    pixels += layer->runs[i].length;
+  }
+}
+
 void RefreshStatisticsOverlayText()
 {
   uint64_t now = tick();
   uint64_t elapsed = now - statsLastPrint;
   if (elapsed < STATISTICS_REFRESH_INTERVAL) return;
+  ++statsOverlayGeneration;
 
 #ifdef FRAME_COMPLETION_TIME_STATISTICS
   if (frameCompletionTimeHistorySize > 1)
@@ -163,12 +282,12 @@ void RefreshStatisticsOverlayText()
     uint64_t accumIntervals = 0;
     for(int i = 0; i < frameCompletionTimeHistorySize-1; ++i)
     {
-      uint64_t interval = MIN(frameCompletionTimeHistory[i] - frameCompletionTimeHistory[i+1], maxInterval);
+      uint64_t interval = MIN(FRAME_COMPLETION_TIME(i) - FRAME_COMPLETION_TIME(i+1), maxInterval);
       accumIntervals += interval;
-      statsFrameIntervalsY[i] = FRAMERATE_GRAPH_MAX_Y - (FRAMERATE_GRAPH_MAX_Y - FRAMERATE_GRAPH_MIN_Y) * interval / maxInterval;
+      statsFrameIntervals[i] = interval;
     }
-    statsTargetFrameRateY = FRAMERATE_GRAPH_MAX_Y - (FRAMERATE_GRAPH_MAX_Y - FRAMERATE_GRAPH_MIN_Y) * (1000000/TARGET_FRAME_RATE) / maxInterval;
-    statsAvgFrameRateIntervalY = FRAMERATE_GRAPH_MAX_Y - (FRAMERATE_GRAPH_MAX_Y - FRAMERATE_GRAPH_MIN_Y) * (accumIntervals / (frameCompletionTimeHistorySize-1)) / maxInterval;
+    statsMaxFrameInterval = maxInterval;
+    statsAvgFrameInterval = accumIntervals / (frameCompletionTimeHistorySize-1);
     statsFrameIntervalsSize = frameCompletionTimeHistorySize-1;
   }
   else
@@ -185,13 +304,45 @@ void RefreshStatisticsOverlayText()
   int spiRate = 0;
   strcpy(spiUsagePercentageText, "N/A");
 #else
-  uint64_t spiThreadIdleFor = __atomic_load_n(&spiThreadIdleUsecs, __ATOMIC_RELAXED);
-  __sync_fetch_and_sub(&spiThreadIdleUsecs, spiThreadIdleFor);
-  if (__atomic_load_n(&spiThreadSleeping, __ATOMIC_RELAXED)) spiThreadIdleFor += tick() - spiThreadSleepStartTime;
-  spiThreadUtilizationRate = MIN(1.0, MAX(0.0, 1.0 - spiThreadIdleFor / (double)STATISTICS_REFRESH_INTERVAL));
+  // The SPI thread is busy while it transmits or polls for the bus to drain, and the bus is busy for as long as it
+  // takes to clock out the bytes that were sent at the configured SPI_BUS_CLOCK_DIVISOR
+  uint64_t spiThreadTimeNow[SPI_THREAD_NUM_STATES];
+  spi_thread_time(spiThreadTimeNow);
+  uint64_t spiThreadTotal = 0;
+  for(int i = 0; i < SPI_THREAD_NUM_STATES; ++i)
+  {
+    spiThreadTimeInInterval[i] = spiThreadTimeNow[i] - spiThreadTimeAtLastPrint[i];
+    spiThreadTimeAtLastPrint[i] = spiThreadTimeNow[i];
+    spiThreadTotal += spiThreadTimeInInterval[i];
+  }
+  uint64_t spiBytesSent = 0;
+  for(int i = 0; spiBus && i < spiBus->numPanels; ++i) spiBytesSent += __atomic_load_n(&spiBus->panels[i]->bytesSent, __ATOMIC_RELAXED);
+  spiThreadUtilizationRate = spiThreadTotal ? (double)(spiThreadTimeInInterval[SPI_THREAD_TRANSMITTING] + spiThreadTimeInInterval[SPI_THREAD_POLLING]) / spiThreadTotal : 0;
+  spiBusDutyCycle = MIN(1.0, (spiBytesSent - spiBytesSentAtLastPrint) * spiUsecsPerByte / elapsed);
+  spiBytesSentAtLastPrint = spiBytesSent;
   int spiRate = (int)MIN(100, (spiThreadUtilizationRate*100.0));
-  sprintf(spiUsagePercentageText, "%d%%", spiRate);
+  int busRate = (int)(spiBusDutyCycle*100.0);
+  sprintf(spiUsagePercentageText, "%d%%/%d%%", spiRate, busRate);
 #endif
+  // Average and max latency from posting a control command to it being written to the bus
+  uint32_t controlTasksRun = __atomic_exchange_n(&statsControlTasksRun, 0, __ATOMIC_RELAXED);
+  uint64_t controlLatencyTotal = __atomic_exchange_n(&statsControlLatencyTotalUsecs, 0, __ATOMIC_RELAXED);
+  uint64_t controlLatencyMax = __atomic_exchange_n(&statsControlLatencyMaxUsecs, 0, __ATOMIC_RELAXED);
+  if (controlTasksRun > 0) sprintf(controlLatencyText, "C%.1f/%.1fms", controlLatencyTotal / (1000.0 * controlTasksRun), controlLatencyMax / 1000.0);
+  else controlLatencyText[0] = '\0';
+
+  // Median and 99th percentile of frame submit to on-glass latency, and the frame intervals, since the last refresh
+  MetricsSnapshot frameLatencies, frameIntervals;
+  MetricsTakeSnapshot(&frameLatencyMetric, &frameLatencies);
+  MetricsTakeSnapshot(&frameIntervalMetric, &frameIntervals);
+  MetricsSnapshot frameLatenciesNow = frameLatencies, frameIntervalsNow = frameIntervals;
+  MetricsSubtract(&frameLatencies, &frameLatenciesAtLastPrint);
+  MetricsSubtract(&frameIntervals, &frameIntervalsAtLastPrint);
+  frameLatenciesAtLastPrint = frameLatenciesNow;
+  frameIntervalsAtLastPrint = frameIntervalsNow;
+  if (frameLatencies.count > 0) sprintf(glassLatencyText, "G%d/%dms", (int)((MetricsPercentile(&frameLatencies, 0.5) + 999) / 1000), (int)((MetricsPercentile(&frameLatencies, 0.99) + 999) / 1000));
+  else glassLatencyText[0] = '\0';
+
   spiBusDataRate = (double)8.0 * statsBytesTransferred * 1000.0 / (elapsed / 1000.0);
 
   if (spiRate < 90) spiUsageColor = RGB565(0,63,0);
@@ -230,22 +381,35 @@ void RefreshStatisticsOverlayText()
   }
   else gpuPollingWastedText[0] = '\0';
 
+  // Frame rate and data rate of each panel on the bus, as sent by the SPI thread
+  for(int i = 0; spiBus && i < spiBus->numPanels; ++i)
+  {
+    uint64_t bytesSent = __atomic_load_n(&spiBus->panels[i]->bytesSent, __ATOMIC_RELAXED);
+    uint32_t framesSent = __atomic_load_n(&spiBus->panels[i]->framesSent, __ATOMIC_RELAXED);
+    sprintf(panelStatsText[i], "P%d:%.0ffps %.2fMB/s", i, (framesSent - panelFramesSentAtLastPrint[i]) * 1000000.0 / elapsed, (bytesSent - panelBytesSentAtLastPrint[i]) / (double)elapsed);
+    panelBytesSentAtLastPrint[i] = bytesSent;
+    panelFramesSentAtLastPrint[i] = framesSent;
+  }
+
   statsLastPrint = now;
 
-  if (frameTimeHistorySize >= 3)
+  uint32_t progressiveFrames = __atomic_load_n(&statsProgressiveFrames, __ATOMIC_RELAXED);
+  uint32_t interlacedFrames = __atomic_load_n(&statsInterlacedFrames, __ATOMIC_RELAXED);
+  uint32_t framesSkipped = __atomic_load_n(&statsFramesSkipped, __ATOMIC_RELAXED);
+  int numProgressiveFramesInHistory = progressiveFrames - progressiveFramesAtLastPrint;
+  int numInterlacedFramesInHistory = interlacedFrames - interlacedFramesAtLastPrint;
+  int numSkippedFramesInHistory = framesSkipped - framesSkippedAtLastPrint;
+  progressiveFramesAtLastPrint = progressiveFrames;
+  interlacedFramesAtLastPrint = interlacedFrames;
+  framesSkippedAtLastPrint = framesSkipped;
+
+  if (frameIntervals.count >= 2)
   {
-    int numInterlacedFramesInHistory = 0;
-    int numProgressiveFramesInHistory = 0;
-    for(int i = 0; i < frameTimeHistorySize; ++i)
-      if (frameTimeHistory[i].interlaced)
-        ++numInterlacedFramesInHistory;
-      else
-        ++numProgressiveFramesInHistory;
-
-    int frames = frameTimeHistorySize;
+    // Progressive frames count twice as interlaced
+    double fieldsPerFrame = 1.0;
     if (numInterlacedFramesInHistory)
-      frames += numProgressiveFramesInHistory; // Progressive frames count twice as interlaced
-    int fps = (0.5 + (frames - 1) * 1000000.0 / (frameTimeHistory[frameTimeHistorySize-1].time - frameTimeHistory[0].time));
+      fieldsPerFrame = (numInterlacedFramesInHistory + 2.0 * numProgressiveFramesInHistory) / (numInterlacedFramesInHistory + numProgressiveFramesInHistory);
+    int fps = (int)(0.5 + fieldsPerFrame * 1000000.0 * frameIntervals.count / frameIntervals.sum);
 #ifdef NO_INTERLACING
     sprintf(fpsText, "%d", fps);
     fpsColor = 0xFFFF;
@@ -262,7 +426,7 @@ void RefreshStatisticsOverlayText()
       fpsColor = 0xFFFF;
     }
 #endif
-    if (frameSkipTimeHistorySize > 0) sprintf(statsFrameSkipText, "-%d", frameSkipTimeHistorySize);
+    if (numSkippedFramesInHistory > 0) sprintf(statsFrameSkipText, "-%d", numSkippedFramesInHistory);
     else statsFrameSkipText[0] = '\0';
   }
   else
@@ -287,5 +451,5 @@ void RefreshStatisticsOverlayText()
 }
 #else
 void RefreshStatisticsOverlayText() {}
-void DrawStatisticsOverlay(uint16_t *) {}
+void DrawStatisticsOverlay(uint16_t *, int, int, int, int) {}
 #endif // ~STATISTICS
@@ -5,7 +5,10 @@
 #include "gpu.h"
 
 void RefreshStatisticsOverlayText(void);
-void DrawStatisticsOverlay(uint16_t *framebuffer);
+// Draws the overlay to a framebuffer of the given size. panel is the index of the panel on the SPI bus that the
+// framebuffer goes to, for the per panel statistics. The overlay is rasterised into a layer per panel only when
+// RefreshStatisticsOverlayText() has changed the text, and every other call copies that layer over the framebuffer.
+void DrawStatisticsOverlay(uint16_t *framebuffer, int width, int scanlineStrideBytes, int height, int panel);
 
 #ifdef STATISTICS
 
@@ -14,15 +17,21 @@ extern volatile float statsSpiBusSpeed;
 extern volatile int statsBcmCoreSpeed;
 extern volatile int statsCpuFrequency;
 extern volatile double statsCpuTemperature;
-extern double spiThreadUtilizationRate;
+extern double spiThreadUtilizationRate; // Share of the last refresh interval that the SPI thread transmitted or polled
 extern double spiBusDataRate;
+extern double spiBusDutyCycle; // Share of the last refresh interval that the bus was clocking out bytes
+extern uint64_t spiThreadTimeInInterval[]; // Usecs of the last refresh interval in each SpiThreadState (spi.h)
 extern int statsGpuPollingWasted;
 extern uint64_t statsBytesTransferred;
 
-extern int frameSkipTimeHistorySize;
-extern uint64_t frameSkipTimeHistory[FRAME_HISTORY_MAX_SIZE];
+// Frames submitted to the SPI thread, and source frames that were skipped, since the start. The frame rate is
+// computed from the difference between two refreshes of the overlay, and the frame interval metric (metrics.h).
+extern volatile uint32_t statsProgressiveFrames;
+extern volatile uint32_t statsInterlacedFrames;
+extern volatile uint32_t statsFramesSkipped;
 
-void AddFrameCompletionTimeMarker();
+// Adds a frame submitted at the given time to the frame interval graph
+void AddFrameCompletionTimeMarker(uint64_t time);
 
 // All overlay statistics are double-buffered: the updated data fields
 // are polled at certain rate, and updated in the first copy below. However
@@ -42,5 +51,8 @@ extern char cpuTemperatureText[32];
 extern uint16_t cpuTemperatureColor;
 extern char gpuPollingWastedText[32];
 extern uint16_t gpuPollingWastedColor;
+extern char controlLatencyText[32];
+extern char glassLatencyText[32];
+extern char panelStatsText[][32]; // One per panel on the SPI bus
 
 #endif
@@ -0,0 +1,42 @@
+#include "tick.h"
+
+volatile int tickClock = TICK_CLOCK_MONOTONIC;
+volatile int64_t tickClockOffset = 0;
+volatile uint64_t virtualClockUsecs = 0;
+
+#ifdef USE_VIDEOCORE
+// Points to the system timer register. N.B. spec sheet says this is two low and high parts, in an 32-bit aligned (but not 64-bit aligned) address. Profiling shows
+// that Pi 3 Model B does allow reading this as a u64 load, and even when unaligned, it is around 30% faster to do so compared to loading in parts "lo | (hi << 32)".
+volatile TIMER_TYPE *systemTimerRegister = 0;
+#endif
+
+static uint64_t ReadClock(int clock)
+{
+#ifdef USE_VIDEOCORE
+  if (clock == TICK_CLOCK_BCM2835_TIMER) return BCM2835_TIMER_TICK();
+#endif
+  if (clock == TICK_CLOCK_VIRTUAL) return __atomic_load_n(&virtualClockUsecs, __ATOMIC_ACQUIRE);
+  return MonotonicClockUsecs();
+}
+
+void SetTickClock(int clock)
+{
+#ifndef USE_VIDEOCORE
+  if (clock == TICK_CLOCK_BCM2835_TIMER) clock = TICK_CLOCK_MONOTONIC;
+#endif
+  if (clock == tickClock) return;
+  uint64_t now = tick();
+  tickClockOffset = (int64_t)(now - ReadClock(clock));
+  tickClock = clock;
+}
+
+void AdvanceVirtualClock(uint64_t usecs)
+{
+  __atomic_fetch_add(&virtualClockUsecs, usecs, __ATOMIC_ACQ_REL);
+}
+
+void SleepUsecs(uint64_t usecs)
+{
+  if (tickClock == TICK_CLOCK_VIRTUAL) AdvanceVirtualClock(usecs);
+  else usleep(usecs);
+}
@@ -1,19 +1,50 @@
 #pragma once
 
 #include <inttypes.h>
+#include <time.h>
 #include <unistd.h>
 
-// Initialized in spi.cpp along with the rest of the BCM2835 peripheral:
-// extern volatile uint64_t *systemTimerRegister;
-// #define tick() (*systemTimerRegister)
+// The clocks that tick() can read. All of them count microseconds.
+enum TickClock
+{
+  TICK_CLOCK_MONOTONIC, // clock_gettime(CLOCK_MONOTONIC_RAW). Works everywhere, and is the clock until InitSPI() maps the BCM2835 timer
+  TICK_CLOCK_BCM2835_TIMER, // The free running 1MHz system timer of the BCM2835, mapped from /dev/mem by InitSPI() while the SPI is up
+  TICK_CLOCK_VIRTUAL // Stands still until AdvanceVirtualClock() or SleepUsecs() move it, to run timing logic deterministically and faster than real time
+};
 
+extern volatile int tickClock;
+extern volatile int64_t tickClockOffset; // Added to the clock, so that tick() goes on from where it was when the clock was switched
+extern volatile uint64_t virtualClockUsecs;
+
+#ifdef USE_VIDEOCORE
+// Initialized in spi.cpp along with the rest of the BCM2835 peripheral
 #if __aarch64__
 #define TIMER_TYPE uint32_t
 extern volatile uint32_t *systemTimerRegister;
-#define tick() (*systemTimerRegister+((uint64_t)(*(systemTimerRegister+1))<<32))
+#define BCM2835_TIMER_TICK() (*systemTimerRegister+((uint64_t)(*(systemTimerRegister+1))<<32))
 #else
 #define TIMER_TYPE uint64_t
 extern volatile uint64_t *systemTimerRegister;
-#define tick() (*systemTimerRegister)
-#endif 
+#define BCM2835_TIMER_TICK() (*systemTimerRegister)
+#endif
+#endif
+
+static inline uint64_t MonotonicClockUsecs() { struct timespec t; clock_gettime(CLOCK_MONOTONIC_RAW, &t); return (uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000; }
+
+static inline uint64_t tick()
+{
+#ifdef USE_VIDEOCORE
+  if (__builtin_expect(tickClock == TICK_CLOCK_BCM2835_TIMER, 1)) return BCM2835_TIMER_TICK() + tickClockOffset;
+#endif
+  if (tickClock == TICK_CLOCK_VIRTUAL) return __atomic_load_n(&virtualClockUsecs, __ATOMIC_ACQUIRE) + tickClockOffset;
+  return MonotonicClockUsecs() + tickClockOffset;
+}
 
+// Switches tick() to another clock, continuing from the time it shows now, so that earlier timestamps stay in the past.
+// Should be called while no other thread is timing anything, e.g. before the threads start.
+void SetTickClock(int clock);
+// Moves the virtual clock forward
+void AdvanceVirtualClock(uint64_t usecs);
+// Sleeps for usecs, or with the virtual clock, advances it by usecs and returns right away. For the waits of the pacing
+// and throttling logic, so that it can run against the virtual clock.
+void SleepUsecs(uint64_t usecs);
@@ -0,0 +1,113 @@
+#ifdef FRAME_TRACING
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "trace.h"
+#include "util.h"
+
+struct TraceEvent
+{
+  const char *name;
+  uint64_t start;
+  uint32_t duration;
+  uint32_t arg;
+};
+
+// Written only by its own thread. The dump reads it concurrently, and drops events that were overwritten while it read.
+struct TraceBuffer
+{
+  char threadName[16];
+  pid_t tid;
+  volatile uint64_t written; // Events written since the start, the next one goes to events[written % TRACE_BUFFER_EVENTS]
+  TraceEvent events[TRACE_BUFFER_EVENTS];
+};
+
+static TraceBuffer *traceBuffers[TRACE_MAX_THREADS];
+static uint32_t numTraceBuffers = 0;
+static thread_local TraceBuffer *threadTraceBuffer = 0;
+static bool traceThreadsExhausted = false;
+
+// Called on the first event of a thread, which by then has been named by SetThreadScheduling()
+static TraceBuffer *RegisterTraceThread()
+{
+  uint32_t index = __atomic_fetch_add(&numTraceBuffers, 1, __ATOMIC_RELAXED);
+  if (index >= TRACE_MAX_THREADS)
+  {
+    if (!traceThreadsExhausted) printf("Trace: more than %d threads, not tracing the rest\n", TRACE_MAX_THREADS);
+    traceThreadsExhausted = true;
+    return 0;
+  }
+  TraceBuffer *buffer = (TraceBuffer*)calloc(1, sizeof(TraceBuffer));
+  if (!buffer) FATAL_ERROR("Failed to allocate a trace buffer!");
+  pthread_getname_np(pthread_self(), buffer->threadName, sizeof(buffer->threadName));
+  buffer->tid = (pid_t)syscall(SYS_gettid);
+  __atomic_store_n(&traceBuffers[index], buffer, __ATOMIC_RELEASE);
+  return buffer;
+}
+
+void RecordTraceEvent(const char *name, uint64_t startUsecs, uint64_t durationUsecs, uint32_t arg)
+{
+  TraceBuffer *buffer = threadTraceBuffer;
+  if (!buffer)
+  {
+    if (traceThreadsExhausted) return;
+    buffer = threadTraceBuffer = RegisterTraceThread();
+    if (!buffer) return;
+  }
+  uint64_t w = buffer->written;
+  // The dump must not see the event before it has seen the count of the event before, see DumpTrace()
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  TraceEvent *e = &buffer->events[w & (TRACE_BUFFER_EVENTS - 1)];
+  e->name = name;
+  e->start = startUsecs;
+  e->duration = (uint32_t)MIN(durationUsecs, (uint64_t)UINT32_MAX);
+  e->arg = arg;
+  __atomic_store_n(&buffer->written, w + 1, __ATOMIC_RELEASE);
+}
+
+void DumpTrace(const char *path)
+{
+  FILE *handle = fopen(path, "w");
+  if (!handle)
+  {
+    printf("Trace: could not open %s for writing\n", path);
+    return;
+  }
+
+  uint32_t numBuffers = MIN(__atomic_load_n(&numTraceBuffers, __ATOMIC_RELAXED), (uint32_t)TRACE_MAX_THREADS);
+  uint64_t numEvents = 0;
+  const char *separator = "";
+  fprintf(handle, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  for(uint32_t i = 0; i < numBuffers; ++i)
+  {
+    TraceBuffer *buffer = __atomic_load_n(&traceBuffers[i], __ATOMIC_ACQUIRE);
+    if (!buffer) continue; // Still being registered
+    fprintf(handle, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", separator, (int)getpid(), (int)buffer->tid, buffer->threadName);
+    separator = ",\n";
+
+    uint64_t end = __atomic_load_n(&buffer->written, __ATOMIC_ACQUIRE);
+    uint64_t begin = end > TRACE_BUFFER_EVENTS ? end - TRACE_BUFFER_EVENTS : 0;
+    for(uint64_t j = begin; j < end; ++j)
+    {
+      TraceEvent e = buffer->events[j & (TRACE_BUFFER_EVENTS - 1)];
+      // If the thread has since started writing over this event, the copy may be torn
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&buffer->written, __ATOMIC_ACQUIRE) - j >= TRACE_BUFFER_EVENTS) continue;
+      fprintf(handle, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%llu,\"dur\":%u,\"args\":{\"arg\":%u}}",
+        e.name, (int)getpid(), (int)buffer->tid, (unsigned long long)e.start, e.duration, e.arg);
+      ++numEvents;
+    }
+  }
+  fprintf(handle, "\n]}\n");
+  fclose(handle);
+  printf("Trace: wrote %llu events of %u threads to %s\n", (unsigned long long)numEvents, numBuffers, path);
+}
+
+#endif
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "tick.h"
+
+// Frame tracing. With FRAME_TRACING (-DFRAME_TRACING=ON on the CMake command line), the TRACE_ macros record how long
+// each stage of a frame took, from decoding to the SPI transfer, into a ring buffer of the calling thread. Recording
+// takes no locks and does not allocate after the first event of a thread, so it is cheap enough to leave on in the
+// SPI thread. The most recent TRACE_BUFFER_EVENTS events of every thread are written out as Chrome trace JSON
+// (chrome://tracing, or https://ui.perfetto.dev) to TRACE_FILE at exit, and whenever DumpTrace() is called. Without
+// FRAME_TRACING the macros compile to nothing.
+//
+// Event names must be string literals, as only the pointer is kept.
+#ifndef TRACE_BUFFER_EVENTS
+#define TRACE_BUFFER_EVENTS 16384 // Must be a power of two
+#endif
+#ifndef TRACE_MAX_THREADS
+#define TRACE_MAX_THREADS 16
+#endif
+#ifndef TRACE_FILE
+#define TRACE_FILE "/tmp/fbcp-trace.json"
+#endif
+
+#ifdef FRAME_TRACING
+
+// Records an event that started at startUsecs (on the tick() clock) and lasted durationUsecs. arg is shown with the
+// event, e.g. the frame number or the byte count.
+void RecordTraceEvent(const char *name, uint64_t startUsecs, uint64_t durationUsecs, uint32_t arg);
+
+// Writes the events that the threads have recorded so far to the given file
+void DumpTrace(const char *path);
+
+// Records the time from its construction to its destruction
+struct TraceScope
+{
+  const char *name;
+  uint64_t start;
+  uint32_t arg;
+  TraceScope(const char *name, uint32_t arg = 0): name(name), start(tick()), arg(arg) {}
+  ~TraceScope() { RecordTraceEvent(name, start, tick() - start, arg); }
+};
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+// Traces the rest of the enclosing block
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
+#define TRACE_SCOPE_ARG(name, arg) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name, (uint32_t)(arg))
+// Traces from TRACE_BEGIN to TRACE_END with the same var in the same block, for stages that are not a block of their own
+#define TRACE_BEGIN(var) uint64_t var = tick()
+#define TRACE_END(var, name, arg) RecordTraceEvent(name, var, tick() - var, (uint32_t)(arg))
+
+#else
+
+#define TRACE_SCOPE(name) ((void)0)
+#define TRACE_SCOPE_ARG(name, arg) ((void)0)
+#define TRACE_BEGIN(var) ((void)0)
+#define TRACE_END(var, name, arg) ((void)0)
+
+#endif
@@ -3,6 +3,7 @@
 #if defined(ST7789) || defined(ST7789VW)
 
 #include "spi.h"
+#include "st7789V.h"
 #include "spi_utils.h"
 #include "gpio_utils.h"
 
@@ -11,6 +12,7 @@
 
 void InitST7789()
 {
+  spi_loop *loop = spiBus->panels[0];
   // If a Reset pin is defined, toggle it briefly high->low->high to enable the device. Some devices do not have a reset pin, in which case compile with GPIO_TFT_RESET_PIN left undefined.
 #if defined(GPIO_TFT_RESET_PIN) && GPIO_TFT_RESET_PIN >= 0
   printf("Resetting display at reset GPIO pin %d\n", GPIO_TFT_RESET_PIN);
@@ -163,7 +165,7 @@ void InitST7789()
     set_gpio(gpio, GPIO_TFT_BACKLIGHT);            // And turn the backlight on.
 #endif
 
-    ClearScreen();
+    ClearScreen(loop);
   
   }
 #ifndef USE_DMA_TRANSFERS // For DMA transfers, keep SPI CS & TA active.
@@ -181,22 +183,27 @@ void TurnDisplayOff()
   set_gpio_mode(gpio, GPIO_TFT_BACKLIGHT, 0x01); // Set backlight pin to digital 0/1 output mode (0x01) in case it had been PWM controlled
   clear_gpio(gpio, GPIO_TFT_BACKLIGHT); // And turn the backlight off.
 #endif
-#if 0
-  QUEUE_SPI_TRANSFER(0x28/*Display OFF*/);
-  QUEUE_SPI_TRANSFER(0x10/*Enter Sleep Mode*/);
+  // Through the control lane, so that the panels go dark after the frame that is being sent, and not after the whole queue
+  for(int i = 0; i < spiBus->numPanels; ++i)
+  {
+    set_brightness_st7789V(spiBus->panels[i], 0);
+    display_off_st7789V(spiBus->panels[i]);
+    sleep_in_st7789V(spiBus->panels[i]);
+  }
 
   usleep(120*1000); // Sleep off can be sent 120msecs after entering sleep mode the earliest, so synchronously sleep here for that duration to be safe.
-#endif
   //  printf("Turned display OFF\n");
 }
 
 void TurnDisplayOn()
 {
-#if 0
-  QUEUE_SPI_TRANSFER(0x11/*Sleep Out*/);
+  for(int i = 0; i < spiBus->numPanels; ++i) sleep_out_st7789V(spiBus->panels[i]);
   usleep(120 * 1000);
-  QUEUE_SPI_TRANSFER(0x29/*Display ON*/);
-#endif
+  for(int i = 0; i < spiBus->numPanels; ++i)
+  {
+    display_on_st7789V(spiBus->panels[i]);
+    set_brightness_st7789V(spiBus->panels[i], DISPLAY_BRIGHTNESS);
+  }
 #if defined(GPIO_TFT_BACKLIGHT) && defined(BACKLIGHT_CONTROL)
   set_gpio_mode(gpio, GPIO_TFT_BACKLIGHT, 0x01); // Set backlight pin to digital 0/1 output mode (0x01) in case it had been PWM controlled
   set_gpio(gpio, GPIO_TFT_BACKLIGHT);            // And turn the backlight on.
@@ -206,7 +213,7 @@ void TurnDisplayOn()
 
 void DeinitSPIDisplay()
 {
-  ClearScreen();
+  ClearScreen(spiBus->panels[0]);
 }
 
 #endif
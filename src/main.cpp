@@ -27,8 +27,17 @@
 #include "mailbox.h"
 #include "diff.h"
 #include "mem_alloc.h"
+#include "realtime.h"
+#include "trace.h"
+#include "metrics.h"
+#include "metrics_export.h"
 #include <Gpu.hpp>
 #include <Vsync.hpp>
+#include <FramePacer.hpp>
+#include <TaskQueue.hpp>
+#include <TickCoalescer.hpp>
+#include <Pipeline.hpp>
+#include <FrameSource.hpp>
 
 #include <stdlib.h>  // For random number generation
 #include <stdint.h>  // For uint16_t and other standard integer types
@@ -39,12 +48,6 @@
 #include <vector>
 #include <functional>
 
-#define STB_IMAGE_IMPLEMENTATION
-#include <stb_image.h>
-#include <queue>
-#include <mutex>
-#include <condition_variable>
-
 int startY = 10;
 int inv = 0;
 
@@ -85,20 +88,23 @@ const char *SignalToString(int signal)
 
 using namespace std;
 
-mutex mtx;
-condition_variable cv;
-queue<function<void()>> q;
+// Work for the main thread. Posting is lock free and does not allocate, so the Vsync thread and signal handlers can post.
+#define RENDER_QUEUE_SIZE 64
+TaskQueue<RENDER_QUEUE_SIZE> renderQueue;
 
-void post(const function<void()>& callback) {
-  unique_lock<mutex> lock(mtx);
-  q.push(callback);
-  cv.notify_one();
+template<typename F>
+void post(F&& callback) {
+  // If the main thread is that far behind, dropping the task is as good as a missed vsync tick
+  renderQueue.post(std::forward<F>(callback));
 }
 
+// Vsync ticks that the render loop has not caught up with yet
+TickCoalescer renderTicks;
+
 void MarkProgramQuitting()
 {
   programRunning = false;
-  post([]{});
+  renderQueue.wake();
 }
 
 void ProgramInterruptHandler(int signal)
@@ -113,131 +119,184 @@ void ProgramInterruptHandler(int signal)
   MarkProgramQuitting();
   __sync_synchronize();
   // Wake the SPI thread if it was sleeping so that it can gracefully quit
-  if (spiTaskMemory)
-  {
-    __atomic_fetch_add(&spiTaskMemory->queueHead, 1, __ATOMIC_SEQ_CST);
-    __atomic_fetch_add(&spiTaskMemory->queueTail, 1, __ATOMIC_SEQ_CST);
-    syscall(SYS_futex, &spiTaskMemory->queueTail, FUTEX_WAKE, 1, 0, 0, 0); // Wake the SPI thread if it was sleeping to get new tasks
-  }
+  if (spiBus) spi_wake_thread(spiBus);
 
   // Wake the main thread if it was sleeping for a new frame so that it can gracefully quit
   __atomic_fetch_add(&numNewGpuFrames, 1, __ATOMIC_SEQ_CST);
   syscall(SYS_futex, &numNewGpuFrames, FUTEX_WAKE, 1, 0, 0, 0);
 }
 
+#ifdef FRAME_TRACING
+// Has the render loop write out the trace, as files can not be written from a signal handler
+void TraceDumpSignalHandler(int signal)
+{
+  post([]{ DumpTrace(TRACE_FILE); });
+}
+#endif
+
+// Frames in the animation
+#define NUM_FRAMES 166
+
+// Hash of the contents of each frame of the animation, or 0 if the frame has not been decoded yet. A frame that
+// looks the same as the one before it needs no ticks of its own.
+static uint64_t frameHashes[NUM_FRAMES];
+
+// How many of the frames after the given one are known to look the same as it
+static int HeldFrames(int frame)
+{
+  int held = 0;
+  while (held < NUM_FRAMES - 1 && frameHashes[frame] && frameHashes[(frame + held + 1) % NUM_FRAMES] == frameHashes[frame]) ++held;
+  return held;
+}
+
+// A frame on its way from the source images to the panel
+struct FrameSlot
+{
+  int frame;
+  PacedFrame paced; // The vsync deadline the frame is for, and when its stages ran
+  uint16_t source[240][320]; // Decoded frame
+  uint16_t canvas[320][240]; // Rotated for the Gpu
+};
+
+// Loads the given frame of the animation, and converts it to RGB565. A frame that fails to load comes out black.
+void DecodeFrame(int frame, uint16_t source[240][320])
+{
+  TRACE_SCOPE_ARG("decode", frame);
+  std::string path = "../res/speaking/frame_" + std::to_string(frame) + ".bmp";
+  LoadFrameImage(path.c_str(), source);
+
+  // FNV-1a
+  uint64_t hash = 14695981039346656037ULL;
+  for (int i = 0; i < 240 * 320; ++i) hash = (hash ^ source[0][i]) * 1099511628211ULL;
+  frameHashes[frame] = hash ? hash : 1;
+}
+
 int main()
 {
   signal(SIGINT, ProgramInterruptHandler);
   signal(SIGQUIT, ProgramInterruptHandler);
   signal(SIGUSR1, ProgramInterruptHandler);
+#ifdef FRAME_TRACING
+  signal(SIGUSR2, TraceDumpSignalHandler);
+#else
   signal(SIGUSR2, ProgramInterruptHandler);
+#endif
   signal(SIGTERM, ProgramInterruptHandler);
   
-  Gpu gpu;
-  gpu.init();
+  LockProcessMemory();
+  SetThreadScheduling("fbcp-render", RENDER_THREAD_POLICY, RENDER_THREAD_PRIORITY, RENDER_THREAD_CPU);
 
+  // All panels on the bus show the same frame, which is diffed only once
+  InitSPI(SPI_PANELS);
+  Gpu gpu;
+  gpu.init(spiBus->panels, SPI_PANELS, GPU_LAYOUT_MIRRORED);
+#ifdef METRICS_EXPORT
+  StartMetricsExport();
+#endif
+
+#if defined(GPIO_TFT_TE)
+  TeGpioVsyncSource teSource(GPIO_CHIP_DEVICE, GPIO_TFT_TE, TE_REFRESH_RATE);
+  Vsync vsync(&teSource, (TE_REFRESH_RATE + TARGET_FRAME_RATE / 2) / TARGET_FRAME_RATE, TE_DELAY_USECS);
+#else
   Vsync vsync;
-  vsync.callback([]{
-    post([]{});
+#endif
+  vsync.callback([&vsync]{
+    uint64_t postTime = tick();
+    if (renderTicks.onTick(vsync.tickIndex())) post([postTime]{ AddSchedLatencySample(&renderThreadLatency, tick() - postTime); });
   });
   vsync.start();
 
-  int width = 320;
-  int height = 240;
-  int channels = 3;
-
-  uint16_t sourceBuffer[height][width];
+  // A frame is drawn after the tick that it is for, and started just in time to be on glass by the tick after that
+  FramePacer pacer(vsync);
 
   int f = 0;
 
-  while (programRunning) {
-    unique_lock<mutex> lock(mtx);
-    cv.wait(lock, [] { return !q.empty(); });
-    function<void()> cb = q.front();
-    q.pop();
-    lock.unlock();
-
-    cb();
-
-    std::string path = "../res/speaking/frame_" + std::to_string(f) + ".bmp";
-    unsigned char *data = stbi_load(path.c_str(), &width, &height, &channels, 0);
-    if (f == 165) {
-      f = 0;
-    }
-    f += 1;
-
-    printf("Drawing frame %d\n", f);
-
-    for (int h = 0; h < height; h++) {
-      for (int w = 0; w < width; w++) {
-        sourceBuffer[h][w] = (0 << 11) | (0 << 5) | 0;
+  // Waits for the next vsync tick, and advances the animation by all the ticks that went by since the last frame.
+  // Returns the frame to draw, or -1 once the program is quitting.
+  auto nextFrame = [&](uint64_t& tickIndex) {
+    while (programRunning) {
+      InlineTask cb;
+      if (!renderQueue.tryPop(cb)) {
+        renderQueue.wait();
+        continue;
       }
-    }
-
-    for (int y = 0; y < height; ++y) {
-      for (int x = 0; x < width; ++x) {
-          unsigned char* pixel = data + (y * width + x) * channels;
-          unsigned char red = pixel[0];
-          unsigned char green = pixel[1];
-          unsigned char blue = pixel[2];
-
-          uint8_t r = (red >> 3) & 0x1F;   // Reduce to 5 bits
-          uint8_t g = (green >> 2) & 0x3F; // Reduce to 6 bits
-          uint8_t b = (blue >> 3) & 0x1F;  // Reduce to 5 bits
-
-          uint16_t rgb16 = (r << 11) | (g << 5) | b;
 
-          sourceBuffer[y][x] = rgb16;
-          
-      }
-    }
+      cb();
 
-    stbi_image_free(data);
+      // Render once for all the ticks that went by, and advance the animation by as many frames
+      uint64_t elapsedTicks = renderTicks.consume(tickIndex);
+      if (!elapsedTicks) continue;
 
-    uint16_t tempBuffer[320][240];
-    for (int i = 0; i < 240; ++i) {
-        for (int j = 0; j < 320; ++j) {
-            tempBuffer[j][240 - 1 - i] = sourceBuffer[i][j];
-        }
-    }
+      int frame = f;
+      f = (f + elapsedTicks) % NUM_FRAMES;
 
-    uint16_t destinationBuffer[320][240];
-    for (int i = 0; i < 320; ++i) {
-      for (int j = 0; j < 240; ++j) {
-        destinationBuffer[i][240 - 1 - j] = tempBuffer[i][j];
+      // Nothing needs to tick, render, diff or be sent while the frames that follow look the same as this one
+      int held = HeldFrames(frame);
+      if (held > 0) {
+        vsync.idleForTicks(held);
+        f = (frame + held + 1) % NUM_FRAMES;
       }
+      return frame;
     }
-
-      // uint16_t blueColor = (0 << 11) | (0 << 5) | 31;  // Blue color in 5-6-5 format (max value for blue)
-      // startY  += 10; // Start 5 lines above the vertical center
-      // if (startY >= 320) {
-      //   startY = 10;
-      // }
-
-      // int endY = startY + 10;        // End 5 lines below the vertical center (10 px total)
-      // if (inv == 0) {
-      //   blueColor = (0 << 11) | (0 << 5) | 0;
-      //   inv = 1;
-      // } else {
-      //   inv = 0;
-      // }
-
-      // for (int y = startY; y < endY; ++y) {
-      //     for (int x = 0; x < width; ++x) {
-      //       int r = rand() % 2;
-      //       sourceBuffer[y * width + x] = (0 << 11) | (0 << 5) | 0;
-      //     }
-      // }
-
-    // for (int i = 0; i < height * width; i++) {
-    //   sourceBuffer[i] = (0 << 11) | (0 << 5) | 31;
-    // }
-
-    gpu.post(&destinationBuffer[0][0]);
-    // usleep(16 * 1000);
+    return -1;
+  };
+
+#ifdef PIPELINED_RENDER
+  // Decoding, rotating and diffing run on threads of their own, with up to PIPELINE_DEPTH frames in flight. The
+  // SPI thread, which sends what the post stage diffed, is the last stage.
+  static FrameSlot slots[PIPELINE_DEPTH];
+  Pipeline pipeline(PIPELINE_DEPTH);
+  pipeline.addStage("decode", [&](int slot) {
+    DecodeFrame(slots[slot].frame, slots[slot].source);
+    return true;
+  }, [&](int slot) {
+    uint64_t tickIndex;
+    slots[slot].frame = nextFrame(tickIndex);
+    if (slots[slot].frame < 0) return false;
+    slots[slot].paced = pacer.beginFrame();
+    return true;
+  });
+  pipeline.addStage("rotate", [&](int slot) {
+    RotateFrame(slots[slot].source, slots[slot].canvas);
+    return true;
+  });
+  pipeline.addStage("post", [&](int slot) {
+    pacer.post(slots[slot].paced, gpu, &slots[slot].canvas[0][0]);
+    return true;
+  });
+  pipeline.run();
+#else
+  static FrameSlot slot;
+  uint64_t tickIndex;
+  int frame;
+  while ((frame = nextFrame(tickIndex)) >= 0) {
+    slot.paced = pacer.beginFrame();
+    DecodeFrame(frame, slot.source);
+    RotateFrame(slot.source, slot.canvas);
+    pacer.post(slot.paced, gpu, &slot.canvas[0][0]);
   }
-
+#endif
+
+  vsync.stop();
+  vsync.printStatistics();
+  pacer.printStatistics();
+  PrintSchedLatencies();
+  PrintMetrics();
+#ifdef STATISTICS
+  PrintSpiThreadTime();
+#endif
+#ifdef PIPELINED_RENDER
+  pipeline.printOccupancy();
+#endif
+  printf("Rendered %llu ticks, %llu ticks folded into later ones\n", (unsigned long long)renderTicks.renderedTicks(), (unsigned long long)renderTicks.missedTicks());
+#ifdef METRICS_EXPORT
+  StopMetricsExport();
+#endif
   gpu.deinit();
+  DeinitSPI();
+#ifdef FRAME_TRACING
+  DumpTrace(TRACE_FILE);
+#endif
 
 
 
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <FramePacer.hpp>
+#include <tick.h>
+#include <util.h>
+
+FramePacer::FramePacer(Vsync& vsync, uint64_t marginUsecs) : marginUsecs(marginUsecs) {
+    grid = [&vsync]() { return vsync.grid(); };
+}
+
+FramePacer::FramePacer(const function<VsyncGrid()>& grid, uint64_t marginUsecs) : grid(grid), marginUsecs(marginUsecs) {}
+
+// The first instant of the grid at or after usecs, rounded up to a whole usec
+uint64_t FramePacer::nextDeadline(const VsyncGrid& grid, uint64_t usecs) {
+    double periods = ceil(((double)usecs - (double)grid.tickUsecs) / grid.periodUsecs);
+    return grid.tickUsecs + (int64_t)ceil(periods * grid.periodUsecs);
+}
+
+static int cmpCost(const void *e1, const void *e2) { return (int)(*(uint32_t*)e1 > *(uint32_t*)e2) - (int)(*(uint32_t*)e1 < *(uint32_t*)e2); }
+
+uint64_t FramePacer::predictCost(uint64_t periodUsecs) {
+    uint32_t costs[FRAME_PACER_HISTORY];
+    int n;
+    {
+        lock_guard<mutex> lock(historyLock);
+        n = historySize;
+        for (int i = 0; i < n; ++i)
+            costs[i] = renderCosts[i] + postCosts[i] + transferCosts[i];
+    }
+    // Until there is some history, assume the frame takes a whole period
+    if (n < 4) return periodUsecs;
+    qsort(costs, n, sizeof(uint32_t), cmpCost);
+    return costs[(n - 1) * FRAME_PACER_PERCENTILE / 100];
+}
+
+PacedFrame FramePacer::beginFrame() {
+    PacedFrame frame = {};
+    VsyncGrid g = grid();
+    uint64_t periodUsecs = (uint64_t)(g.periodUsecs + 0.5);
+    uint64_t cost = predictCost(periodUsecs);
+    predictedCost.store(cost);
+
+    // The first deadline that the frame can still make if it starts now, but not the one that the previous frame was
+    // for. The grid that a source gives moves a little from frame to frame, so the same deadline is told by being
+    // less than half a period off.
+    uint64_t now = tick();
+    uint64_t deadline = nextDeadline(g, MAX(now + cost + marginUsecs, prevDeadline + periodUsecs / 2));
+    if (prevDeadline && deadline > prevDeadline + periodUsecs + periodUsecs / 2)
+        skippedDeadlines.fetch_add((deadline - prevDeadline + periodUsecs / 2) / periodUsecs - 1, memory_order_relaxed);
+    prevDeadline = deadline;
+
+    uint64_t startTime = deadline - cost - marginUsecs;
+    now = tick();
+    if (startTime > now) SleepUsecs(startTime - now);
+
+    frame.deadline = deadline;
+    frame.startTime = tick();
+    return frame;
+}
+
+void FramePacer::post(PacedFrame& frame, Gpu& gpu, uint16_t *canvas) {
+    frame.postTime = tick();
+    uint32_t fence = gpu.post(canvas);
+    frame.postedTime = tick();
+    endFrame(frame, MAX(gpu.waitFence(fence), frame.postedTime));
+}
+
+void FramePacer::endFrame(const PacedFrame& frame, uint64_t onGlass) {
+    if (onGlass > frame.deadline) missedDeadlines.fetch_add(1, memory_order_relaxed);
+    frames.fetch_add(1, memory_order_relaxed);
+
+    lock_guard<mutex> lock(historyLock);
+    renderCosts[historyTail] = (uint32_t)(frame.postTime - frame.startTime);
+    postCosts[historyTail] = (uint32_t)(frame.postedTime - frame.postTime);
+    transferCosts[historyTail] = (uint32_t)(onGlass - frame.postedTime);
+    historyTail = (historyTail + 1) % FRAME_PACER_HISTORY;
+    if (historySize < FRAME_PACER_HISTORY) ++historySize;
+}
+
+void FramePacer::statistics(FramePacerStatistics& stats) {
+    stats.frames = frames.load();
+    stats.missedDeadlines = missedDeadlines.load();
+    stats.skippedDeadlines = skippedDeadlines.load();
+    stats.predictedCostUsecs = predictedCost.load();
+    uint64_t renderTotal = 0, postTotal = 0, transferTotal = 0;
+    lock_guard<mutex> lock(historyLock);
+    int n = historySize;
+    for (int i = 0; i < n; ++i) {
+        renderTotal += renderCosts[i];
+        postTotal += postCosts[i];
+        transferTotal += transferCosts[i];
+    }
+    stats.renderUsecs = n ? renderTotal / n : 0;
+    stats.postUsecs = n ? postTotal / n : 0;
+    stats.transferUsecs = n ? transferTotal / n : 0;
+}
+
+void FramePacer::printStatistics() {
+    FramePacerStatistics stats;
+    statistics(stats);
+    printf("Frame pacer: %llu frames, %llu missed deadlines, %llu skipped deadlines, predicted cost %.2fms (render %.2fms + post %.2fms + transfer %.2fms on average)\n",
+        (unsigned long long)stats.frames, (unsigned long long)stats.missedDeadlines, (unsigned long long)stats.skippedDeadlines,
+        stats.predictedCostUsecs / 1000.0, stats.renderUsecs / 1000.0, stats.postUsecs / 1000.0, stats.transferUsecs / 1000.0);
+}
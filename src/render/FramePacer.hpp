@@ -0,0 +1,84 @@
+#pragma once
+
+#include <functional>
+#include <mutex>
+#include <atomic>
+#include <stdint.h>
+#include <display.h>
+#include <Gpu.hpp>
+#include <Vsync.hpp>
+
+using namespace std;
+
+// How many of the most recent frames the cost prediction looks at
+#define FRAME_PACER_HISTORY 64
+// The cost is predicted as this percentile of the recent frames' costs
+#define FRAME_PACER_PERCENTILE 90
+// Extra time left between the predicted end of a frame and its vsync deadline
+#ifndef FRAME_PACER_MARGIN_USECS
+#define FRAME_PACER_MARGIN_USECS 2000
+#endif
+
+struct FramePacerStatistics {
+    uint64_t frames; // Frames rendered
+    uint64_t missedDeadlines; // Frames that were on glass only after their vsync deadline
+    uint64_t skippedDeadlines; // Deadlines that were given up on, because the predicted cost did not fit before them anymore
+    uint64_t predictedCostUsecs; // Current prediction of render + post + transfer
+    uint64_t renderUsecs, postUsecs, transferUsecs; // Averages over the history
+};
+
+// A frame that the pacer started, with the times of its stages on the tick() clock
+struct PacedFrame {
+    uint64_t deadline; // The vsync deadline that the frame is meant to be on glass by
+    uint64_t startTime; // When rendering started
+    uint64_t postTime; // When rendering was done and the canvas went to Gpu::post()
+    uint64_t postedTime; // When Gpu::post() returned
+};
+
+// Starts each frame just in time for it to be on glass at the next vsync deadline, instead of right at the vsync.
+// The pacer learns what a frame costs (rendering the view, diffing and queueing it in Gpu::post, and sending it until
+// its fence signals), and starts rendering at the deadline minus a high percentile of the recent costs minus a margin.
+// That keeps the frame's content as fresh as possible while it still makes the deadline. The deadlines are the ticks
+// of a Vsync, so they follow its phase, or the panel's TE pulses when it is locked on them.
+//
+// The render loop calls beginFrame() before it renders, and post() (or endFrame()) with the rendered frame. With a
+// pipeline, those can be on different threads, and several frames can be in flight, each for a deadline of its own.
+class FramePacer {
+    private:
+        function<VsyncGrid()> grid; // Where the deadlines are
+
+        uint64_t marginUsecs;
+        uint64_t prevDeadline = 0;
+
+        // Costs of the most recent frames, in usecs
+        mutex historyLock;
+        uint32_t renderCosts[FRAME_PACER_HISTORY] = {};
+        uint32_t postCosts[FRAME_PACER_HISTORY] = {};
+        uint32_t transferCosts[FRAME_PACER_HISTORY] = {};
+        int historySize = 0;
+        int historyTail = 0;
+
+        atomic<uint64_t> frames{0};
+        atomic<uint64_t> missedDeadlines{0};
+        atomic<uint64_t> skippedDeadlines{0};
+        atomic<uint64_t> predictedCost{0};
+
+        uint64_t predictCost(uint64_t periodUsecs);
+        static uint64_t nextDeadline(const VsyncGrid& grid, uint64_t usecs);
+    public:
+        // Paces frames to the ticks of the Vsync, which must outlive the pacer
+        FramePacer(Vsync& vsync, uint64_t marginUsecs = FRAME_PACER_MARGIN_USECS);
+        // Paces frames to the instants of the grid that the function returns, e.g. a simulated one
+        FramePacer(const function<VsyncGrid()>& grid, uint64_t marginUsecs = FRAME_PACER_MARGIN_USECS);
+
+        // Picks the first deadline that a frame started now can still make, after the one the previous frame was
+        // for, and sleeps until the frame has to start for it. Called from one thread only.
+        PacedFrame beginFrame();
+        // Posts the rendered canvas of the frame, waits until it is on glass, and accounts for it
+        void post(PacedFrame& frame, Gpu& gpu, uint16_t *canvas);
+        // Accounts for a frame that was on glass at onGlass, with its postTime and postedTime filled in
+        void endFrame(const PacedFrame& frame, uint64_t onGlass);
+
+        void statistics(FramePacerStatistics& stats);
+        void printStatistics();
+};
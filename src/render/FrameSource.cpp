@@ -0,0 +1,54 @@
+#include <string.h>
+#include <FrameSource.hpp>
+#include <trace.h>
+#include <util.h>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image.h>
+
+bool LoadFrameImage(const char *path, uint16_t source[FRAME_SOURCE_HEIGHT][FRAME_SOURCE_WIDTH])
+{
+  int width = FRAME_SOURCE_WIDTH;
+  int height = FRAME_SOURCE_HEIGHT;
+  int channels = 3;
+  unsigned char *data = stbi_load(path, &width, &height, &channels, 0);
+
+  memset(source, 0, FRAME_SOURCE_HEIGHT * FRAME_SOURCE_WIDTH * sizeof(uint16_t));
+  if (!data) return false;
+  for (int y = 0; y < MIN(height, FRAME_SOURCE_HEIGHT); ++y) {
+    for (int x = 0; x < MIN(width, FRAME_SOURCE_WIDTH); ++x) {
+        unsigned char* pixel = data + (y * width + x) * channels;
+        unsigned char red = pixel[0];
+        unsigned char green = pixel[1];
+        unsigned char blue = pixel[2];
+
+        uint8_t r = (red >> 3) & 0x1F;   // Reduce to 5 bits
+        uint8_t g = (green >> 2) & 0x3F; // Reduce to 6 bits
+        uint8_t b = (blue >> 3) & 0x1F;  // Reduce to 5 bits
+
+        uint16_t rgb16 = (r << 11) | (g << 5) | b;
+
+        source[y][x] = rgb16;
+    }
+  }
+
+  stbi_image_free(data);
+  return true;
+}
+
+void RotateFrame(uint16_t source[FRAME_SOURCE_HEIGHT][FRAME_SOURCE_WIDTH], uint16_t destination[FRAME_SOURCE_WIDTH][FRAME_SOURCE_HEIGHT])
+{
+  TRACE_SCOPE("rotate");
+  uint16_t tempBuffer[320][240];
+  for (int i = 0; i < 240; ++i) {
+      for (int j = 0; j < 320; ++j) {
+          tempBuffer[j][240 - 1 - i] = source[i][j];
+      }
+  }
+
+  for (int i = 0; i < 320; ++i) {
+    for (int j = 0; j < 240; ++j) {
+      destination[i][240 - 1 - j] = tempBuffer[i][j];
+    }
+  }
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdint.h>
+
+// Size of the frames of the animations in res/, as they are drawn (landscape)
+#define FRAME_SOURCE_WIDTH 320
+#define FRAME_SOURCE_HEIGHT 240
+
+// Loads an image (any format that stb_image reads) and converts it to RGB565, cropped to the frame size. An image
+// that fails to load comes out black, and false is returned.
+bool LoadFrameImage(const char *path, uint16_t source[FRAME_SOURCE_HEIGHT][FRAME_SOURCE_WIDTH]);
+
+// Rotates a decoded frame into the canvas that the Gpu takes
+void RotateFrame(uint16_t source[FRAME_SOURCE_HEIGHT][FRAME_SOURCE_WIDTH], uint16_t destination[FRAME_SOURCE_WIDTH][FRAME_SOURCE_HEIGHT]);
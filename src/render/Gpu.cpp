@@ -2,43 +2,58 @@
 #include <display.h>
 #include <Gpu.hpp>
 #include <spi.h>
+#include <trace.h>
+#include <metrics.h>
 
 Gpu::Gpu() {
 
 }
 
-void Gpu::init() {
-    OpenMailbox();
-    InitSPI();
-    
-    gpuFrameWidth = 240;
-    gpuFrameHeight = 320;
+void Gpu::init(SpiTransport *(*createTransport)()) {
+    InitSPI(1, createTransport);
+    init(spiBus->panels[0]);
+    ownsBus = true;
+}
+
+void Gpu::init(spi_loop* panel) {
+    init(&panel, 1, GPU_LAYOUT_SPLIT);
+}
+
+void Gpu::init(spi_loop** loops, int numPanels, GpuLayout layout) {
+    this->numPanels = numPanels;
+    this->layout = layout;
+    ownsBus = false;
+
+    // The canvas is rotated into the panels' portrait scan order, where the columns of the canvas become rows. In split
+    // layout the panels' rows are stacked, so that a single diff pass covers all of them.
+    int numRegions = (layout == GPU_LAYOUT_SPLIT) ? numPanels : 1;
+    gpuFrameWidth = GPU_PANEL_CANVAS_HEIGHT;
+    gpuFrameHeight = GPU_PANEL_CANVAS_WIDTH * numRegions;
 
     displayXOffset = 0;
     displayYOffset = 0;
 
-    gpuFramebufferScanlineStrideBytes = 480;
-    gpuFramebufferSizeBytes = 153600;
-
-    excessPixelsLeft = 0;
-    excessPixelsRight = 0;
-    excessPixelsTop = 0;
-    excessPixelsBottom = 0;
+    gpuFramebufferScanlineStrideBytes = gpuFrameWidth * FRAMEBUFFER_BYTESPERPIXEL;
+    gpuFramebufferSizeBytes = gpuFramebufferScanlineStrideBytes * gpuFrameHeight;
 
+    for (int i = 0; i < numPanels; ++i) {
+        panels[i] = GpuPanel();
+        panels[i].loop = loops[i];
+        // Canvas column x lands on rotated row gpuFrameHeight-1-x, so the leftmost panel gets the bottom rows
+        panels[i].firstRow = (layout == GPU_LAYOUT_SPLIT) ? (numRegions - 1 - i) * GPU_PANEL_CANVAS_WIDTH : 0;
+        printf("Panel on chip select %d shows rows %d-%d\n", loops[i]->chipSelect, panels[i].firstRow, panels[i].firstRow + GPU_PANEL_CANVAS_WIDTH - 1);
+    }
     printf("Display X offset %d\n", displayXOffset);
     printf("Display Y offset %d\n", displayYOffset);
 
     printf("GPU Frames Buffer Scanlines Stride Bytes %d\n", gpuFramebufferScanlineStrideBytes);
     printf("GPU Frame Buffer Size Bytes %d\n", gpuFramebufferSizeBytes);
 
-    printf("Display excessPixelsLeft %d\n", excessPixelsLeft);
-    printf("Display excessPixelsRight %d\n", excessPixelsRight);
-    printf("Display excessPixelsTop %d\n", excessPixelsTop);
-    printf("Display excessPixelsBottom %d\n", excessPixelsBottom);
-
-    printf("GPU Frame Width: %d, GPU Frame Height: %d", gpuFrameWidth, gpuFrameHeight);
+    printf("GPU Frame Width: %d, GPU Frame Height: %d\n", gpuFrameWidth, gpuFrameHeight);
 
-    spans = (Span *)Malloc((gpuFrameWidth * gpuFrameHeight / 2) * sizeof(Span), "main() task spans");
+    // Spans that cross from one panel to the next are cut in two, which takes one more span per crossing span. At most
+    // one span per pixel column can cross each boundary.
+    spans = (Span *)Malloc((gpuFrameWidth * gpuFrameHeight / 2 + gpuFrameWidth * (numRegions - 1)) * sizeof(Span), "main() task spans");
 
     int size = gpuFramebufferSizeBytes;
     framebuffer[0] = (uint16_t *)Malloc(size, "main() framebuffer0");
@@ -47,8 +62,8 @@ void Gpu::init() {
     memset(framebuffer[0], 0, size);                    // Doublebuffer received GPU memory contents, first buffer contains current GPU memory,
     memset(framebuffer[1], 0, gpuFramebufferSizeBytes); // second buffer contains whatever the display is currently showing. This allows diffing pixels between the two.
 
-    curFrameEnd = spiTaskMemory->queueTail;
-    prevFrameEnd = spiTaskMemory->queueTail;
+    framesPosted = 0;
+    memset(frameFences, 0, sizeof(frameFences));
 
     prevFrameWasInterlacedUpdate = false;
     interlacedUpdate = false; // True if the previous update we did was an interlaced half field update.
@@ -70,7 +85,15 @@ int Gpu::countChangedPixels(uint16_t *framebuffer, uint16_t *prevFramebuffer) {
   return changedPixels;
 }
 
-void Gpu::createSpans(Span*& head, uint16_t* framebuffer, uint16_t* prevFramebuffer, bool interlacedDiff, int interlacedFieldParity) {
+int Gpu::canvasWidth() const {
+  return (layout == GPU_LAYOUT_SPLIT) ? GPU_PANEL_CANVAS_WIDTH * numPanels : GPU_PANEL_CANVAS_WIDTH;
+}
+
+int Gpu::canvasHeight() const {
+  return GPU_PANEL_CANVAS_HEIGHT;
+}
+
+int Gpu::createSpans(Span*& head, uint16_t* framebuffer, uint16_t* prevFramebuffer, bool interlacedDiff, int interlacedFieldParity) {
   int numSpans = 0;
 
   int y = interlacedDiff ? interlacedFieldParity : 0;
@@ -170,6 +193,7 @@ void Gpu::createSpans(Span*& head, uint16_t* framebuffer, uint16_t* prevFramebuf
     scanline += scanlineEndInc;
     prevScanline += scanlineEndInc;
   }
+  return numSpans;
 }
 
 void Gpu::optimizeSpans(Span* head) {
@@ -215,45 +239,178 @@ void Gpu::optimizeSpans(Span* head) {
   }
 }
 
-void Gpu::postDisplayXPositionUpdate(spi_loop* loop, uint16_t position) {
-  SPITask *task = spi_create_task(loop, 2);
-  task->cmd = 0x2A; // CASET
-  task->data[0] = (position) >> 8;
-  task->data[1] = (position) & 0xFF;
-  // bytesTransferred += 3;
-  spi_commit_task(loop, task);
+void Gpu::setDisplayXPosition(SPIWindow& window, uint16_t position) {
+  window.casetSize = 2; // CASET
+  window.caset[0] = (position) >> 8;
+  window.caset[1] = (position) & 0xFF;
+}
+
+void Gpu::setDisplayYPosition(SPIWindow& window, uint16_t position) {
+  window.rasetSize = 2; // RASET
+  window.raset[0] = (position) >> 8;
+  window.raset[1] = (position) & 0xFF;
+}
+
+void Gpu::setDisplayXWindow(SPIWindow& window, uint16_t start, uint16_t end) {
+  window.casetSize = 4; // CASET
+  window.caset[0] = (start) >> 8;
+  window.caset[1] = (start) & 0xFF;
+  window.caset[2] = (end) >> 8;
+  window.caset[3] = (end) & 0xFF;
 }
 
-void Gpu::postDisplayYPositionUpdate(spi_loop* loop, uint16_t position) {
-  SPITask *task = spi_create_task(loop, 2);
-  task->cmd = 0x2B; // RASET
-  task->data[0] = (position) >> 8;
-  task->data[1] = (position) & 0xFF;
-  // bytesTransferred += 3;
-  spi_commit_task(loop, task);
+// Cuts the spans at the boundaries between the panels' rows, and links each piece into the list of the panel that
+// shows it. Pieces beyond the first are taken from freeSpans. The list is sorted by y, so every panel's list is as well.
+void Gpu::routeSpans(Span* head, Span* freeSpans) {
+  Span* tails[SPI_MAX_PANELS] = {};
+  for (int p = 0; p < numPanels; ++p) panels[p].head = 0;
+
+  for (Span *i = head, *next; i; i = next) {
+    next = i->next;
+    int p = 0;
+    while (i->y < panels[p].firstRow || i->y >= panels[p].firstRow + GPU_PANEL_CANVAS_WIDTH) ++p;
+
+    int boundary = panels[p].firstRow + GPU_PANEL_CANVAS_WIDTH;
+    if (i->endY > boundary) {
+      // Rows before the last one are full [x, endX[, so the cut leaves a full rectangle above the boundary, and the rest
+      // (with the partial last row) continues on the panel below it
+      Span *rest = freeSpans++;
+      *rest = *i;
+      rest->y = boundary;
+      rest->size = (rest->endX - rest->x) * (rest->endY - rest->y - 1) + (rest->lastScanEndX - rest->x);
+      rest->next = next;
+      next = rest;
+
+      i->endY = boundary;
+      i->lastScanEndX = i->endX;
+      i->size = (i->endX - i->x) * (i->endY - i->y);
+    }
+
+    i->next = 0;
+    if (tails[p]) tails[p]->next = i;
+    else panels[p].head = i;
+    tails[p] = i;
+  }
 }
 
-void Gpu::postDisplayXWindowUpdate(spi_loop* loop, uint16_t start, uint16_t end) {
-  SPITask *task = spi_create_task(loop, 4);
-  task->cmd = 0x2A; // CASET
-  task->data[0] = (start) >> 8;
-  task->data[1] = (start) & 0xFF;
-  task->data[2] = (end) >> 8;
-  task->data[3] = (end) & 0xFF;
-  // bytesTransferred += 5;
-  spi_commit_task(loop, task);
+// The panels are mounted in portrait, so the landscape canvas is rotated into the framebuffer, with the regions of the
+// panels stacked on top of each other
+void Gpu::transposeCanvas(const uint16_t* buffer) {
+    const int canvasW = canvasWidth();
+    uint16_t *fb = framebuffer[0];
+    for (int i = 0; i < gpuFrameWidth; ++i) {
+      const uint16_t *src = buffer + (gpuFrameWidth - 1 - i) * canvasW + (canvasW - 1);
+      for (int j = 0; j < gpuFrameHeight; ++j) {
+        fb[j * gpuFrameWidth + i] = src[-j];
+      }
+    }
 }
 
-void Gpu::post(uint16_t* buffer) {
-    uint16_t rotatedBuffer[320][240];
-    for (int i = 0; i < 240; ++i) {
-        for (int j = 0; j < 320; ++j) {
-            rotatedBuffer[j][i] = buffer[(239 - i) * 320 + (319 - j)];
+// Copies the pixels of the span from the framebuffer to data, byte swapped to the big endian RGB565 that the display takes
+void Gpu::packSpan(const Span* span, uint16_t* data) {
+    uint16_t *scanline = framebuffer[0] + span->y * (gpuFramebufferScanlineStrideBytes >> 1);
+    for (int y = span->y; y < span->endY; ++y, scanline += gpuFramebufferScanlineStrideBytes >> 1) {
+      int endX = (y + 1 == span->endY) ? span->lastScanEndX : span->endX;
+      int x = span->x;
+
+      while (x < endX && (x % 2 != 0)) {
+        uint16_t pixel = __builtin_bswap16(scanline[x]); // to big endian
+        memcpy(data, &pixel, sizeof(uint16_t));
+        data += 1;
+        x += 1;
+      }
+
+      while (x < (endX & ~1))
+      {
+        uint32_t twoPixels; // = *(uint32_t*) (scanline + x);
+        memcpy(&twoPixels, scanline + x, sizeof(uint32_t));
+        twoPixels = ((twoPixels & 0xFF00FF00U) >> 8) | ((twoPixels & 0x00FF00FFU) << 8);
+        memcpy(data, &twoPixels, sizeof(uint32_t)); 
+        data += 2;
+        x += 2;
+      }
+
+      while (x < endX) {
+        uint16_t pixel = __builtin_bswap16(scanline[x]); // to big endian
+        memcpy(data, &pixel, sizeof(uint16_t));
+        x += 1;
+        data += 1;
+      }
+    }
+}
+
+// Queues the spans of the panel as fused window + pixel write tasks, tracking the panel's window to leave out the
+// CASET/RASET updates that are not needed. Returns the number of bytes queued.
+int Gpu::submitSpans(GpuPanel& panel, uint64_t submitTime) {
+    int bytesTransferred = 0;
+    int displayYOffset = this->displayYOffset - panel.firstRow; // Span rows are canvas rows, this maps them to the panel's rows
+
+    for (Span *i = panel.head; i; i = i->next) {
+        // Any cursor/window changes needed by this span are fused into the header of its pixel write task
+        SPIWindow window = {};
+
+        if (panel.spiY != i->y) {
+          setDisplayYPosition(window, displayYOffset + i->y);
+          panel.spiY = i->y;
         }
+
+        if (i->endY > i->y + 1 && (panel.spiX != i->x || panel.spiEndX != i->endX)) { // Multiline span
+          setDisplayXWindow(window, displayXOffset + i->x, displayXOffset + i->endX - 1);
+          panel.spiX = i->x;
+          panel.spiEndX = i->endX;
+        } else { // Singleline span
+          if (panel.spiEndX < i->endX) { // Update X end window
+            // We are doing a single line span and need to increase the X window. If possible,
+            // peek ahead to cater to the next multiline span update if that will be compatible.
+            
+            // TODO: Optimize next end x, cause looks like it has mistake, if next single line span end x is greater than 
+            // the next multiline span end x, it will lead to unnessary update
+            int nextEndX = gpuFrameWidth;
+            for (Span *j = i->next; j; j = j->next) {
+              if (j->endY > j->y + 1) {
+                if (j->endX >= i->endX) {
+                  nextEndX = j->endX;
+                }
+                break;
+              }
+            }
+            setDisplayXWindow(window, displayXOffset + i->x, displayXOffset + nextEndX - 1);
+            panel.spiX = i->x;
+            panel.spiEndX = nextEndX;
+          } else {
+            if (panel.spiX != i->x) { // Update X start window
+              setDisplayXPosition(window, displayXOffset + i->x);
+              panel.spiX = i->x;
+            }
+          }
+        }
+
+        bool hasWindow = window.casetSize || window.rasetSize;
+        SPITask *task = spi_create_task(panel.loop, (hasWindow ? sizeof(SPIWindow) : 0) + i->size * SPI_BYTESPERPIXEL);
+        task->cmd = DISPLAY_WRITE_PIXELS;
+        if (hasWindow) {
+          task->flags |= SPI_TASK_WINDOW;
+          memcpy(task->Window(), &window, sizeof(SPIWindow));
+        }
+        if (!i->next) {
+          // Lets the SPI thread know where control commands can be slotted in without tearing, and when the frame is on glass
+          task->flags |= SPI_TASK_FRAME_END;
+          task->fence = spi_issue_fence(panel.loop, submitTime);
+          panel.prevFrameFence = panel.curFrameFence;
+          panel.curFrameFence = task->fence;
+        }
+
+        bytesTransferred += task->BusBytes();
+        packSpan(i, (uint16_t*)task->PayloadStart());
+
+        spi_commit_task(panel.loop, task);
     }
-	buffer = &rotatedBuffer[0][0];
+    return bytesTransferred;
+}
 
-    // memcpy(framebuffer[0], buffer, gpuFramebufferSizeBytes);
+uint32_t Gpu::post(uint16_t* buffer) {
+    TRACE_SCOPE_ARG("Gpu::post", framesPosted + 1);
+    uint64_t submitTime = tick();
 
     // printf("All initialized, now running main loop...\n");
 
@@ -276,42 +433,13 @@ void Gpu::post(uint16_t* buffer) {
 
     // At all times keep at most two rendered frames in the SPI task queue pending to be displayed. Only proceed to submit a new frame
     // once the older of those has been displayed.
-    bool once = true;
-    while ((spiTaskMemory->queueTail + SPI_QUEUE_SIZE - spiTaskMemory->queueHead) % SPI_QUEUE_SIZE > (spiTaskMemory->queueTail + SPI_QUEUE_SIZE - prevFrameEnd) % SPI_QUEUE_SIZE)
-    {
-      if (spiTaskMemory->spiBytesQueued > 10000)
-        spiThreadWasWorkingHardBefore = true; // SPI thread had too much work in queue atm (2 full frames)
-
-      // Peek at the SPI thread's workload and throttle a bit if it has got a lot of work still to do.
-      double usecsUntilSpiQueueEmpty = spiTaskMemory->spiBytesQueued * spiUsecsPerByte;
-      printf("SPI thread had too much work in queue atm (2 full frames)! %d", usecsUntilSpiQueueEmpty);
-      if (usecsUntilSpiQueueEmpty > 0)
+    for (int p = 0; p < numPanels; ++p) {
+      if (!spi_fence_signaled(panels[p].loop, panels[p].prevFrameFence))
       {
-        uint32_t bytesInQueueBefore = spiTaskMemory->spiBytesQueued;
-        uint32_t sleepUsecs = (uint32_t)(usecsUntilSpiQueueEmpty * 0.4);
-#ifdef STATISTICS
-        uint64_t t0 = tick();
-#endif
-        if (sleepUsecs > 1000)
-          usleep(500);
-
-#ifdef STATISTICS
-        uint64_t t1 = tick();
-        uint32_t bytesInQueueAfter = spiTaskMemory->spiBytesQueued;
-        bool starved = (spiTaskMemory->queueHead == spiTaskMemory->queueTail);
-        if (starved)
-          spiThreadWasWorkingHardBefore = false;
-
-/*
-        if (once && starved)
-        {
-          printf("Had %u bytes in queue, asked to sleep for %u usecs, got %u usecs sleep, afterwards %u bytes in queue. (got %.2f%% work done)%s\n",
-            bytesInQueueBefore, sleepUsecs, (uint32_t)(t1 - t0), bytesInQueueAfter, (bytesInQueueBefore-bytesInQueueAfter)*100.0/bytesInQueueBefore,
-            starved ? "  SLEPT TOO LONG, SPI THREAD STARVED" : "");
-          once = false;
-        }
-*/
-#endif
+        TRACE_SCOPE_ARG("fence wait", p);
+        if (panels[p].loop->taskMemory->spiBytesQueued > 10000)
+          spiThreadWasWorkingHardBefore = true; // SPI thread had too much work in queue atm (2 full frames)
+        spi_fence_wait(panels[p].loop, panels[p].prevFrameFence);
       }
     }
 
@@ -319,30 +447,8 @@ void Gpu::post(uint16_t* buffer) {
       printf("GPU Thread had too much too work !\n");
     }
 
-    int expiredFrames = 0;
-    uint64_t now = tick();
-    while (expiredFrames < frameTimeHistorySize && now - frameTimeHistory[expiredFrames].time >= FRAMERATE_HISTORY_LENGTH)
-      ++expiredFrames;
-    if (expiredFrames > 0)
-    {
-      frameTimeHistorySize -= expiredFrames;
-      for (int i = 0; i < frameTimeHistorySize; ++i)
-        frameTimeHistory[i] = frameTimeHistory[i + expiredFrames];
-    }
-
-    // printf("Expired frames logic!");
-
-#ifdef STATISTICS
-    int expiredSkippedFrames = 0;
-    while (expiredSkippedFrames < frameSkipTimeHistorySize && now - frameSkipTimeHistory[expiredSkippedFrames] >= 1000000 /*FRAMERATE_HISTORY_LENGTH*/)
-      ++expiredSkippedFrames;
-    if (expiredSkippedFrames > 0)
-    {
-      frameSkipTimeHistorySize -= expiredSkippedFrames;
-      for (int i = 0; i < frameSkipTimeHistorySize; ++i)
-        frameSkipTimeHistory[i] = frameSkipTimeHistory[i + expiredSkippedFrames];
-    }
-#endif
+    // All panels show frames from the same source, so the source frame rate is only tracked on the first one
+    bool tracksFrameRate = (panels[0].loop == spiBus->panels[0]);
 
     int numNewFrames = 1;// __atomic_load_n(&numNewGpuFrames, __ATOMIC_SEQ_CST);
     // usleep(16 * 1000);
@@ -352,17 +458,21 @@ void Gpu::post(uint16_t* buffer) {
     uint64_t frameObtainedTime;
     if (gotNewFramebuffer)
     {
-      memcpy(framebuffer[0], buffer, gpuFramebufferSizeBytes);
+      TRACE_BEGIN(transposeStart);
+      transposeCanvas(buffer);
+      TRACE_END(transposeStart, "transpose", 0);
 
 #ifdef STATISTICS
-      uint64_t now = tick();
-      for (int i = 0; i < numNewFrames - 1 && frameSkipTimeHistorySize < FRAMERATE_HISTORY_LENGTH; ++i)
-        frameSkipTimeHistory[frameSkipTimeHistorySize++] = now;
+      if (tracksFrameRate) __atomic_fetch_add(&statsFramesSkipped, numNewFrames - 1, __ATOMIC_RELAXED);
 #endif
       //usleep(20 * 1000);
       // __atomic_fetch_sub(&numNewGpuFrames, numNewFrames, __ATOMIC_SEQ_CST);
 
-      DrawStatisticsOverlay(framebuffer[0]);
+      // Each panel gets its own overlay. In the mirrored layout all panels show the same region, so it is drawn once.
+      for (int p = 0; p < (layout == GPU_LAYOUT_SPLIT ? numPanels : 1); ++p) {
+        uint16_t *region = framebuffer[0] + panels[p].firstRow * (gpuFramebufferScanlineStrideBytes >> 1);
+        DrawStatisticsOverlay(region, gpuFrameWidth, gpuFramebufferScanlineStrideBytes, GPU_PANEL_CANVAS_WIDTH, panels[p].loop->chipSelect);
+      }
 
       if (!displayOff)
         RefreshStatisticsOverlayText();
@@ -376,11 +486,32 @@ void Gpu::post(uint16_t* buffer) {
 
     const double tooMuchToUpdateUsecs = timesliceToUseForScreenUpdates / desiredTargetFps; // If updating the current and new frame takes too many frames worth of allotted time, drop to interlacing.
 
+    TRACE_BEGIN(countStart);
     int numChangedPixels = framebufferHasNewChangedPixels ? countChangedPixels(framebuffer[0], framebuffer[1]) : 0;
+    TRACE_END(countStart, "countChangedPixels", numChangedPixels);
+
+#ifdef TURN_DISPLAY_OFF_AFTER_USECS_OF_INACTIVITY
+    // While the panels are off, the previous frame is what they showed when they went off, so the changes add up until
+    // there are enough of them to wake the panels up, and are then all sent
+    uint64_t now = tick();
+    if (!displayContentsLastChanged || numChangedPixels > DISPLAY_CONSIDERED_INACTIVE_PERCENTAGE * gpuFrameWidth * gpuFrameHeight) {
+      displayContentsLastChanged = now;
+      if (displayOff) {
+        TurnDisplayOn();
+        displayOff = false;
+      }
+    } else if (!displayOff && now - displayContentsLastChanged > TURN_DISPLAY_OFF_AFTER_USECS_OF_INACTIVITY) {
+      TurnDisplayOff();
+      displayOff = true;
+    }
+#endif
     // printf("Number of changed pixels, %d\n", numChangedPixels);
 
     uint32_t bytesToSend = numChangedPixels * SPI_BYTESPERPIXEL + (DISPLAY_DRAWABLE_HEIGHT << 1);
-    interlacedUpdate = ((bytesToSend + spiTaskMemory->spiBytesQueued) * spiUsecsPerByte > tooMuchToUpdateUsecs); // Decide whether to do interlacedUpdate - only updates half of the screen
+    // The panels share the bus, so what decides whether this frame fits in time is the backlog of all of them
+    uint32_t bytesQueued = spi_bus_bytes_queued(panels[0].loop->bus);
+    MetricsRecord(&queueDepthMetric, bytesQueued);
+    interlacedUpdate = ((bytesToSend + bytesQueued) * spiUsecsPerByte > tooMuchToUpdateUsecs); // Decide whether to do interlacedUpdate - only updates half of the screen
 
     assert(!interlacedUpdate);
 
@@ -392,121 +523,98 @@ void Gpu::post(uint16_t* buffer) {
     Span *head = 0;
 
     if (framebufferHasNewChangedPixels || prevFrameWasInterlacedUpdate) {
-        createSpans(head, framebuffer[0], framebuffer[1], interlacedUpdate, frameParity);
+        TRACE_BEGIN(createStart);
+        int numSpans = createSpans(head, framebuffer[0], framebuffer[1], interlacedUpdate, frameParity);
+        TRACE_END(createStart, "createSpans", numSpans);
+        MetricsRecord(&frameSpansMetric, numSpans);
         // NoDiffChangedRectangle(head);
 
         // Merge spans together on adjacent scanlines - works only if doing a progressive update
         if (!interlacedUpdate) {
+          TRACE_SCOPE("optimizeSpans");
           optimizeSpans(head);
         }
-    }
-    
-    // Submit spans
-    if (!displayOff) {
-      for (Span *i = head; i; i = i->next) {
-        if (spiY != i->y) {
-          postDisplayYPositionUpdate(loop, displayYOffset + i->y);
-          spiY = i->y;
-        }
 
-        if (i->endY > i->y + 1 && (spiX != i->x || spiEndX != i->endX)) { // Multiline span
-          postDisplayXWindowUpdate(loop, displayXOffset + i->x, displayXOffset + i->endX - 1);
-          spiX = i->x;
-          spiEndX = i->endX;
-        } else { // Singleline span
-          if (spiEndX < i->endX) { // Update X end window
-            // We are doing a single line span and need to increase the X window. If possible,
-            // peek ahead to cater to the next multiline span update if that will be compatible.
-            
-            // TODO: Optimize next end x, cause looks like it has mistake, if next single line span end x is greater than 
-            // the next multiline span end x, it will lead to unnessary update
-            int nextEndX = gpuFrameWidth;
-            for (Span *j = i->next; j; j = j->next) {
-              if (j->endY > j->y + 1) {
-                if (j->endX >= i->endX) {
-                  nextEndX = j->endX;
-                }
-                break;
-              }
-            }
-            postDisplayXWindowUpdate(loop, displayXOffset + i->x, displayXOffset + nextEndX - 1);
-            spiX = i->x;
-            spiEndX = nextEndX;
-          } else {
-            if (spiX != i->x) { // Update X start window
-              postDisplayXPositionUpdate(loop, displayXOffset + i->x);
-              spiX = i->x;
+        // The diff is done once for the whole canvas, so the previous frame is updated here and not per panel. While the
+        // panels are off nothing is submitted, so the previous frame must keep what is on the panels.
+        if (!displayOff) {
+          for (Span *i = head; i; i = i->next) {
+            uint16_t *scanline = framebuffer[0] + i->y * (gpuFramebufferScanlineStrideBytes >> 1);
+            uint16_t *prevScanline = framebuffer[1] + i->y * (gpuFramebufferScanlineStrideBytes >> 1);
+            for (int y = i->y; y < i->endY; ++y, scanline += gpuFramebufferScanlineStrideBytes >> 1, prevScanline += gpuFramebufferScanlineStrideBytes >> 1) {
+              int endX = (y + 1 == i->endY) ? i->lastScanEndX : i->endX;
+              memcpy(prevScanline + i->x, scanline + i->x, (endX - i->x) * FRAMEBUFFER_BYTESPERPIXEL);
             }
           }
         }
 
-        SPITask *task = spi_create_task(loop, i->size * SPI_BYTESPERPIXEL);
-        task->cmd = DISPLAY_WRITE_PIXELS;
-
-        bytesTransferred += task->PayloadSize() + 1; // + command byte
-        
-        uint16_t *scanline = framebuffer[0] + i->y * (gpuFramebufferScanlineStrideBytes >> 1);
-        uint16_t *prevScanline = framebuffer[1] + i->y * (gpuFramebufferScanlineStrideBytes >> 1);
-
-        uint16_t *data = (uint16_t*) task->data;
-        for (int y = i->y; y < i->endY; ++y, scanline += gpuFramebufferScanlineStrideBytes >> 1, prevScanline += gpuFramebufferScanlineStrideBytes >> 1) {
-          int endX = (y + 1 == i->endY) ? i->lastScanEndX : i->endX;
-          int x = i->x;
-
-          while (x < endX && (x % 2 != 0)) {
-            uint16_t pixel = __builtin_bswap16(scanline[x]); // to big endian
-            memcpy(data, &pixel, sizeof(uint16_t));
-            data += 1;
-            x += 1;
-          }
-
-          while (x < (endX & ~1U))
-          {
-            uint32_t twoPixels; // = *(uint32_t*) (scanline + x);
-            memcpy(&twoPixels, scanline + x, sizeof(uint32_t));
-            twoPixels = ((twoPixels & 0xFF00FF00U) >> 8) | ((twoPixels & 0x00FF00FFU) << 8);
-            memcpy(data, &twoPixels, sizeof(uint32_t)); 
-            data += 2;
-            x += 2;
-          }
-
-          while (x < endX) {
-            uint16_t pixel = __builtin_bswap16(scanline[x]); // to big endian
-            memcpy(data, &pixel, sizeof(uint16_t));
-            x += 1;
-            data += 1;
-          }
-          
-          memcpy(prevScanline + i->x, scanline + i->x, (endX - i->x) * FRAMEBUFFER_BYTESPERPIXEL);
+        if (layout == GPU_LAYOUT_SPLIT) {
+          routeSpans(head, spans + numSpans);
+        } else {
+          // Every panel replays the same span stream, with its own cursor and window state
+          for (int p = 0; p < numPanels; ++p) panels[p].head = head;
         }
-
-        spi_commit_task(loop, task);
+    } else {
+      for (int p = 0; p < numPanels; ++p) panels[p].head = 0;
+    }
+    
+    // Submit spans
+    if (!displayOff) {
+      for (int p = 0; p < numPanels; ++p) {
+        TRACE_SCOPE_ARG("submitSpans", p);
+        bytesTransferred += submitSpans(panels[p], submitTime);
       }
     }
 
-    // Remember where in the command queue this frame ends, to keep track of the SPI thread's progress over it
-    if (bytesTransferred > 0)
+    MetricsRecord(&frameBytesMetric, bytesTransferred);
+    if (bytesTransferred > 0 && tracksFrameRate)
     {
-      prevFrameEnd = curFrameEnd;
-      curFrameEnd = spiTaskMemory->queueTail;
-    }
-
+      uint64_t now = tick();
+      if (lastFrameTime) MetricsRecord(&frameIntervalMetric, now - lastFrameTime);
+      lastFrameTime = now;
 #ifdef STATISTICS
-    if (bytesTransferred > 0)
-    {
-      if (frameTimeHistorySize < FRAME_HISTORY_MAX_SIZE)
-      {
-        frameTimeHistory[frameTimeHistorySize].interlaced = interlacedUpdate || prevFrameWasInterlacedUpdate;
-        frameTimeHistory[frameTimeHistorySize++].time = tick();
-      }
-      AddFrameCompletionTimeMarker();
+      __atomic_fetch_add((interlacedUpdate || prevFrameWasInterlacedUpdate) ? &statsInterlacedFrames : &statsProgressiveFrames, 1, __ATOMIC_RELAXED);
+      AddFrameCompletionTimeMarker(now);
+#endif
     }
+#ifdef STATISTICS
     statsBytesTransferred += bytesTransferred;
 #endif
+
+    // If nothing changed on a panel, its part of the frame is on glass once its previous frame is
+    ++framesPosted;
+    for (int p = 0; p < numPanels; ++p) {
+      frameFences[framesPosted % GPU_FRAME_FENCE_HISTORY][p] = panels[p].curFrameFence;
+    }
+    return framesPosted;
+}
+
+// Fences of frames that have dropped out of the history are long signaled, as only two frames are ever in flight
+bool Gpu::isFenceSignaled(uint32_t fence) {
+  if (fence == 0 || framesPosted - fence >= GPU_FRAME_FENCE_HISTORY) return true;
+  for (int p = 0; p < numPanels; ++p) {
+    if (!spi_fence_signaled(panels[p].loop, frameFences[fence % GPU_FRAME_FENCE_HISTORY][p])) return false;
+  }
+  return true;
+}
+
+uint64_t Gpu::waitFence(uint32_t fence) {
+  if (fence == 0 || framesPosted - fence >= GPU_FRAME_FENCE_HISTORY) return tick();
+  uint64_t onGlass = 0;
+  for (int p = 0; p < numPanels; ++p) {
+    uint64_t panelOnGlass = spi_fence_wait(panels[p].loop, frameFences[fence % GPU_FRAME_FENCE_HISTORY][p]);
+    onGlass = MAX(onGlass, panelOnGlass);
+  }
+  return onGlass;
 }
 
 void Gpu::deinit() {
-    DeinitSPI();
-    CloseMailbox();
+    if (ownsBus) DeinitSPI();
+    free(spans);
+    free(framebuffer[0]);
+    free(framebuffer[1]);
+    spans = nullptr;
+    framebuffer[0] = framebuffer[1] = nullptr;
+    numPanels = 0;
     printf("Quit.\n");
-}
\ No newline at end of file
+}
@@ -31,34 +31,67 @@
 #include "mem_alloc.h"
 #include <st7789V.h>
 
+// Size of the frame that one panel shows, as posted (landscape, before the rotation to the panel's portrait scan order)
+#define GPU_PANEL_CANVAS_WIDTH 320
+#define GPU_PANEL_CANVAS_HEIGHT 240
+
+// How the panels of a Gpu share the posted canvas
+enum GpuLayout {
+    GPU_LAYOUT_SPLIT,   // The canvas is the panels side by side (e.g. 640x240 for two), panel 0 on the left
+    GPU_LAYOUT_MIRRORED // Every panel shows the whole 320x240 canvas
+};
+
+// Remembers the on-glass fences of this many of the most recently posted frames
+#define GPU_FRAME_FENCE_HISTORY 16
+
+// A panel that a Gpu drives, and the display side state that is kept per panel
+struct GpuPanel {
+    spi_loop* loop = nullptr;
+    int firstRow = 0; // First row of the rotated canvas that this panel shows
+
+    // Window that the panel's CASET/RASET currently point to
+    int spiX = -1;
+    int spiEndX = DISPLAY_WIDTH;
+    int spiY = -1;
+
+    // Fences of the two most recently submitted frames that had changes on this panel
+    uint32_t curFrameFence = 0;
+    uint32_t prevFrameFence = 0;
+
+    Span* head = nullptr; // Spans routed to this panel in the current post()
+};
+
 class Gpu {
+    friend class GpuBenchmark; // tools/bench/pixel_bench times the private hot paths on their own
 
     private:
-        // int gpuFrameWidth = 240;
-        // int gpuFrameHeight = 320;
+        GpuPanel panels[SPI_MAX_PANELS];
+        int numPanels = 0;
+        GpuLayout layout = GPU_LAYOUT_SPLIT;
+        bool ownsBus = false; // True if init() started the SPI bus, and deinit() should stop it
 
-        // int displayXOffset = 0;
-        // int displayYOffset = 0;
+        // Rotated canvas: the panels' rows stacked on top of each other in split layout
+        int gpuFrameWidth = 240;
+        int gpuFrameHeight = 320;
 
-        // TODO: Calculate in runtime
-        // int gpuFramebufferScanlineStrideBytes = 480;
-        // int gpuFramebufferSizeBytes = 153600;
+        int displayXOffset = 0;
+        int displayYOffset = 0;
 
-        // int excessPixelsLeft = 0;
-        // int excessPixelsRight = 0;
-        // int excessPixelsTop = 0;
-        // int excessPixelsBottom = 0;
+        // TODO: Calculate in runtime
+        int gpuFramebufferScanlineStrideBytes = 480;
+        int gpuFramebufferSizeBytes = 153600;
 
-        int spiX = -1;
-        int spiEndX = DISPLAY_WIDTH;
-        int spiY = -1;
+        Span* spans = nullptr;
 
-        bool displayOff = false;
+        bool displayOff = false; // The panels were put to sleep for inactivity
+        uint64_t displayContentsLastChanged = 0;
 
         uint16_t* framebuffer[2];
 
-        uint32_t curFrameEnd;
-        uint32_t prevFrameEnd;
+        // post() returns frame numbers as its fences, which map to the fences of each panel here
+        uint32_t framesPosted = 0;
+        uint64_t lastFrameTime = 0; // When the previous frame that had changes was submitted
+        uint32_t frameFences[GPU_FRAME_FENCE_HISTORY][SPI_MAX_PANELS];
 
         bool prevFrameWasInterlacedUpdate = false;
         bool interlacedUpdate = false; // True if the previous update we did was an interlaced half field update.
@@ -66,16 +99,33 @@ class Gpu {
 
         int countChangedPixels(uint16_t *framebuffer, uint16_t *prevFramebuffer);
         
-        void createSpans(Span*& head, uint16_t* framebuffer, uint16_t* prevFramebuffer, bool interlacedDiff, int interlacedFieldParity);
+        int createSpans(Span*& head, uint16_t* framebuffer, uint16_t* prevFramebuffer, bool interlacedDiff, int interlacedFieldParity);
         void optimizeSpans(Span* head);
+        void routeSpans(Span* head, Span* freeSpans);
+        void packSpan(const Span* span, uint16_t* data);
+        int submitSpans(GpuPanel& panel, uint64_t submitTime);
+        void transposeCanvas(const uint16_t* buffer);
 
-        void postDisplayXPositionUpdate(spi_loop* loop, uint16_t position);
-        void postDisplayYPositionUpdate(spi_loop* loop, uint16_t position);
+        void setDisplayXPosition(SPIWindow& window, uint16_t position);
+        void setDisplayYPosition(SPIWindow& window, uint16_t position);
 
-        void postDisplayXWindowUpdate(spi_loop* loop, uint16_t start, uint16_t end);
+        void setDisplayXWindow(SPIWindow& window, uint16_t start, uint16_t end);
     public:
         Gpu();
-        void init();
-        void post(uint16_t* buffer);
+        // Starts the SPI bus with a single panel, and drives that panel
+        void init(SpiTransport *(*createTransport)() = CreateSpiTransport);
+        // Drives one panel of a bus that has been started with InitSPI(numPanels). Several Gpus, one per panel,
+        // can then post frames independently; deinit() of such a Gpu leaves the bus running.
+        void init(spi_loop* panel);
+        // Drives several panels of a started bus from one canvas, which is diffed only once per frame
+        void init(spi_loop** loops, int numPanels, GpuLayout layout);
+        // Size of the buffer that post() takes
+        int canvasWidth() const;
+        int canvasHeight() const;
+        // Diffs the canvas against what is on the displays and queues the changes. Returns a fence that is
+        // signaled once the frame has been fully sent to all panels.
+        uint32_t post(uint16_t* buffer);
+        bool isFenceSignaled(uint32_t fence);
+        uint64_t waitFence(uint32_t fence); // Returns the tick() time when the frame was on glass
         void deinit();
 };
\ No newline at end of file
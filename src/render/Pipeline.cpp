@@ -0,0 +1,95 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <Pipeline.hpp>
+#include <tick.h>
+#include <util.h>
+
+Pipeline::Pipeline(int depth) : depth(MAX(1, MIN(depth, PIPELINE_MAX_DEPTH))) {
+}
+
+void Pipeline::addStage(const char *name, const function<bool(int slot)>& work, const function<bool(int slot)>& input) {
+    if (numStages == PIPELINE_MAX_STAGES) FATAL_ERROR("Too many pipeline stages!");
+    stages[numStages].name = name;
+    stages[numStages].input = input;
+    stages[numStages].work = work;
+    ++numStages;
+}
+
+void Pipeline::push(int queue, int slot) {
+    SlotQueue& q = queues[queue];
+    lock_guard<mutex> guard(q.mtx);
+    // Never full, as there are only depth slots in total
+    q.slots[(q.head + q.size++) % PIPELINE_MAX_DEPTH] = slot;
+    q.cv.notify_one();
+}
+
+int Pipeline::pop(int queue) {
+    SlotQueue& q = queues[queue];
+    unique_lock<mutex> lock(q.mtx);
+    q.cv.wait(lock, [&] { return q.size > 0 || stopping.load(); });
+    if (stopping.load()) return -1;
+    int slot = q.slots[q.head];
+    q.head = (q.head + 1) % PIPELINE_MAX_DEPTH;
+    --q.size;
+    return slot;
+}
+
+void Pipeline::runStage(int i) {
+    Stage& stage = stages[i];
+    if (i > 0) {
+        // Named after the stage, so that it shows up as such in top and in traces
+        char name[16];
+        snprintf(name, sizeof(name), "fbcp-%s", stage.name);
+        pthread_setname_np(pthread_self(), name);
+    }
+    for (;;) {
+        uint64_t t0 = tick();
+        int slot = pop(i);
+        if (slot < 0) break;
+        bool keepGoing = !stage.input || stage.input(slot);
+        uint64_t t1 = tick();
+        keepGoing = keepGoing && stage.work(slot);
+        uint64_t t2 = tick();
+        stage.waitUsecs.fetch_add(t1 - t0, memory_order_relaxed);
+        stage.busyUsecs.fetch_add(t2 - t1, memory_order_relaxed);
+        if (!keepGoing) {
+            stop();
+            break;
+        }
+        stage.frames.fetch_add(1, memory_order_relaxed);
+        push((i + 1) % numStages, slot);
+    }
+}
+
+void Pipeline::run() {
+    stopping.store(false);
+    startTime = tick();
+    for (int slot = 0; slot < depth; ++slot) push(0, slot);
+    for (int i = 1; i < numStages; ++i) stages[i].worker = thread(&Pipeline::runStage, this, i);
+    runStage(0);
+    stop();
+    for (int i = 1; i < numStages; ++i) stages[i].worker.join();
+    endTime = tick();
+}
+
+void Pipeline::stop() {
+    stopping.store(true);
+    for (int i = 0; i < numStages; ++i) {
+        lock_guard<mutex> guard(queues[i].mtx);
+        queues[i].cv.notify_all();
+    }
+}
+
+void Pipeline::printOccupancy() {
+    double elapsed = (double)((endTime ? endTime : tick()) - startTime);
+    if (elapsed <= 0) return;
+    printf("Pipeline of %d stages, %d frames in flight:\n", numStages, depth);
+    for (int i = 0; i < numStages; ++i) {
+        Stage& stage = stages[i];
+        uint64_t frames = stage.frames.load();
+        printf("  %-8s %6llu frames, %5.1f%% busy, %5.1f%% waiting for input, %.2fms per frame\n", stage.name, (unsigned long long)frames,
+            100.0 * stage.busyUsecs.load() / elapsed, 100.0 * stage.waitUsecs.load() / elapsed, frames ? stage.busyUsecs.load() / 1000.0 / frames : 0.0);
+    }
+}
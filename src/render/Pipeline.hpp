@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <stdint.h>
+
+using namespace std;
+
+#define PIPELINE_MAX_STAGES 4
+#define PIPELINE_MAX_DEPTH 8
+
+// Runs the stages of producing a frame on threads of their own, so that e.g. frame N+2 decodes while frame N+1 is
+// diffed and frame N is on the bus. The frames in flight are slots 0...depth-1 of the caller's own frame storage; a
+// stage is handed the index of the slot to work on. Slots go from stage to stage through bounded queues, and back to
+// the first stage when the last one is done with them, so at most depth frames are in flight and no stage can run
+// ahead of the others by more than that.
+//
+// The sustainable frame rate is set by the slowest stage instead of the sum of all stages. Each stage's occupancy
+// (the fraction of time it spends working) shows which one that is.
+class Pipeline {
+    private:
+        // Bounded queue of slot indices from one stage to the next
+        struct SlotQueue {
+            mutex mtx;
+            condition_variable cv;
+            int slots[PIPELINE_MAX_DEPTH];
+            int head = 0, size = 0;
+        };
+
+        struct Stage {
+            const char *name;
+            function<bool(int slot)> input;
+            function<bool(int slot)> work;
+            thread worker;
+            atomic<uint64_t> busyUsecs{0};
+            atomic<uint64_t> waitUsecs{0};
+            atomic<uint64_t> frames{0};
+        };
+
+        Stage stages[PIPELINE_MAX_STAGES];
+        SlotQueue queues[PIPELINE_MAX_STAGES]; // queues[i] feeds stage i
+        int numStages = 0;
+        int depth;
+        atomic<bool> stopping{false};
+        uint64_t startTime = 0;
+        uint64_t endTime = 0;
+
+        void push(int queue, int slot);
+        int pop(int queue); // -1 once the pipeline is stopping
+        void runStage(int stage);
+    public:
+        Pipeline(int depth);
+
+        // Adds a stage after the ones added so far. The work returns false to stop the whole pipeline. The first stage
+        // can have an input that waits for something to work on, e.g. a vsync tick, which is then not counted as busy.
+        void addStage(const char *name, const function<bool(int slot)>& work, const function<bool(int slot)>& input = nullptr);
+        // Runs the first stage on the calling thread and the rest on threads of their own, until a stage stops it
+        void run();
+        void stop();
+
+        void printOccupancy();
+};
@@ -1,24 +1,35 @@
 #include <Surface.h>
+#include <string.h>
+#include <stdlib.h>
+#include <spi.h>
+#include <mem_alloc.h>
 
-Surface::Surface(View& view) : view(view) {
-    for (int i = 0; i < HEIGHT; ++i) {
-        for (int j = 0; j < WIDTH; ++j) {
-            frameBuffer[i][j] = 0;
-        }
-    }
-}
+Surface::Surface(View& view, int numPanels, GpuLayout layout) : view(view), numPanels(numPanels), layout(layout) {}
 
 void Surface::init() {
-    gpu.init();
+    if (numPanels == 1) {
+        gpu.init();
+    } else {
+        InitSPI(numPanels);
+        gpu.init(spiBus->panels, numPanels, layout);
+    }
+    frameBuffer = (uint16_t *)Malloc(gpu.canvasWidth() * gpu.canvasHeight() * sizeof(uint16_t), "Surface frameBuffer");
+    memset(frameBuffer, 0, gpu.canvasWidth() * gpu.canvasHeight() * sizeof(uint16_t));
     vsync.callback([this]() {
-        performDrawing();
+        PacedFrame frame = pacer.beginFrame();
+        pacer.post(frame, gpu, performDrawing());
     });
     vsync.start();
 }
 
-void Surface::performDrawing() {
-    view.draw(Surface::WIDTH, Surface::HEIGHT, &frameBuffer[0][0]);
-    gpu.post(&frameBuffer[0][0]);
+// Draws the view, and returns the canvas for the pacer to post
+uint16_t* Surface::performDrawing() {
+    view.draw(gpu.canvasWidth(), gpu.canvasHeight(), frameBuffer);
+    return frameBuffer;
 }
 
-Surface::~Surface() {}
\ No newline at end of file
+Surface::~Surface() {
+    vsync.stop();
+    pacer.printStatistics();
+    free(frameBuffer);
+}
@@ -2,22 +2,24 @@
 
 #include <View.hpp>
 #include <Vsync.hpp>
+#include <FramePacer.hpp>
 #include <stdint.h>
 #include <Gpu.hpp>
 
 class Surface {
-    public:
-        static const int WIDTH = 320;
-        static const int HEIGHT = 240;
     private:
         Vsync vsync;
         Gpu gpu;
-        uint16_t frameBuffer[HEIGHT][WIDTH];
+        FramePacer pacer{vsync}; // Starts each frame just in time for the vsync tick after the one it was drawn for
+        uint16_t* frameBuffer = nullptr;
         View& view;
+        int numPanels;
+        GpuLayout layout;
     public:
-        Surface(View& View);
+        // With several panels in split layout, the view draws one canvas that spans all of them side by side
+        Surface(View& View, int numPanels = 1, GpuLayout layout = GPU_LAYOUT_SPLIT);
         ~Surface();
 
         void init();
-        void performDrawing();
-};
\ No newline at end of file
+        uint16_t* performDrawing();
+};
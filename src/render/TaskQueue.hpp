@@ -0,0 +1,148 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include <unistd.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+// Bytes of captured state that a task can carry. Larger callables do not compile, instead of falling back to the heap.
+#define TASK_INLINE_SIZE 48
+
+// A callable stored in place, without a heap allocation. Move only, and run exactly once.
+class InlineTask {
+    private:
+        alignas(max_align_t) unsigned char storage[TASK_INLINE_SIZE];
+        void (*invokeFn)(void*) = nullptr;
+        void (*destroyFn)(void*) = nullptr;
+        void (*moveFn)(void* to, void* from) = nullptr;
+
+    public:
+        InlineTask() {}
+
+        template<typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, InlineTask>::value>::type>
+        InlineTask(F&& f) {
+            typedef typename std::decay<F>::type Fn;
+            static_assert(sizeof(Fn) <= TASK_INLINE_SIZE, "Task captures too much state to be stored inline, raise TASK_INLINE_SIZE");
+            static_assert(alignof(Fn) <= alignof(max_align_t), "Task needs more alignment than can be stored inline");
+            new (storage) Fn(std::forward<F>(f));
+            invokeFn = [](void* p) { (*(Fn*)p)(); };
+            destroyFn = [](void* p) { ((Fn*)p)->~Fn(); };
+            moveFn = [](void* to, void* from) { new (to) Fn(std::move(*(Fn*)from)); ((Fn*)from)->~Fn(); };
+        }
+
+        InlineTask(InlineTask&& other) { *this = std::move(other); }
+
+        InlineTask& operator=(InlineTask&& other) {
+            if (this == &other) return *this;
+            reset();
+            if (other.invokeFn) {
+                other.moveFn(storage, other.storage);
+                invokeFn = other.invokeFn;
+                destroyFn = other.destroyFn;
+                moveFn = other.moveFn;
+                other.invokeFn = nullptr;
+            }
+            return *this;
+        }
+
+        InlineTask(const InlineTask&) = delete;
+        InlineTask& operator=(const InlineTask&) = delete;
+
+        ~InlineTask() { reset(); }
+
+        void reset() {
+            if (invokeFn) destroyFn(storage);
+            invokeFn = nullptr;
+        }
+
+        explicit operator bool() const { return invokeFn != nullptr; }
+
+        void operator()() { invokeFn(storage); }
+};
+
+// Bounded multi-producer single-consumer queue of InlineTasks, with all slots allocated up front. post() is lock
+// free and does not allocate, so it can be called from any thread, including from a signal handler. The consumer
+// sleeps on a futex while the queue is empty, and producers only make the wake up system call when it is asleep.
+//
+// The ring follows Vyukov's bounded queue: every slot has a sequence number that tells whether it is free for the
+// producer of a given position, or holds the task that the consumer expects next.
+template<int Capacity>
+class TaskQueue {
+    static_assert((Capacity & (Capacity - 1)) == 0, "TaskQueue capacity must be a power of two");
+
+    private:
+        struct Slot {
+            uint32_t sequence;
+            InlineTask task;
+        };
+
+        Slot slots[Capacity];
+        alignas(64) uint32_t enqueuePos = 0;
+        alignas(64) uint32_t dequeuePos = 0;
+        uint32_t wakeups = 0; // Futex word, bumped by producers to wake the consumer
+        uint32_t consumerSleeping = 0;
+
+    public:
+        TaskQueue() {
+            for (int i = 0; i < Capacity; ++i) slots[i].sequence = i;
+        }
+
+        // Returns false if the queue is full
+        template<typename F>
+        bool post(F&& f) {
+            uint32_t pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+            Slot* slot;
+            for (;;) {
+                slot = &slots[pos & (Capacity - 1)];
+                int32_t diff = (int32_t)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - pos);
+                if (diff == 0) {
+                    if (__atomic_compare_exchange_n(&enqueuePos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+                }
+            }
+            slot->task = InlineTask(std::forward<F>(f));
+            // Sequentially consistent, so that either this store is seen by the consumer's check in wait(), or the
+            // consumer's sleeping flag is seen here
+            __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_SEQ_CST);
+
+            if (__atomic_load_n(&consumerSleeping, __ATOMIC_SEQ_CST)) wake();
+            return true;
+        }
+
+        // Wakes the consumer up from wait() even if nothing was posted, e.g. to have it notice that it should quit
+        void wake() {
+            __atomic_fetch_add(&wakeups, 1, __ATOMIC_SEQ_CST);
+            syscall(SYS_futex, &wakeups, FUTEX_WAKE_PRIVATE, 1, 0, 0, 0);
+        }
+
+        // Consumer only. Moves the oldest task to task, and returns false if there is none.
+        bool tryPop(InlineTask& task) {
+            Slot* slot = &slots[dequeuePos & (Capacity - 1)];
+            if ((int32_t)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - (dequeuePos + 1)) < 0) return false;
+            task = std::move(slot->task);
+            __atomic_store_n(&slot->sequence, dequeuePos + Capacity, __ATOMIC_RELEASE);
+            ++dequeuePos;
+            return true;
+        }
+
+        // Consumer only. Sleeps until a task is posted or wake() is called, or up to timeoutUsecs if that is not 0.
+        void wait(uint64_t timeoutUsecs = 0) {
+            uint32_t w = __atomic_load_n(&wakeups, __ATOMIC_SEQ_CST);
+            __atomic_store_n(&consumerSleeping, 1, __ATOMIC_SEQ_CST);
+            // A task posted before the flag was raised did not wake us, so look once more before sleeping
+            Slot* slot = &slots[dequeuePos & (Capacity - 1)];
+            if ((int32_t)(__atomic_load_n(&slot->sequence, __ATOMIC_SEQ_CST) - (dequeuePos + 1)) < 0) {
+                struct timespec timeout = { (time_t)(timeoutUsecs / 1000000), (long)(timeoutUsecs % 1000000) * 1000 };
+                syscall(SYS_futex, &wakeups, FUTEX_WAIT_PRIVATE, w, timeoutUsecs ? &timeout : 0, 0, 0);
+            }
+            __atomic_store_n(&consumerSleeping, 0, __ATOMIC_SEQ_CST);
+        }
+};
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+
+// Counts vsync ticks for a render loop instead of queueing one task per tick. If rendering falls behind, the ticks
+// that came meanwhile are folded into a single render of the latest one, rather than rendered back to back when they
+// are already stale. The Vsync thread calls onTick(), and posts a wake up task to the render loop only when it
+// returns true; the render loop then calls consume().
+class TickCoalescer {
+    private:
+        uint64_t latestTick = 0; // Index of the most recent tick
+        uint64_t renderedTick = 0; // Index of the tick that was last consumed
+        uint32_t pending = 0; // 1 while a wake up for the render loop is on its way
+        uint64_t missed = 0; // Ticks that were folded into a later one
+        uint64_t renders = 0;
+        bool started = false;
+
+    public:
+        // Vsync thread. Returns true if the render loop has to be woken up for this tick.
+        bool onTick(uint64_t tickIndex) {
+            __atomic_store_n(&latestTick, tickIndex, __ATOMIC_SEQ_CST);
+            return __atomic_exchange_n(&pending, 1, __ATOMIC_SEQ_CST) == 0;
+        }
+
+        // Render loop. Returns how many ticks have gone by since the previous call (0 if none), and the latest tick
+        // index in tickIndex, so that animation can be advanced by the elapsed ticks.
+        uint64_t consume(uint64_t& tickIndex) {
+            __atomic_store_n(&pending, 0, __ATOMIC_SEQ_CST);
+            tickIndex = __atomic_load_n(&latestTick, __ATOMIC_SEQ_CST);
+            if (!started) {
+                // The first tick counts as one, whatever its index
+                if (!tickIndex) return 0;
+                started = true;
+                renderedTick = tickIndex - 1;
+            }
+            uint64_t elapsed = tickIndex - renderedTick;
+            if (!elapsed) return 0;
+            renderedTick = tickIndex;
+            ++renders;
+            __atomic_fetch_add(&missed, elapsed - 1, __ATOMIC_RELAXED);
+            return elapsed;
+        }
+
+        // Ticks that did not get a render of their own
+        uint64_t missedTicks() const { return __atomic_load_n(&missed, __ATOMIC_RELAXED); }
+        uint64_t renderedTicks() const { return renders; }
+};
@@ -1,28 +1,275 @@
-#include <chrono>
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 #include <Vsync.hpp>
+#include <util.h>
+#include <tick.h>
+#include <realtime.h>
+
+static uint64_t nowNsecs() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+Vsync::Vsync(double rateHz, uint64_t phaseUsecs) {
+    periodNsecs = (uint64_t)(1000000000.0 / rateHz + 0.5);
+    phaseNsecs = (phaseUsecs * 1000) % periodNsecs;
+    tickPeriodNsecs.store(periodNsecs);
+}
+
+Vsync::Vsync(VsyncSource* source, int edgesPerTick, uint64_t delayUsecs) : source(source), edgesPerTick(MAX(edgesPerTick, 1)) {
+    periodNsecs = source->nominalPeriodNsecs() * this->edgesPerTick;
+    phaseNsecs = 0;
+    delayNsecs = delayUsecs * 1000;
+    tickPeriodNsecs.store(periodNsecs);
+}
+
+Vsync::~Vsync() {
+    stop();
+}
 
 void Vsync::start() {
-    worker = thread(&Vsync::run, this);
+    isCancelled.store(false);
+    tickCount.store(0);
+    worker = thread(source ? &Vsync::runLocked : &Vsync::run, this);
 }
 
 void Vsync::stop() {
     isCancelled.store(true);
+    resume();
+    if (source) source->cancel();
+    if (worker.joinable() && worker.get_id() != this_thread::get_id()) worker.join();
+}
+
+// Sleeps until the deadline and runs the callback. Returns false if the Vsync was stopped meanwhile.
+bool Vsync::fireTick(uint64_t deadline, uint64_t& prevWakeup) {
+    struct timespec t;
+    t.tv_sec = deadline / 1000000000ULL;
+    t.tv_nsec = deadline % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, 0) == EINTR)
+        if (isCancelled.load()) return false;
+    if (isCancelled.load()) return false;
+    if (isIdleAt(deadline)) {
+        // Went idle while this tick was being waited for
+        idleTicks.fetch_add(1, memory_order_relaxed);
+        return true;
+    }
+
+    uint64_t wakeup = nowNsecs();
+    AddSchedLatencySample(&vsyncThreadLatency, wakeup > deadline ? (wakeup - deadline) / 1000 : 0);
+    if (prevWakeup) {
+        // Skipped ticks are counted in the missed tick histogram, so only the distance to the nearest whole number
+        // of periods is jitter
+        uint64_t offset = (wakeup - prevWakeup) % periodNsecs;
+        uint64_t deviation = MIN(offset, periodNsecs - offset);
+        uint64_t bucket = MIN(deviation / (VSYNC_JITTER_BUCKET_USECS * 1000), (uint64_t)VSYNC_JITTER_HISTOGRAM_SIZE - 1);
+        jitterHistogram[bucket].fetch_add(1, memory_order_relaxed);
+    }
+    prevWakeup = wakeup;
+
+    lastDeadline.store(deadline, memory_order_relaxed);
+    tickCount.fetch_add(1, memory_order_relaxed);
+    if (cb) cb();
+    ticks.fetch_add(1, memory_order_relaxed);
+    return true;
+}
+
+bool Vsync::isIdleAt(uint64_t deadline) const {
+    uint64_t until = idleUntilNsecs.load();
+    return until && until > deadline;
+}
+
+// Sleeps until the idle time is over or resume() is called. Returns false if the Vsync was stopped meanwhile.
+bool Vsync::sleepWhileIdle() {
+    idleSpells.fetch_add(1, memory_order_relaxed);
+    for (;;) {
+        uint32_t w = __atomic_load_n(&idleWakeups, __ATOMIC_SEQ_CST);
+        uint64_t until = idleUntilNsecs.load();
+        if (isCancelled.load()) return false;
+        if (!until) return true;
+        if (until != VSYNC_IDLE_UNTIL_RESUMED && nowNsecs() >= until) {
+            // Done, unless idleUntil() was called again meanwhile
+            idleUntilNsecs.compare_exchange_strong(until, 0);
+            return true;
+        }
+        // FUTEX_WAIT_BITSET takes an absolute timeout on CLOCK_MONOTONIC, unlike FUTEX_WAIT
+        struct timespec t = { (time_t)(until / 1000000000ULL), (long)(until % 1000000000ULL) };
+        syscall(SYS_futex, &idleWakeups, FUTEX_WAIT_BITSET_PRIVATE, w, until != VSYNC_IDLE_UNTIL_RESUMED ? &t : 0, 0, FUTEX_BITSET_MATCH_ANY);
+    }
 }
 
 void Vsync::run() {
+    SetThreadScheduling("fbcp-vsync", VSYNC_THREAD_POLICY, VSYNC_THREAD_PRIORITY, VSYNC_THREAD_CPU);
+
+    // First tick is the next instant on the phase grid
+    uint64_t now = nowNsecs();
+    uint64_t deadline = (now - phaseNsecs) / periodNsecs * periodNsecs + phaseNsecs + periodNsecs;
+    uint64_t prevWakeup = 0;
+
+    for (;;) {
+        if (isIdleAt(deadline)) {
+            if (!sleepWhileIdle()) break;
+            // Pick the grid up again at the next instant on it
+            now = nowNsecs();
+            uint64_t resumeDeadline = (now - phaseNsecs) / periodNsecs * periodNsecs + phaseNsecs + periodNsecs;
+            idleTicks.fetch_add((resumeDeadline - deadline) / periodNsecs, memory_order_relaxed);
+            deadline = resumeDeadline;
+            prevWakeup = 0; // The idle gap is not jitter
+        }
+        if (!fireTick(deadline, prevWakeup)) break;
+
+        // Recover from an overrun by skipping to the next deadline that is still ahead, instead of catching up on the
+        // missed ones back to back
+        deadline += periodNsecs;
+        now = nowNsecs();
+        if (now >= deadline) {
+            uint64_t missed = (now - deadline) / periodNsecs + 1;
+            deadline += missed * periodNsecs;
+            missedTicks.fetch_add(missed, memory_order_relaxed);
+            tickCount.fetch_add(missed, memory_order_relaxed);
+            missedHistogram[MIN(missed, (uint64_t)VSYNC_MISSED_HISTOGRAM_SIZE - 1)].fetch_add(1, memory_order_relaxed);
+        }
+    }
+}
+
+// Ticks from the edges of the source, through a phase-locked loop that predicts when the next edge is due
+void Vsync::runLocked() {
+    SetThreadScheduling("fbcp-vsync", VSYNC_THREAD_POLICY, VSYNC_THREAD_PRIORITY, VSYNC_THREAD_CPU);
+
+    const uint64_t nominalEdgePeriod = source->nominalPeriodNsecs();
+    uint64_t edgePeriod = nominalEdgePeriod;
+    uint64_t nextEdge = 0; // 0 until the first edge has been seen
+    int edgesToTick = edgesPerTick;
+    uint64_t prevWakeup = 0;
+    uint64_t ignoreEdgesBefore = 0;
+
     while (!isCancelled.load()) {
-        this_thread::sleep_for(chrono::milliseconds(16));
+        if (nextEdge && isIdleAt(nextEdge + edgePeriod * (edgesToTick - 1) + delayNsecs)) {
+            uint64_t idleFrom = nowNsecs();
+            if (!sleepWhileIdle()) break;
+            // Free run the estimate over the edges that went by, keeping the ticks on the same edges as before. Those
+            // edges are still queued up in the source, so skip them.
+            uint64_t now = nowNsecs();
+            if (nextEdge < now) {
+                uint64_t skipped = (now - nextEdge) / edgePeriod + 1;
+                nextEdge += skipped * edgePeriod;
+                edgesToTick = (int)(((uint64_t)edgesToTick - 1 + edgesPerTick - skipped % edgesPerTick) % edgesPerTick) + 1;
+            }
+            idleTicks.fetch_add((now - idleFrom) / (edgePeriod * edgesPerTick), memory_order_relaxed);
+            ignoreEdgesBefore = now;
+            prevWakeup = 0;
+        }
 
-        function<void()> cb;
-        {
-            std::lock_guard<std::mutex> guard(mtx);
-            cb = this->cb;
+        // An edge that has not come by an eighth of a period after it was due is taken as missed, which bounds how late
+        // a tick on an estimated edge is. Before the loop has locked on, waits in slices so that stop() is noticed.
+        uint64_t edge;
+        uint64_t waitUntil = nextEdge ? nextEdge + edgePeriod / 8 : nowNsecs() + 100 * nominalEdgePeriod;
+        if (source->waitEdge(waitUntil, edge)) {
+            if (edge < ignoreEdgesBefore) continue;
+            if (!nextEdge) nextEdge = edge;
+            if (edge + edgePeriod / 2 < nextEdge) continue; // An edge from before a skip, or a glitch
+
+            int64_t error = (int64_t)(edge - nextEdge);
+            if (error > (int64_t)edgePeriod / 8 || -error > (int64_t)edgePeriod / 4) {
+              nextEdge = edge; // Lost the lock, e.g. the panel was reset, so lock on again from this edge
+            } else {
+              // The phase follows half of the error, and the period an eighth of it, limited to 10% off the nominal
+              nextEdge += error / 2;
+              edgePeriod += error / 8;
+              edgePeriod = MAX(MIN(edgePeriod, nominalEdgePeriod * 11 / 10), nominalEdgePeriod * 9 / 10);
+            }
+        } else {
+            if (isCancelled.load()) break;
+            if (!nextEdge) continue;
+            estimatedEdges.fetch_add(1, memory_order_relaxed); // Free run on the estimate
+        }
+
+        uint64_t thisEdge = nextEdge;
+        nextEdge += edgePeriod;
+        if (--edgesToTick > 0) continue;
+        edgesToTick = edgesPerTick;
+
+        tickPeriodNsecs.store(edgePeriod * edgesPerTick, memory_order_relaxed);
+        if (!fireTick(thisEdge + delayNsecs, prevWakeup)) break;
+
+        // Skip over the ticks whose edges went by while the callback ran
+        uint64_t tickPeriod = edgePeriod * edgesPerTick;
+        uint64_t nextTick = nextEdge + edgePeriod * (edgesPerTick - 1) + delayNsecs;
+        uint64_t now = nowNsecs();
+        if (now >= nextTick) {
+            uint64_t missed = (now - nextTick) / tickPeriod + 1;
+            nextEdge += missed * tickPeriod;
+            missedTicks.fetch_add(missed, memory_order_relaxed);
+            tickCount.fetch_add(missed, memory_order_relaxed);
+            missedHistogram[MIN(missed, (uint64_t)VSYNC_MISSED_HISTOGRAM_SIZE - 1)].fetch_add(1, memory_order_relaxed);
         }
-        cb();
     }
 }
 
+VsyncGrid Vsync::grid() const {
+    // The most recent tick is on the grid, and before the first one, the last instant on the phase grid is. tick() need
+    // not be on CLOCK_MONOTONIC, so that is moved over to it by where the two clocks are now.
+    uint64_t period = tickPeriodNsecs.load(memory_order_relaxed);
+    uint64_t anchor = lastDeadline.load(memory_order_relaxed);
+    uint64_t nowTick = tick();
+    uint64_t now = nowNsecs();
+    if (!anchor) anchor = (now - phaseNsecs) / period * period + phaseNsecs;
+    VsyncGrid grid;
+    grid.tickUsecs = nowTick + ((int64_t)anchor - (int64_t)now) / 1000;
+    grid.periodUsecs = period / 1000.0;
+    return grid;
+}
+
+void Vsync::idleUntil(uint64_t untilNsecs) {
+    idleUntilNsecs.store(untilNsecs);
+}
+
+void Vsync::idleForTicks(uint64_t ticks) {
+    if (!ticks) return;
+    // Half a period short of the last tick to skip, so that the tick after it runs on time
+    uint64_t period = periodNsecs;
+    uint64_t last = lastDeadline.load(memory_order_relaxed);
+    idleUntil((last ? last : nowNsecs()) + ticks * period + period / 2);
+}
+
+void Vsync::resume() {
+    idleUntilNsecs.store(0);
+    __atomic_fetch_add(&idleWakeups, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &idleWakeups, FUTEX_WAKE_PRIVATE, 1, 0, 0, 0);
+}
+
 void Vsync::callback(const function<void()>& callback) {
-    lock_guard<std::mutex> guard(mtx);
     this->cb = callback;
-}
\ No newline at end of file
+}
+
+void Vsync::statistics(VsyncStatistics& stats, bool reset) {
+    stats.ticks = reset ? ticks.exchange(0) : ticks.load();
+    stats.missedTicks = reset ? missedTicks.exchange(0) : missedTicks.load();
+    for (int i = 0; i < VSYNC_JITTER_HISTOGRAM_SIZE; ++i)
+        stats.jitterHistogram[i] = reset ? jitterHistogram[i].exchange(0) : jitterHistogram[i].load();
+    for (int i = 0; i < VSYNC_MISSED_HISTOGRAM_SIZE; ++i)
+        stats.missedHistogram[i] = reset ? missedHistogram[i].exchange(0) : missedHistogram[i].load();
+    stats.estimatedEdges = reset ? estimatedEdges.exchange(0) : estimatedEdges.load();
+    stats.idleTicks = reset ? idleTicks.exchange(0) : idleTicks.load();
+    stats.idleSpells = reset ? idleSpells.exchange(0) : idleSpells.load();
+}
+
+void Vsync::printStatistics() {
+    VsyncStatistics stats;
+    statistics(stats);
+    printf("Vsync: %llu ticks at %.2fhz, %llu missed", (unsigned long long)stats.ticks, 1000000000.0 / periodNsecs, (unsigned long long)stats.missedTicks);
+    if (source) printf(", %llu edges estimated", (unsigned long long)stats.estimatedEdges);
+    if (stats.idleSpells) printf(", %llu ticks idle in %llu spells", (unsigned long long)stats.idleTicks, (unsigned long long)stats.idleSpells);
+    printf("\n");
+    printf("  period jitter:");
+    for (int i = 0; i < VSYNC_JITTER_HISTOGRAM_SIZE; ++i)
+        if (stats.jitterHistogram[i]) printf(" %s%dus:%u", (i == VSYNC_JITTER_HISTOGRAM_SIZE - 1) ? ">=" : "<", (i + (i < VSYNC_JITTER_HISTOGRAM_SIZE - 1)) * VSYNC_JITTER_BUCKET_USECS, stats.jitterHistogram[i]);
+    printf("\n  missed ticks in a row:");
+    for (int i = 1; i < VSYNC_MISSED_HISTOGRAM_SIZE; ++i)
+        if (stats.missedHistogram[i]) printf(" %s%d:%u", (i == VSYNC_MISSED_HISTOGRAM_SIZE - 1) ? ">=" : "", i, stats.missedHistogram[i]);
+    printf("\n");
+}
@@ -3,20 +3,107 @@
 #include <atomic>
 #include <functional>
 #include <thread>
-#include <mutex>
+#include <stdint.h>
+#include <display.h>
+#include <VsyncSource.hpp>
 
 using namespace std;
 
+// Width of a bucket of the period jitter histogram, in usecs. The last bucket also counts all larger deviations.
+#define VSYNC_JITTER_BUCKET_USECS 100
+#define VSYNC_JITTER_HISTOGRAM_SIZE 64
+// The missed tick histogram counts overruns by how many ticks they skipped, the last bucket counts that many or more
+#define VSYNC_MISSED_HISTOGRAM_SIZE 16
+// Passed to idleUntil() to idle until resume() is called
+#define VSYNC_IDLE_UNTIL_RESUMED UINT64_MAX
+
+struct VsyncStatistics {
+    uint64_t ticks; // Callbacks that were run
+    uint64_t missedTicks; // Ticks that were skipped, because a callback ran past them
+    uint32_t jitterHistogram[VSYNC_JITTER_HISTOGRAM_SIZE]; // |measured period - nominal period|, in VSYNC_JITTER_BUCKET_USECS buckets
+    uint32_t missedHistogram[VSYNC_MISSED_HISTOGRAM_SIZE]; // [n] = how many times n ticks were skipped in a row
+    uint64_t estimatedEdges; // Edges of the VsyncSource that did not come, and were stood in for by the phase-locked estimate
+    uint64_t idleTicks; // Ticks that were not run because the Vsync was idle
+    uint64_t idleSpells; // How many times the Vsync went idle
+};
+
+// Instants at tickUsecs + k * periodUsecs on the tick() clock, for any integer k
+struct VsyncGrid {
+    uint64_t tickUsecs; // One instant on the grid, the most recent tick or one close to it
+    double periodUsecs;
+};
+
+// Calls the callback at a fixed rate from a thread of its own. Ticks are absolute deadlines on CLOCK_MONOTONIC at
+// phase + k * period, so the period does not drift by the callback's run time or the scheduler's wake up latency.
+// If a callback runs past one or more deadlines, those ticks are skipped instead of being run back to back.
+//
+// With a VsyncSource, the ticks follow the source's edges instead (e.g. the panel's TE pulses), every
+// edgesPerTick'th edge, delayed by delayUsecs so that the panel's scanout is past the region that is updated first.
+// A software phase-locked loop tracks the phase and period of the edges, and stands in for edges that do not come.
+//
+// When the content is known not to change for a while, idleUntil() suspends the ticks, so that nothing renders, diffs
+// or wakes the SPI thread meanwhile. The thread sleeps until the given time or until resume(), and then ticks again
+// from the next instant on the grid (or the next edge of the source), so within a tick.
 class Vsync {
     private:
         thread worker;
-        atomic<bool> isCancelled;
-        mutex mtx;
-        function<void()> cb;
+        atomic<bool> isCancelled{false};
+        function<void()> cb; // Only set before start(), so the Vsync thread calls it without a lock or a copy
+
+        uint64_t periodNsecs;
+        uint64_t phaseNsecs;
+
+        VsyncSource* source = nullptr;
+        int edgesPerTick = 1;
+        uint64_t delayNsecs = 0;
+        atomic<uint64_t> estimatedEdges{0};
+
+        atomic<uint64_t> tickCount{0}; // Ticks run and skipped since start(), not reset with the statistics
+        atomic<uint64_t> ticks{0};
+        atomic<uint64_t> missedTicks{0};
+        atomic<uint32_t> jitterHistogram[VSYNC_JITTER_HISTOGRAM_SIZE] = {};
+        atomic<uint32_t> missedHistogram[VSYNC_MISSED_HISTOGRAM_SIZE] = {};
+
+        atomic<uint64_t> idleUntilNsecs{0}; // 0 while ticking
+        uint32_t idleWakeups = 0; // Futex that resume() and stop() wake the idle thread up through
+        atomic<uint64_t> lastDeadline{0}; // Deadline of the most recent tick
+        atomic<uint64_t> tickPeriodNsecs{0}; // Period of the ticks, as the phase-locked loop estimates it with a source
+        atomic<uint64_t> idleTicks{0};
+        atomic<uint64_t> idleSpells{0};
 
         void run();
+        void runLocked();
+        bool fireTick(uint64_t deadline, uint64_t& prevWakeup);
+        bool isIdleAt(uint64_t deadline) const;
+        bool sleepWhileIdle();
     public:
+        // Ticks at rateHz, at the instants that are phaseUsecs past a multiple of the period on CLOCK_MONOTONIC, so
+        // that Vsyncs of the same rate and phase tick together.
+        Vsync(double rateHz = TARGET_FRAME_RATE, uint64_t phaseUsecs = 0);
+        // Ticks on every edgesPerTick'th edge of the source, delayUsecs after it. The source must outlive the Vsync.
+        Vsync(VsyncSource* source, int edgesPerTick, uint64_t delayUsecs);
+        ~Vsync();
+
         void start();
         void stop();
+        // Sets what to call on every tick. Must be called before start().
         void callback(const function<void()>& callback);
-};
\ No newline at end of file
+        // Index of the current tick, counting skipped ticks too, starting from 1. A callback can use it to tell how
+        // many ticks went by since it last ran.
+        uint64_t tickIndex() const { return tickCount.load(); }
+        // Where the ticks are on the tick() clock: at the phase of the ticks, and with a source, at the estimated phase
+        // and period of its edges. For pacing work to be done just before a tick. Any thread can call it.
+        VsyncGrid grid() const;
+
+        // Suspends the ticks until untilNsecs on CLOCK_MONOTONIC, or until resume() is called if that is
+        // VSYNC_IDLE_UNTIL_RESUMED. Ticks that go by while idle are not counted in tickIndex(). Any thread can call these.
+        void idleUntil(uint64_t untilNsecs);
+        // Suspends the next ticks ticks, so that the first tick to run is the ticks+1'th after the most recent one
+        void idleForTicks(uint64_t ticks);
+        // Starts ticking again from the next tick. Only makes a futex call, so it is safe in a signal handler too.
+        void resume();
+
+        // Copies the statistics gathered so far, and with reset, starts gathering anew
+        void statistics(VsyncStatistics& stats, bool reset = false);
+        void printStatistics();
+};
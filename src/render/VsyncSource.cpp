@@ -0,0 +1,106 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <chrono>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+
+#include <VsyncSource.hpp>
+#include <util.h>
+
+static uint64_t nowNsecs() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+TeGpioVsyncSource::TeGpioVsyncSource(const char *gpioChip, unsigned int line, double refreshRateHz) {
+    periodNsecs = (uint64_t)(1000000000.0 / refreshRateHz + 0.5);
+
+    int chipFd = open(gpioChip, O_RDWR);
+    if (chipFd < 0) FATAL_ERROR("Failed to open GPIO character device for the TE line!");
+    struct gpioevent_request request;
+    memset(&request, 0, sizeof(request));
+    request.lineoffset = line;
+    request.handleflags = GPIOHANDLE_REQUEST_INPUT;
+    request.eventflags = GPIOEVENT_REQUEST_RISING_EDGE;
+    strcpy(request.consumer_label, "fbcp-te");
+    if (ioctl(chipFd, GPIO_GET_LINEEVENT_IOCTL, &request) < 0) FATAL_ERROR("Failed to request edge events of the TE line!");
+    close(chipFd); // The event fd stays valid after the chip fd is closed
+    eventFd = request.fd;
+
+    cancelFd = eventfd(0, EFD_NONBLOCK);
+    if (cancelFd < 0) FATAL_ERROR("Failed to create eventfd!");
+    printf("TE vsync: GPIO line %u on %s, %.2fhz\n", line, gpioChip, refreshRateHz);
+}
+
+TeGpioVsyncSource::~TeGpioVsyncSource() {
+    close(eventFd);
+    close(cancelFd);
+}
+
+bool TeGpioVsyncSource::waitEdge(uint64_t deadlineNsecs, uint64_t& edgeNsecs) {
+    for (;;) {
+        uint64_t now = nowNsecs();
+        if (now >= deadlineNsecs) return false;
+
+        struct pollfd fds[2] = { { eventFd, POLLIN, 0 }, { cancelFd, POLLIN, 0 } };
+        struct timespec timeout = { (time_t)((deadlineNsecs - now) / 1000000000ULL), (long)((deadlineNsecs - now) % 1000000000ULL) };
+        int ret = ppoll(fds, 2, &timeout, 0);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret < 0) FATAL_ERROR("Failed to poll the TE line!");
+        if (ret == 0 || (fds[1].revents & POLLIN)) return false;
+
+        struct gpioevent_data event;
+        if (read(eventFd, &event, sizeof(event)) != sizeof(event)) continue;
+        // Kernels before 5.7 stamp line events with CLOCK_REALTIME, in which case the read time has to do
+        now = nowNsecs();
+        edgeNsecs = (event.timestamp <= now && now - event.timestamp < 1000000000ULL) ? event.timestamp : now;
+        return true;
+    }
+}
+
+void TeGpioVsyncSource::cancel() {
+    uint64_t one = 1;
+    if (write(cancelFd, &one, sizeof(one)) < 0) {}
+}
+
+SimulatedVsyncSource::SimulatedVsyncSource(double refreshRateHz) {
+    periodNsecs = (uint64_t)(1000000000.0 / refreshRateHz + 0.5);
+}
+
+void SimulatedVsyncSource::pushEdge(uint64_t edgeNsecs) {
+    lock_guard<mutex> guard(mtx);
+    edges.push_back(edgeNsecs);
+    cv.notify_all();
+}
+
+bool SimulatedVsyncSource::waitEdge(uint64_t deadlineNsecs, uint64_t& edgeNsecs) {
+    unique_lock<mutex> lock(mtx);
+    for (;;) {
+        if (cancelled) return false;
+        uint64_t now = nowNsecs();
+        if (!edges.empty() && edges.front() <= now) {
+            edgeNsecs = edges.front();
+            edges.pop_front();
+            return true;
+        }
+        if (now >= deadlineNsecs) return false;
+        // steady_clock is CLOCK_MONOTONIC
+        uint64_t wakeup = edges.empty() ? deadlineNsecs : MIN(edges.front(), deadlineNsecs);
+        cv.wait_until(lock, chrono::steady_clock::time_point(chrono::nanoseconds(wakeup)));
+    }
+}
+
+void SimulatedVsyncSource::cancel() {
+    lock_guard<mutex> guard(mtx);
+    cancelled = true;
+    cv.notify_all();
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+using namespace std;
+
+// Where the edges that a Vsync locks on to come from. Timestamps are in nsecs on CLOCK_MONOTONIC.
+class VsyncSource {
+    public:
+        virtual ~VsyncSource() {}
+        // Waits for the next edge until the absolute time deadlineNsecs. Returns false if none arrived by then, or if
+        // the wait was cancelled.
+        virtual bool waitEdge(uint64_t deadlineNsecs, uint64_t& edgeNsecs) = 0;
+        // Wakes up a thread that waits in waitEdge()
+        virtual void cancel() = 0;
+        // How often the edges should come
+        virtual uint64_t nominalPeriodNsecs() = 0;
+};
+
+// Edges of the tearing effect (TE) output of the display controller, read as rising edge events of a GPIO line
+// through the GPIO character device. The controller raises TE when its scanout enters the vertical blanking period.
+class TeGpioVsyncSource : public VsyncSource {
+    private:
+        int eventFd; // Line event fd of the TE line
+        int cancelFd; // eventfd that cancel() writes to
+        uint64_t periodNsecs;
+    public:
+        TeGpioVsyncSource(const char *gpioChip, unsigned int line, double refreshRateHz);
+        ~TeGpioVsyncSource();
+
+        bool waitEdge(uint64_t deadlineNsecs, uint64_t& edgeNsecs) override;
+        void cancel() override;
+        uint64_t nominalPeriodNsecs() override { return periodNsecs; }
+};
+
+// Edges that are fed in with pushEdge(), e.g. from a recording or a test. An edge is delivered once the clock has
+// passed its timestamp, so feeding timestamps with gaps in them simulates missed TE pulses.
+class SimulatedVsyncSource : public VsyncSource {
+    private:
+        mutex mtx;
+        condition_variable cv;
+        deque<uint64_t> edges;
+        bool cancelled = false;
+        uint64_t periodNsecs;
+    public:
+        SimulatedVsyncSource(double refreshRateHz);
+
+        void pushEdge(uint64_t edgeNsecs);
+
+        bool waitEdge(uint64_t deadlineNsecs, uint64_t& edgeNsecs) override;
+        void cancel() override;
+        uint64_t nominalPeriodNsecs() override { return periodNsecs; }
+};
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "bcm2835_transport.h"
+#include "gpio_utils.h"
+#include "util.h"
+
+// Uncomment this to print out all bytes sent to the SPI bus
+// #define DEBUG_SPI_BUS_WRITES
+
+#ifdef DEBUG_SPI_BUS_WRITES
+static uint32_t writeCounter = 0;
+#define DEBUG_PRINT_WRITTEN_BYTE(byte) do { \
+  printf("%02X", byte); \
+  if ((++writeCounter & 3) == 0) printf("\n"); \
+  } while(0)
+#else
+#define DEBUG_PRINT_WRITTEN_BYTE(byte) ((void)0)
+#endif
+
+// Errata to BCM2835 behavior: documentation states that the SPI0 DLEN register is only used for DMA. However, even when DMA is not being utilized, setting it from
+// a value != 0 or 1 gets rid of an excess idle clock cycle that is present when transmitting each byte. (by default in Polled SPI Mode each 8 bits transfer in 9 clocks)
+// With DLEN=2 each byte is clocked to the bus in 8 cycles, observed to improve max throughput from 56.8mbps to 63.3mbps (+11.4%, quite close to the theoretical +12.5%)
+// https://www.raspberrypi.org/forums/viewtopic.php?f=44&t=181154
+#define UNLOCK_FAST_8_CLOCKS_SPI() (spi->dlen = 2)
+
+Bcm2835Transport::Bcm2835Transport(volatile SPIRegisterFile *spi, volatile GPIORegisterFile *gpio): spi(spi), gpio(gpio), chipSelect(0) {
+  // By default all GPIO pins are in input mode (0x00), initialize them for SPI and GPIO writes
+  set_gpio_mode(gpio, GPIO_TFT_DATA_CONTROL, 0x01); // Data/Control pin to output (0x01)
+  set_gpio_mode(gpio, GPIO_SPI0_MISO, 0x04);
+  set_gpio_mode(gpio, GPIO_SPI0_MOSI, 0x04);
+  set_gpio_mode(gpio, GPIO_SPI0_CLK, 0x04);
+  // The Adafruit 1.65" 240x240 ST7789 based display is unique compared to others that it does want to see the Chip Select line go
+  // low and high to start a new command. For that display we let hardware SPI toggle the CS line, and actually run TA<-0 and TA<-1
+  // transitions to let the CS line live. For most other displays, we just set CS line always enabled for the display throughout
+  // fbcp-ili9341 lifetime, which is a tiny bit faster.
+  set_gpio_mode(gpio, GPIO_SPI0_CE0, 0x04);
+  set_gpio_mode(gpio, GPIO_SPI0_CE1, 0x04); // A second panel may sit on CE1
+
+  spi->cs = BCM2835_SPI0_CS_CLEAR; // Initialize the Control and Status register to defaults: CS=0 (Chip Select), CPHA=0 (Clock Phase), CPOL=0 (Clock Polarity), CSPOL=0 (Chip Select Polarity), TA=0 (Transfer not active), and reset TX and RX queues.
+  spi->clk = SPI_BUS_CLOCK_DIVISOR; // Clock Divider determines SPI bus speed, resulting speed=256MHz/clk
+
+  // Enable fast 8 clocks per byte transfer mode, instead of slower 9 clocks per byte.
+  UNLOCK_FAST_8_CLOCKS_SPI();
+}
+
+Bcm2835Transport::~Bcm2835Transport() {
+  spi->cs = BCM2835_SPI0_CS_CLEAR;
+
+#ifdef GPIO_TFT_DATA_CONTROL
+  set_gpio_mode(gpio, GPIO_TFT_DATA_CONTROL, 0);
+#endif
+  set_gpio_mode(gpio, GPIO_SPI0_CE1, 0);
+  set_gpio_mode(gpio, GPIO_SPI0_CE0, 0);
+  set_gpio_mode(gpio, GPIO_SPI0_MISO, 0);
+  set_gpio_mode(gpio, GPIO_SPI0_MOSI, 0);
+  set_gpio_mode(gpio, GPIO_SPI0_CLK, 0);
+}
+
+void Bcm2835Transport::writeFifo(uint8_t byte) {
+  spi->fifo = byte;
+  DEBUG_PRINT_WRITTEN_BYTE(byte);
+}
+
+// The CS field selects which of the CE0/CE1 lines TA asserts. Every write to the CS register while a transfer is
+// active must carry it along, or the transfer would jump over to the other panel.
+void Bcm2835Transport::begin() {
+  spi->cs = BCM2835_SPI0_CS_TA | chipSelect;
+}
+
+void Bcm2835Transport::command(uint8_t cmd) {
+  // An SPI transfer to the display always starts with one control (command) byte, followed by N data bytes.
+  clear_gpio(gpio, GPIO_TFT_DATA_CONTROL);
+
+  writeFifo(cmd);
+
+  while(!(spi->cs & (BCM2835_SPI0_CS_RXD|BCM2835_SPI0_CS_DONE))) /*nop*/;
+
+  set_gpio(gpio, GPIO_TFT_DATA_CONTROL);
+}
+
+void Bcm2835Transport::data(const uint8_t *bytes, uint32_t size) {
+  const uint8_t *end = bytes + size;
+  const uint8_t *prefillEnd = bytes + MIN(15, size);
+
+  while(bytes < prefillEnd) writeFifo(*bytes++);
+  while(bytes < end)
+  {
+    uint32_t cs = spi->cs;
+    if ((cs & BCM2835_SPI0_CS_TXD)) writeFifo(*bytes++);
+// TODO:      else asm volatile("yield");
+    if ((cs & (BCM2835_SPI0_CS_RXR|BCM2835_SPI0_CS_RXF))) spi->cs = BCM2835_SPI0_CS_CLEAR_RX | BCM2835_SPI0_CS_TA | chipSelect;
+  }
+}
+
+void Bcm2835Transport::end() {
+  flush();
+  spi->cs = BCM2835_SPI0_CS_CLEAR_RX | chipSelect; // Clear TA and any pending bytes
+}
+
+void Bcm2835Transport::flush() {
+  uint32_t cs;
+  while (!(((cs = spi->cs) ^ BCM2835_SPI0_CS_TA) & (BCM2835_SPI0_CS_DONE | BCM2835_SPI0_CS_TA))) // While TA=1 and DONE=0
+    if ((cs & (BCM2835_SPI0_CS_RXR | BCM2835_SPI0_CS_RXF)))
+      spi->cs = BCM2835_SPI0_CS_CLEAR_RX | BCM2835_SPI0_CS_TA | chipSelect;
+
+  if ((cs & BCM2835_SPI0_CS_RXD)) spi->cs = BCM2835_SPI0_CS_CLEAR_RX | BCM2835_SPI0_CS_TA | chipSelect;
+}
+
+// With TA=0 neither line is asserted, so switching panels is only a matter of which CS bits the next begin() writes
+void Bcm2835Transport::selectChip(uint8_t chip) {
+  chipSelect = chip & BCM2835_SPI0_CS_CS;
+}
+
+void Bcm2835Transport::setClockDivisor(uint32_t divisor) {
+  spi->clk = divisor;
+  __sync_synchronize();
+}
+
+void Bcm2835Transport::resetDisplay() {
+#if defined(GPIO_TFT_RESET_PIN) && GPIO_TFT_RESET_PIN >= 0
+  printf("Resetting display at reset GPIO pin %d\n", GPIO_TFT_RESET_PIN);
+  set_gpio_mode(gpio, GPIO_TFT_RESET_PIN, 1);
+  set_gpio(gpio, GPIO_TFT_RESET_PIN);
+  usleep(120 * 1000);
+  clear_gpio(gpio, GPIO_TFT_RESET_PIN);
+  usleep(120 * 1000);
+  set_gpio(gpio, GPIO_TFT_RESET_PIN);
+  usleep(120 * 1000);
+#endif
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "spi_transport.h"
+#include "spi.h"
+
+// Polled SPI0 through the BCM2835 register files mapped from /dev/mem. This is the fastest transport,
+// but needs root and a Pi.
+class Bcm2835Transport : public SpiTransport {
+    public:
+        Bcm2835Transport(volatile SPIRegisterFile *spi, volatile GPIORegisterFile *gpio);
+        ~Bcm2835Transport();
+
+        void begin() override;
+        void command(uint8_t cmd) override;
+        void data(const uint8_t *bytes, uint32_t size) override;
+        void end() override;
+        void flush() override;
+        void selectChip(uint8_t chipSelect) override;
+
+        void setClockDivisor(uint32_t divisor) override;
+        void resetDisplay() override;
+
+    private:
+        volatile SPIRegisterFile *spi;
+        volatile GPIORegisterFile *gpio;
+        uint32_t chipSelect; // BCM2835_SPI0_CS_CS bits of the selected panel
+
+        void writeFifo(uint8_t byte);
+};
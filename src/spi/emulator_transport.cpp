@@ -0,0 +1,42 @@
+#include "emulator_transport.h"
+
+EmulatorTransport::EmulatorTransport(int panelWidth, int panelHeight) {
+  for(int i = 0; i < SPI_NUM_CHIP_SELECTS; ++i)
+    panels[i] = new St7789Emulator(panelWidth, panelHeight);
+  selected = panels[0];
+}
+
+EmulatorTransport::~EmulatorTransport() {
+  for(int i = 0; i < SPI_NUM_CHIP_SELECTS; ++i)
+    delete panels[i];
+}
+
+void EmulatorTransport::begin() {
+}
+
+void EmulatorTransport::command(uint8_t cmd) {
+  selected->command(cmd);
+}
+
+void EmulatorTransport::data(const uint8_t *bytes, uint32_t size) {
+  selected->data(bytes, size);
+}
+
+void EmulatorTransport::end() {
+  selected->endTransfer();
+}
+
+void EmulatorTransport::flush() {
+}
+
+void EmulatorTransport::selectChip(uint8_t chipSelect) {
+  selected = panels[chipSelect];
+}
+
+void EmulatorTransport::setClockDivisor(uint32_t) {
+}
+
+void EmulatorTransport::resetDisplay() {
+  for(int i = 0; i < SPI_NUM_CHIP_SELECTS; ++i)
+    panels[i]->reset();
+}
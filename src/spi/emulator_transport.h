@@ -0,0 +1,28 @@
+#pragma once
+
+#include "spi_transport.h"
+#include "st7789_emulator.h"
+
+// Feeds the byte stream into an emulated ST7789 per chip select instead of sending it anywhere, so that what the task
+// pipeline draws can be inspected pixel by pixel, and dumped as PNG, on a development machine.
+class EmulatorTransport : public SpiTransport {
+    public:
+        EmulatorTransport(int panelWidth, int panelHeight);
+        ~EmulatorTransport();
+
+        void begin() override;
+        void command(uint8_t cmd) override;
+        void data(const uint8_t *bytes, uint32_t size) override;
+        void end() override;
+        void flush() override;
+        void selectChip(uint8_t chipSelect) override;
+
+        void setClockDivisor(uint32_t divisor) override;
+        void resetDisplay() override;
+
+        St7789Emulator *panel(int chipSelect) { return panels[chipSelect]; }
+
+    private:
+        St7789Emulator *panels[SPI_NUM_CHIP_SELECTS];
+        St7789Emulator *selected;
+};
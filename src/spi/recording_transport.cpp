@@ -0,0 +1,56 @@
+#include "recording_transport.h"
+
+RecordingTransport::RecordingTransport(uint32_t capacityBytes): capacity(capacityBytes), selectedChip(0) {
+  recordedData.reserve(capacity);
+  clear();
+}
+
+void RecordingTransport::clear() {
+  recordedCommands.clear();
+  recordedData.clear();
+  isTruncated = false;
+  numTransfers = numCommandBytes = numDataBytes = numChipSelectSwitches = 0;
+}
+
+void RecordingTransport::begin() {
+  ++numTransfers;
+}
+
+void RecordingTransport::command(uint8_t cmd) {
+  ++numCommandBytes;
+  if (isTruncated) return;
+  RecordedCommand c = { cmd, selectedChip, (uint32_t)recordedData.size(), 0 };
+  recordedCommands.push_back(c);
+}
+
+void RecordingTransport::data(const uint8_t *bytes, uint32_t size) {
+  numDataBytes += size;
+  if (isTruncated || recordedCommands.empty()) return;
+  if (recordedData.size() + size > capacity)
+  {
+    // Stop recording at a command boundary, so that the recorded stream stays well formed
+    isTruncated = true;
+    recordedData.resize(recordedCommands.back().dataOffset);
+    recordedCommands.pop_back();
+    return;
+  }
+  recordedData.insert(recordedData.end(), bytes, bytes + size);
+  recordedCommands.back().dataSize += size;
+}
+
+void RecordingTransport::end() {
+}
+
+void RecordingTransport::flush() {
+}
+
+void RecordingTransport::selectChip(uint8_t chipSelect) {
+  ++numChipSelectSwitches;
+  selectedChip = chipSelect;
+}
+
+void RecordingTransport::setClockDivisor(uint32_t) {
+}
+
+void RecordingTransport::resetDisplay() {
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <vector>
+
+#include "spi_transport.h"
+
+// A command as seen on the bus: the command byte, and the data bytes that followed it up until the next command
+typedef struct RecordedCommand
+{
+  uint8_t cmd;
+  uint8_t chipSelect; // Panel that the command went to
+  uint32_t dataOffset; // Offset of the data bytes in RecordingTransport::dataBytes()
+  uint32_t dataSize;
+} RecordedCommand;
+
+// Records the command and data byte stream in memory instead of sending it anywhere. Needs no display hardware, so
+// the whole task pipeline can be run and throughput-benchmarked on a development machine.
+class RecordingTransport : public SpiTransport {
+    public:
+        // Once capacityBytes worth of data has been recorded, further bytes are only counted and not stored,
+        // so that long benchmark runs do not grow without bounds.
+        RecordingTransport(uint32_t capacityBytes);
+
+        void begin() override;
+        void command(uint8_t cmd) override;
+        void data(const uint8_t *bytes, uint32_t size) override;
+        void end() override;
+        void flush() override;
+        void selectChip(uint8_t chipSelect) override;
+
+        void setClockDivisor(uint32_t divisor) override;
+        void resetDisplay() override;
+
+        const std::vector<RecordedCommand>& commands() const { return recordedCommands; }
+        const std::vector<uint8_t>& dataBytes() const { return recordedData; }
+
+        uint64_t transfers() const { return numTransfers; }
+        uint64_t commandBytes() const { return numCommandBytes; }
+        uint64_t dataByteCount() const { return numDataBytes; }
+        uint64_t busBytes() const { return numCommandBytes + numDataBytes; }
+        uint64_t chipSelectSwitches() const { return numChipSelectSwitches; }
+        bool truncated() const { return isTruncated; }
+
+        void clear();
+
+    private:
+        std::vector<RecordedCommand> recordedCommands;
+        std::vector<uint8_t> recordedData;
+        uint32_t capacity;
+        bool isTruncated;
+        uint8_t selectedChip;
+
+        volatile uint64_t numTransfers;
+        volatile uint64_t numCommandBytes;
+        volatile uint64_t numDataBytes;
+        volatile uint64_t numChipSelectSwitches;
+};
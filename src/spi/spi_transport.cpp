@@ -0,0 +1,47 @@
+#include <stdio.h>
+
+#include "config.h"
+#include "spi_transport.h"
+#include "spi.h"
+#include "util.h"
+#include "bcm2835_transport.h"
+#include "spidev_transport.h"
+#include "recording_transport.h"
+#include "emulator_transport.h"
+
+// How many bytes of the stream the recording transport keeps in memory, roughly 16 full frames
+#define RECORDING_TRANSPORT_CAPACITY (DISPLAY_WIDTH*DISPLAY_HEIGHT*SPI_BYTESPERPIXEL*16)
+
+SpiTransport *CreateSpiTransport() {
+#if defined(SPI_TRANSPORT_SPIDEV)
+  return new SpidevTransport(SPIDEV_DEVICE, GPIO_CHIP_DEVICE);
+#elif defined(SPI_TRANSPORT_RECORDING)
+  return new RecordingTransport(RECORDING_TRANSPORT_CAPACITY);
+#elif defined(SPI_TRANSPORT_EMULATOR)
+  return new EmulatorTransport(DISPLAY_NATIVE_WIDTH, DISPLAY_NATIVE_HEIGHT);
+#else
+  return new Bcm2835Transport(spi, gpio);
+#endif
+}
+
+#ifdef SPI_TRANSPORT_EMULATOR
+void DumpEmulatedPanels(const char *pathFormat) {
+  EmulatorTransport *emulator = (EmulatorTransport*)spiBus->transport;
+  for(int i = 0; i < spiBus->numPanels; ++i)
+  {
+    St7789Emulator *panel = emulator->panel(spiBus->panels[i]->chipSelect);
+    char path[256];
+    snprintf(path, sizeof(path), pathFormat, i);
+    if (!panel->writePng(path)) printf("Could not write %s\n", path);
+
+    const St7789Stats &s = panel->stats;
+    double frames = MAX(spiBus->panels[i]->framesSent, 1);
+    printf("Emulated panel %d: %s, %llu frames, counting the init: %.1f bytes/frame, %.1f commands/frame, %.1f CASET/RASET/frame, %.1f%% of %llu pixel writes unchanged",
+      i, path, (unsigned long long)spiBus->panels[i]->framesSent, (s.commands + s.dataBytes) / frames, s.commands / frames, s.windowCommands / frames,
+      s.unchangedPixelWrites * 100.0 / MAX(s.pixelWrites, 1), (unsigned long long)s.pixelWrites);
+    if (s.outOfRangePixelWrites) printf(", %llu out of GRAM", (unsigned long long)s.outOfRangePixelWrites);
+    if (s.unsupportedCommands) printf(", %llu unsupported commands", (unsigned long long)s.unsupportedCommands);
+    printf("\n");
+  }
+}
+#endif
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <inttypes.h>
+
+// SPI0 has two hardware chip select lines, CE0 and CE1, so up to two panels can share the bus
+#define SPI_NUM_CHIP_SELECTS 2
+
+// Byte level interface between the SPI task queue and the display bus. The SPI thread (and the display
+// init code, before the thread is started) only talks to the display through this, so the same task
+// pipeline can drive the panel over polled BCM2835 SPI0, over Linux spidev, or record to memory.
+class SpiTransport {
+    public:
+        virtual ~SpiTransport() {}
+
+        // Starts a transfer, asserting the chip select line
+        virtual void begin() = 0;
+        // Sends one command byte with the D/C line low
+        virtual void command(uint8_t cmd) = 0;
+        // Sends data bytes with the D/C line high
+        virtual void data(const uint8_t *bytes, uint32_t size) = 0;
+        // Waits for all written bytes to leave the bus and ends the transfer, deasserting the chip select line
+        virtual void end() = 0;
+        // Ends a transfer that another one of the same frame follows. A transport that batches the transfers of a
+        // frame into few system calls (spidev) may keep the bytes queued until the end() of the frame's last
+        // transfer or the next selectChip(). The bytes are copied by then, so the caller may reuse their memory.
+        virtual void endMidFrame() { end(); }
+        // Makes sure that the written bytes are on the bus before the D/C line changes, but keeps the transfer active.
+        // The polled transport waits for them to leave its FIFO.
+        virtual void flush() = 0;
+
+        // Routes the following transfers to the panel on the given chip select line (0: CE0, 1: CE1). Only called
+        // in between transfers, and only when the selected panel changes.
+        virtual void selectChip(uint8_t chipSelect) = 0;
+
+        // Sets the bus speed in terms of the BCM2835 SPI0 CDIV clock divisor, like SPI_BUS_CLOCK_DIVISOR
+        virtual void setClockDivisor(uint32_t divisor) = 0;
+        // Toggles the display reset line high->low->high, if the display has one
+        virtual void resetDisplay() = 0;
+};
+
+// Creates the transport that the build was configured with (-DSPI_TRANSPORT=bcm2835/spidev/recording/emulator)
+SpiTransport *CreateSpiTransport();
+
+#ifdef SPI_TRANSPORT_EMULATOR
+// Writes what each emulated panel shows to a PNG (pathFormat takes the panel index as %d), and prints the bytes and
+// commands per frame that it received. Called by DeinitSPI() once the SPI thread has quit, so tasks that were still
+// queued then are not on the panels.
+void DumpEmulatedPanels(const char *pathFormat);
+#endif
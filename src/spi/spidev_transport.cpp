@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+
+#include "config.h"
+#include "spidev_transport.h"
+#include "spi.h"
+#include "util.h"
+
+// The spidev driver refuses messages larger than its bufsiz module parameter, which defaults to 4096 bytes. It can be
+// raised with e.g. spidev.bufsiz=65536 in /boot/cmdline.txt, which allows a lot more batching.
+#define SPIDEV_DEFAULT_BUFSIZ 4096
+
+int SpidevSyscalls::open(const char *path, int flags) {
+  return ::open(path, flags);
+}
+
+int SpidevSyscalls::ioctl(int fd, unsigned long request, void *arg) {
+  return ::ioctl(fd, request, arg);
+}
+
+int SpidevSyscalls::close(int fd) {
+  return ::close(fd);
+}
+
+uint32_t SpidevSyscalls::maxMessageSize() {
+  uint32_t bufsiz = SPIDEV_DEFAULT_BUFSIZ;
+  FILE *handle = fopen("/sys/module/spidev/parameters/bufsiz", "r");
+  if (handle)
+  {
+    if (fscanf(handle, "%u", &bufsiz) != 1 || bufsiz == 0) bufsiz = SPIDEV_DEFAULT_BUFSIZ;
+    fclose(handle);
+  }
+  return bufsiz;
+}
+
+// Requests the given GPIO line as an output, and returns the line handle fd
+static int RequestOutputLine(SpidevSyscalls *sys, int chipFd, unsigned int line, uint8_t initialValue) {
+  struct gpiohandle_request request;
+  memset(&request, 0, sizeof(request));
+  request.lineoffsets[0] = line;
+  request.lines = 1;
+  request.flags = GPIOHANDLE_REQUEST_OUTPUT;
+  request.default_values[0] = initialValue;
+  strcpy(request.consumer_label, "fbcp");
+  if (sys->ioctl(chipFd, GPIO_GET_LINEHANDLE_IOCTL, &request) < 0) FATAL_ERROR("Failed to request GPIO line from the GPIO character device!");
+  return request.fd;
+}
+
+int SpidevTransport::openSpiDevice(const char *path) {
+  int fd = sys->open(path, O_RDWR);
+  if (fd < 0) FATAL_ERROR("Failed to open spidev device (is SPI enabled in /boot/config.txt?)");
+
+  uint8_t mode = SPI_MODE_0;
+  uint8_t bitsPerWord = 8;
+  if (sys->ioctl(fd, SPI_IOC_WR_MODE, &mode) < 0) FATAL_ERROR("Failed to set spidev SPI mode!");
+  if (sys->ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &bitsPerWord) < 0) FATAL_ERROR("Failed to set spidev bits per word!");
+  return fd;
+}
+
+SpidevTransport::SpidevTransport(const char *spiDevice, const char *gpioChip, SpidevSyscalls *syscalls): sys(syscalls), ownsSyscalls(!syscalls), resetFd(-1), numPending(0), pendingBytes(0) {
+  if (!sys) sys = new SpidevSyscalls();
+
+  snprintf(this->spiDevice, sizeof(this->spiDevice), "%s", spiDevice);
+  for(int i = 0; i < SPI_NUM_CHIP_SELECTS; ++i) spiFds[i] = -1;
+  spiFd = spiFds[0] = openSpiDevice(spiDevice);
+  setClockDivisor(SPI_BUS_CLOCK_DIVISOR);
+  maxMessageSize = sys->maxMessageSize();
+  pendingData = (uint8_t*)malloc(maxMessageSize);
+  if (!pendingData) FATAL_ERROR("Failed to allocate the spidev message buffer!");
+
+  int chipFd = sys->open(gpioChip, O_RDWR);
+  if (chipFd < 0) FATAL_ERROR("Failed to open GPIO character device!");
+  dataControlFd = RequestOutputLine(sys, chipFd, GPIO_TFT_DATA_CONTROL, 1);
+  dataControlLevel = 1;
+#if defined(GPIO_TFT_RESET_PIN) && GPIO_TFT_RESET_PIN >= 0
+  resetFd = RequestOutputLine(sys, chipFd, GPIO_TFT_RESET_PIN, 1);
+#endif
+  sys->close(chipFd); // Line handles stay valid after the chip fd is closed
+
+  printf("spidev transport: %s at %uhz, %u bytes per message, D/C line %d on %s\n", spiDevice, speedHz, maxMessageSize, GPIO_TFT_DATA_CONTROL, gpioChip);
+}
+
+SpidevTransport::~SpidevTransport() {
+  submit();
+  if (resetFd >= 0) sys->close(resetFd);
+  sys->close(dataControlFd);
+  for(int i = 0; i < SPI_NUM_CHIP_SELECTS; ++i)
+    if (spiFds[i] >= 0) sys->close(spiFds[i]);
+  free(pendingData);
+  if (ownsSyscalls) delete sys;
+}
+
+void SpidevTransport::setLine(int lineFd, uint8_t value) {
+  struct gpiohandle_data data;
+  memset(&data, 0, sizeof(data));
+  data.values[0] = value;
+  if (sys->ioctl(lineFd, GPIOHANDLE_SET_LINE_VALUES_IOCTL, &data) < 0) FATAL_ERROR("Failed to set GPIO line value!");
+}
+
+void SpidevTransport::setDataControl(uint8_t level) {
+  if (dataControlLevel == level) return;
+  submit(); // Everything queued so far must be on the bus before the D/C line can change
+  setLine(dataControlFd, level);
+  dataControlLevel = level;
+}
+
+void SpidevTransport::queue(const uint8_t *bytes, uint32_t size) {
+  while(size > 0)
+  {
+    if (numPending == SPIDEV_MAX_TRANSFERS_PER_MESSAGE || pendingBytes == maxMessageSize) submit();
+    uint32_t chunk = MIN(size, maxMessageSize - pendingBytes);
+    memcpy(pendingData + pendingBytes, bytes, chunk);
+    struct spi_ioc_transfer *xfer = &pending[numPending++];
+    memset(xfer, 0, sizeof(*xfer));
+    xfer->tx_buf = (uintptr_t)(pendingData + pendingBytes);
+    xfer->len = chunk;
+    xfer->speed_hz = speedHz;
+    xfer->bits_per_word = 8;
+    pendingBytes += chunk;
+    bytes += chunk;
+    size -= chunk;
+  }
+}
+
+void SpidevTransport::submit() {
+  if (numPending == 0) return;
+  if (sys->ioctl(spiFd, SPI_IOC_MESSAGE(numPending), pending) < 0) FATAL_ERROR("spidev SPI_IOC_MESSAGE failed!");
+  numPending = 0;
+  pendingBytes = 0;
+}
+
+// spidev asserts chip select for the duration of each message by itself, so there is no transfer state to begin.
+void SpidevTransport::begin() {
+}
+
+void SpidevTransport::command(uint8_t cmd) {
+  setDataControl(0);
+  queue(&cmd, 1);
+}
+
+void SpidevTransport::data(const uint8_t *bytes, uint32_t size) {
+  setDataControl(1);
+  queue(bytes, size);
+}
+
+// The SPI_IOC_MESSAGE ioctl only returns once the message is on the bus, so ending only needs to submit what has been
+// queued. Flushing is what the polled transport needs before the D/C line changes, which setDataControl() already
+// takes care of here, so it leaves the bytes queued for the rest of the frame.
+void SpidevTransport::end() {
+  submit();
+}
+
+void SpidevTransport::endMidFrame() {
+}
+
+void SpidevTransport::flush() {
+}
+
+void SpidevTransport::selectChip(uint8_t chipSelect) {
+  if (chipSelect >= SPI_NUM_CHIP_SELECTS) FATAL_ERROR("Chip select out of range!");
+  submit(); // A message only ever goes to one device
+  if (spiFds[chipSelect] < 0)
+  {
+    char path[sizeof(spiDevice)];
+    snprintf(path, sizeof(path), "%s", spiDevice);
+    path[strlen(path)-1] = '0' + chipSelect;
+    spiFds[chipSelect] = openSpiDevice(path);
+    printf("spidev transport: chip select %d on %s\n", chipSelect, path);
+  }
+  spiFd = spiFds[chipSelect];
+}
+
+void SpidevTransport::setClockDivisor(uint32_t divisor) {
+  submit(); // Queued transfers were meant to go at the old speed
+  speedHz = SPI_NOMINAL_CORE_FREQUENCY / divisor;
+}
+
+void SpidevTransport::resetDisplay() {
+  if (resetFd < 0) return;
+  submit();
+  printf("Resetting display at reset GPIO pin %d\n", GPIO_TFT_RESET_PIN);
+  setLine(resetFd, 1);
+  usleep(120 * 1000);
+  setLine(resetFd, 0);
+  usleep(120 * 1000);
+  setLine(resetFd, 1);
+  usleep(120 * 1000);
+}
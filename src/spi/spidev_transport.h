@@ -0,0 +1,72 @@
+#pragma once
+
+#include <linux/spi/spidev.h>
+
+#include "spi_transport.h"
+
+// Most transfers that are batched into a single SPI_IOC_MESSAGE ioctl
+#define SPIDEV_MAX_TRANSFERS_PER_MESSAGE 64
+
+// The system calls that the spidev transport makes. Overridden by a fake spidev driver in tools/bench, so that the
+// transport can be run and measured on hosts that do not have SPI hardware.
+class SpidevSyscalls {
+    public:
+        virtual ~SpidevSyscalls() {}
+        virtual int open(const char *path, int flags);
+        virtual int ioctl(int fd, unsigned long request, void *arg);
+        virtual int close(int fd);
+        // The most bytes the spidev driver accepts in one message (its bufsiz module parameter)
+        virtual uint32_t maxMessageSize();
+};
+
+// Drives the display through the Linux spidev driver (/dev/spidevX.Y), with the D/C and reset lines driven through
+// the GPIO character device (/dev/gpiochipN). Slower than the polled BCM2835 transport, but does not need /dev/mem
+// access, so it works as a non-root user and on hardened images.
+//
+// Every ioctl is a round trip to the kernel, so bytes are not sent right away. They are copied into a single
+// SPI_IOC_MESSAGE, across the transfers of a frame (endMidFrame()), until the D/C line needs to change, the message
+// grows to the driver's bufsiz limit or to SPIDEV_MAX_TRANSFERS_PER_MESSAGE transfers, the chip select changes, or
+// the last transfer of the frame is ended. The D/C line is a GPIO of its own, so a message cannot span a change of it.
+//
+// A panel on the other chip select line is driven through the sibling spidev device (e.g. /dev/spidev0.1 next to
+// /dev/spidev0.0), which is opened the first time that panel is selected. Both panels share the D/C and reset lines.
+class SpidevTransport : public SpiTransport {
+    public:
+        // If syscalls is null, the real system calls are used
+        SpidevTransport(const char *spiDevice, const char *gpioChip, SpidevSyscalls *syscalls = 0);
+        ~SpidevTransport();
+
+        void begin() override;
+        void command(uint8_t cmd) override;
+        void data(const uint8_t *bytes, uint32_t size) override;
+        void end() override;
+        void endMidFrame() override;
+        void flush() override;
+        void selectChip(uint8_t chipSelect) override;
+
+        void setClockDivisor(uint32_t divisor) override;
+        void resetDisplay() override;
+
+    private:
+        SpidevSyscalls *sys;
+        bool ownsSyscalls;
+        char spiDevice[64]; // Device of CE0, the devices of the other chip selects only differ in the last digit
+        int spiFds[SPI_NUM_CHIP_SELECTS]; // -1 until the chip select is used
+        int spiFd; // Device of the selected chip select
+        int dataControlFd; // GPIO line handle of the D/C line
+        int resetFd; // GPIO line handle of the reset line, or -1 if the display does not have one
+        uint32_t speedHz;
+        uint32_t maxMessageSize;
+
+        int dataControlLevel; // Current level of the D/C line, or -1 if not known
+        struct spi_ioc_transfer pending[SPIDEV_MAX_TRANSFERS_PER_MESSAGE];
+        uint8_t *pendingData; // maxMessageSize bytes that the pending transfers point into, since the task memory they came from is reused once the task is done
+        uint32_t numPending;
+        uint32_t pendingBytes;
+
+        int openSpiDevice(const char *path);
+        void setLine(int lineFd, uint8_t value);
+        void setDataControl(uint8_t level);
+        void queue(const uint8_t *bytes, uint32_t size);
+        void submit();
+};
@@ -0,0 +1,252 @@
+#include <string.h>
+#include <vector>
+
+#include "st7789_emulator.h"
+#include "png_writer.h"
+
+// ST7789 commands that the emulator models
+#define ST7789_NOP 0x00
+#define ST7789_SWRESET 0x01
+#define ST7789_SLPIN 0x10
+#define ST7789_SLPOUT 0x11
+#define ST7789_PTLON 0x12
+#define ST7789_NORON 0x13
+#define ST7789_INVOFF 0x20
+#define ST7789_INVON 0x21
+#define ST7789_DISPOFF 0x28
+#define ST7789_DISPON 0x29
+#define ST7789_CASET 0x2A
+#define ST7789_RASET 0x2B
+#define ST7789_RAMWR 0x2C
+#define ST7789_VSCRDEF 0x33
+#define ST7789_TEOFF 0x34
+#define ST7789_TEON 0x35
+#define ST7789_MADCTL 0x36
+#define ST7789_VSCSAD 0x37
+#define ST7789_IDMOFF 0x38
+#define ST7789_IDMON 0x39
+#define ST7789_COLMOD 0x3A
+#define ST7789_RAMWRC 0x3C
+#define ST7789_WRDISBV 0x51
+#define ST7789_FRCTRL2 0xC6
+
+// COLMOD control interface formats
+#define ST7789_COLMOD_16BPP 0x05
+#define ST7789_COLMOD_18BPP 0x06
+
+static uint32_t Rgb565ToRgb666(uint16_t c)
+{
+  uint32_t r = (c >> 11) & 0x1F, g = (c >> 5) & 0x3F, b = c & 0x1F;
+  // The controller fills the missing low bit of the 5 bit channels with their top bit
+  return (((r << 1) | (r >> 4)) << 12) | (g << 6) | ((b << 1) | (b >> 4));
+}
+
+static uint16_t Rgb666ToRgb565(uint32_t c)
+{
+  return (uint16_t)((((c >> 13) & 0x1F) << 11) | (((c >> 6) & 0x3F) << 5) | ((c >> 1) & 0x1F));
+}
+
+St7789Emulator::St7789Emulator(int panelWidth, int panelHeight, bool invertedPanel)
+:panelWidth(panelWidth), panelHeight(panelHeight), invertedPanel(invertedPanel)
+{
+  // GRAM contents are undefined at power on: fill it with noise, so that a frame that does not cover all of it shows
+  uint32_t noise = 1;
+  for(int y = 0; y < ST7789_GRAM_HEIGHT; ++y)
+    for(int x = 0; x < ST7789_GRAM_WIDTH; ++x)
+      gram[y][x] = (noise = noise * 1664525u + 1013904223u) >> 14;
+  reset();
+  resetStats();
+}
+
+void St7789Emulator::reset()
+{
+  memoryAccessControl = 0;
+  pixelFormat = ST7789_COLMOD_18BPP;
+  columnStart = 0;
+  columnEnd = ST7789_GRAM_WIDTH - 1;
+  rowStart = 0;
+  rowEnd = ST7789_GRAM_HEIGHT - 1;
+  topFixedArea = 0;
+  scrollArea = ST7789_GRAM_HEIGHT;
+  bottomFixedArea = 0;
+  scrollStart = 0;
+  isScrolling = false;
+  isInverted = false;
+  isDisplayOn = false;
+  isSleeping = true;
+  brightnessValue = 0;
+  currentCommand = -1;
+  numParams = numPixelBytes = 0;
+  cursorX = cursorY = 0;
+}
+
+void St7789Emulator::resetStats()
+{
+  memset(&stats, 0, sizeof(stats));
+}
+
+void St7789Emulator::command(uint8_t cmd)
+{
+  finishCommand();
+  ++stats.commands;
+  ++stats.commandCounts[cmd];
+  currentCommand = cmd;
+  switch(cmd)
+  {
+    case ST7789_NOP: case ST7789_TEOFF: case ST7789_TEON: case ST7789_IDMOFF: case ST7789_IDMON: case ST7789_FRCTRL2:
+    case ST7789_MADCTL: case ST7789_COLMOD: case ST7789_VSCRDEF: case ST7789_VSCSAD: case ST7789_WRDISBV: break;
+    case ST7789_CASET: case ST7789_RASET: ++stats.windowCommands; break;
+    case ST7789_SWRESET: reset(); break;
+    case ST7789_SLPIN: isSleeping = true; break;
+    case ST7789_SLPOUT: isSleeping = false; break;
+    case ST7789_PTLON: case ST7789_NORON: isScrolling = false; break;
+    case ST7789_INVOFF: isInverted = false; break;
+    case ST7789_INVON: isInverted = true; break;
+    case ST7789_DISPOFF: isDisplayOn = false; break;
+    case ST7789_DISPON: isDisplayOn = true; break;
+    case ST7789_RAMWR: cursorX = columnStart; cursorY = rowStart; break;
+    case ST7789_RAMWRC: break;
+    default: ++stats.unsupportedCommands; break;
+  }
+}
+
+void St7789Emulator::data(const uint8_t *bytes, uint32_t size)
+{
+  stats.dataBytes += size;
+  if (currentCommand == ST7789_RAMWR || currentCommand == ST7789_RAMWRC)
+  {
+    uint32_t bytesPerPixel = (pixelFormat == ST7789_COLMOD_16BPP) ? 2 : 3;
+    for(uint32_t i = 0; i < size; ++i)
+    {
+      pixelBytes[numPixelBytes++] = bytes[i];
+      if (numPixelBytes < bytesPerPixel) continue;
+      numPixelBytes = 0;
+      if (bytesPerPixel == 2) writePixel(Rgb565ToRgb666((pixelBytes[0] << 8) | pixelBytes[1]));
+      else writePixel(((pixelBytes[0] >> 2) << 12) | ((pixelBytes[1] >> 2) << 6) | (pixelBytes[2] >> 2));
+    }
+  }
+  else if (currentCommand >= 0)
+    for(uint32_t i = 0; i < size; ++i)
+      parameter(bytes[i]);
+}
+
+void St7789Emulator::endTransfer()
+{
+  finishCommand();
+}
+
+void St7789Emulator::finishCommand()
+{
+  // A pixel that was cut short by the next command is dropped, like the controller does
+  currentCommand = -1;
+  numParams = numPixelBytes = 0;
+}
+
+void St7789Emulator::parameter(uint8_t byte)
+{
+  if (numParams >= sizeof(params)) return;
+  params[numParams++] = byte;
+  uint16_t param16 = (numParams >= 2) ? (params[numParams-2] << 8) | params[numParams-1] : 0;
+  switch(currentCommand)
+  {
+    // Each 16 bit parameter takes effect once both of its bytes have arrived, which is what lets the driver send
+    // only the start column/row when the end stays the same
+    case ST7789_CASET:
+      if (numParams == 2) columnStart = param16;
+      else if (numParams == 4) columnEnd = param16;
+      break;
+    case ST7789_RASET:
+      if (numParams == 2) rowStart = param16;
+      else if (numParams == 4) rowEnd = param16;
+      break;
+    case ST7789_MADCTL: if (numParams == 1) memoryAccessControl = byte; break;
+    case ST7789_COLMOD: if (numParams == 1) pixelFormat = byte & 0x07; break;
+    case ST7789_VSCRDEF:
+      if (numParams == 2) topFixedArea = param16;
+      else if (numParams == 4) scrollArea = param16;
+      else if (numParams == 6) bottomFixedArea = param16;
+      break;
+    case ST7789_VSCSAD:
+      if (numParams == 2)
+      {
+        scrollStart = param16;
+        isScrolling = true;
+      }
+      break;
+    case ST7789_WRDISBV: if (numParams == 1) brightnessValue = byte; break;
+    default: break;
+  }
+}
+
+// Maps an MCU address to GRAM: MX and MY mirror the address space that the MCU sees (320 columns by 240 rows with
+// MV), and MV then exchanges columns and rows
+bool St7789Emulator::gramAddress(int x, int y, int *column, int *row) const
+{
+  bool mv = (memoryAccessControl & ST7789_MADCTL_MV) != 0;
+  int w = mv ? ST7789_GRAM_HEIGHT : ST7789_GRAM_WIDTH;
+  int h = mv ? ST7789_GRAM_WIDTH : ST7789_GRAM_HEIGHT;
+  if (x < 0 || y < 0 || x >= w || y >= h) return false;
+  if (memoryAccessControl & ST7789_MADCTL_MX) x = w - 1 - x;
+  if (memoryAccessControl & ST7789_MADCTL_MY) y = h - 1 - y;
+  *column = mv ? y : x;
+  *row = mv ? x : y;
+  return true;
+}
+
+void St7789Emulator::writePixel(uint32_t rgb666)
+{
+  ++stats.pixelWrites;
+  int column, row;
+  if (gramAddress(cursorX, cursorY, &column, &row))
+  {
+    if (gram[row][column] == rgb666) ++stats.unchangedPixelWrites;
+    gram[row][column] = rgb666;
+  }
+  else
+    ++stats.outOfRangePixelWrites;
+
+  // The cursor runs through the window column by column, then row by row, and wraps back to its start
+  if (++cursorX > columnEnd)
+  {
+    cursorX = columnStart;
+    if (++cursorY > rowEnd) cursorY = rowStart;
+  }
+}
+
+uint16_t St7789Emulator::pixelAt(int x, int y) const
+{
+  int column, row;
+  return gramAddress(x, y, &column, &row) ? Rgb666ToRgb565(gram[row][column]) : 0;
+}
+
+void St7789Emulator::renderVisible(uint8_t *rgb) const
+{
+  bool on = displayOn();
+  bool inverted = isInverted != invertedPanel;
+  bool bgr = (memoryAccessControl & ST7789_MADCTL_BGR) != 0;
+  for(int y = 0; y < panelHeight; ++y)
+  {
+    // In vertical scrolling mode, the scroll area between the fixed top and bottom areas shows GRAM from line
+    // scrollStart onwards, wrapping around within the scroll area
+    int row = y;
+    if (isScrolling && y >= topFixedArea && y < topFixedArea + scrollArea && scrollArea > 0)
+      row = topFixedArea + (y - topFixedArea + scrollStart - topFixedArea + scrollArea) % scrollArea;
+    for(int x = 0; x < panelWidth; ++x, rgb += 3)
+    {
+      uint32_t c = (on && row >= 0 && row < ST7789_GRAM_HEIGHT && x < ST7789_GRAM_WIDTH) ? gram[row][x] : 0;
+      if (on && inverted) c ^= 0x3FFFF;
+      uint8_t r = (c >> 12) & 0x3F, g = (c >> 6) & 0x3F, b = c & 0x3F;
+      if (bgr) { uint8_t t = r; r = b; b = t; }
+      rgb[0] = (r << 2) | (r >> 4);
+      rgb[1] = (g << 2) | (g >> 4);
+      rgb[2] = (b << 2) | (b >> 4);
+    }
+  }
+}
+
+bool St7789Emulator::writePng(const char *path) const
+{
+  std::vector<uint8_t> rgb(panelWidth * panelHeight * 3);
+  renderVisible(rgb.data());
+  return WritePng(path, panelWidth, panelHeight, rgb.data());
+}
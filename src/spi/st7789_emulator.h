@@ -0,0 +1,92 @@
+#pragma once
+
+#include <inttypes.h>
+
+// The ST7789 has a 240x320 graphics memory (GRAM), of which a panel shows panelWidth x panelHeight lines
+#define ST7789_GRAM_WIDTH 240
+#define ST7789_GRAM_HEIGHT 320
+
+// MADCTL bits
+#define ST7789_MADCTL_MY 0x80 // Row address order
+#define ST7789_MADCTL_MX 0x40 // Column address order
+#define ST7789_MADCTL_MV 0x20 // Row/column exchange
+#define ST7789_MADCTL_BGR 0x08
+
+// What the emulated panel received, since the last reset of the counters
+typedef struct St7789Stats
+{
+  uint64_t commands;
+  uint64_t dataBytes; // Parameter and pixel bytes
+  uint64_t windowCommands; // CASET and RASET
+  uint64_t pixelWrites;
+  uint64_t unchangedPixelWrites; // Pixels that were written with the color that they already had: wasted bandwidth
+  uint64_t outOfRangePixelWrites; // Pixels that fell outside of GRAM, e.g. from a window beyond its edges
+  uint64_t unsupportedCommands; // Commands that the emulator does not model, and whose parameters were ignored
+  uint32_t commandCounts[256];
+} St7789Stats;
+
+// Interprets the command stream of an ST7789 into an emulated GRAM image, following the datasheet: CASET and RASET
+// take effect parameter by parameter (so a CASET of only the start column leaves the end column as it was), RAMWR
+// starts writing at the start of the window, and the write cursor runs along the columns of the window, then down its
+// rows, wrapping around to the start of the window at its end. MADCTL maps the window to GRAM, COLMOD picks 16 or 18
+// bits per pixel, and VSCRDEF/VSCSAD scroll the lines that the panel shows.
+class St7789Emulator {
+    public:
+        // invertedPanel: the panel shows inverted colors unless INVON is set, as most ST7789 IPS panels do
+        St7789Emulator(int panelWidth = ST7789_GRAM_WIDTH, int panelHeight = ST7789_GRAM_HEIGHT, bool invertedPanel = true);
+
+        // Hardware reset: the registers go to their defaults, GRAM keeps its contents
+        void reset();
+
+        // The byte stream of one transfer, as the SPI transport sends it
+        void command(uint8_t cmd);
+        void data(const uint8_t *bytes, uint32_t size);
+        // The chip select was deasserted, which ends the command in progress
+        void endTransfer();
+
+        // GRAM contents at column x, row y of the MCU's address space under the current MADCTL (what a CASET x, RASET y
+        // write lands on), as RGB565. 0 if outside of GRAM.
+        uint16_t pixelAt(int x, int y) const;
+        // What the panel shows, as panelWidth x panelHeight 8 bit RGB triplets: GRAM scrolled, inverted, color order
+        // swapped, and black if the display is off or asleep
+        void renderVisible(uint8_t *rgb) const;
+        bool writePng(const char *path) const;
+
+        int width() const { return panelWidth; }
+        int height() const { return panelHeight; }
+        uint8_t madctl() const { return memoryAccessControl; }
+        bool displayOn() const { return isDisplayOn && !isSleeping; }
+        uint8_t brightness() const { return brightnessValue; } // WRDISBV, not applied to the rendered image
+
+        St7789Stats stats;
+        void resetStats();
+
+    private:
+        void finishCommand();
+        void parameter(uint8_t byte);
+        void writePixel(uint32_t rgb666);
+        bool gramAddress(int x, int y, int *column, int *row) const;
+
+        int panelWidth, panelHeight;
+        bool invertedPanel;
+        uint32_t gram[ST7789_GRAM_HEIGHT][ST7789_GRAM_WIDTH]; // RGB666, 6 bits per channel in the low 18 bits
+
+        // Registers
+        uint8_t memoryAccessControl;
+        uint8_t pixelFormat;
+        uint16_t columnStart, columnEnd, rowStart, rowEnd;
+        uint16_t topFixedArea, scrollArea, bottomFixedArea, scrollStart;
+        bool isScrolling;
+        bool isInverted;
+        bool isDisplayOn;
+        bool isSleeping;
+        uint8_t brightnessValue;
+
+        // The command in progress
+        int currentCommand; // -1 if none
+        uint8_t params[8];
+        uint32_t numParams;
+        uint8_t pixelBytes[3];
+        uint32_t numPixelBytes;
+        int cursorX, cursorY;
+};
@@ -2,26 +2,15 @@
 #include <stdio.h>
 #include <memory.h>
 #include <spi.h>
-#include <spi_utils.h>
-#include <gpio_utils.h>
-
-void init_st7789V() {
-    // If a Reset pin is defined, toggle it briefly high->low->high to enable the device. Some devices do not have a reset pin, in which case compile with GPIO_TFT_RESET_PIN left undefined.
-    printf("Resetting display at reset GPIO pin %d\n", GPIO_TFT_RESET_PIN);
-    set_gpio_mode(gpio, GPIO_TFT_RESET_PIN, 1);
-    set_gpio(gpio, GPIO_TFT_RESET_PIN);
-    usleep(120 * 1000);
-    clear_gpio(gpio, GPIO_TFT_RESET_PIN);
-    usleep(120 * 1000);
-    set_gpio(gpio, GPIO_TFT_RESET_PIN);
-    usleep(120 * 1000);
+
+void init_st7789V(spi_loop *loop) {
+    spi_select_panel(loop);
 
     // Do the initialization with a very low SPI bus speed, so that it will succeed even if the bus speed chosen by the user is too high.
-    spi->clk = 34;
-    __sync_synchronize();
+    loop->transport->setClockDivisor(34);
 
     printf("Driver begin spi communication!\n");
-    begin_spi_communication(spi);
+    loop->transport->begin();
     usleep(120 * 1000);
 
     SPI_TRANSFER(0x11 /*Sleep Out*/);
@@ -60,6 +49,11 @@ void init_st7789V() {
     SPI_TRANSFER(0xC6, 0x01);
     usleep(20 * 1000);
 
+#if defined(GPIO_TFT_TE)
+    SPI_TRANSFER(0x35 /*TEON: Tearing Effect Line On*/, 0x00 /*V-blank only*/);
+    usleep(20 * 1000);
+#endif
+
     // SPI_TRANSFER(0x34);
     // usleep(20 * 1000);
 
@@ -75,14 +69,38 @@ void init_st7789V() {
     // set_gpio(gpio, GPIO_TFT_BACKLIGHT);            // And turn the backlight on.
     // #endif
 
-    ClearScreen();
+    ClearScreen(loop);
     usleep(120 * 1000);
 
-    end_spi_communication(spi);
+    loop->transport->end();
     usleep(120 * 1000); // Delay a bit before restoring CLK, or otherwise this has been observed to cause the display not init if done back to back after the clear operation above.
 
     // And speed up to the desired operation speed finally after init is done.
-    spi->clk = SPI_BUS_CLOCK_DIVISOR;
+    loop->transport->setClockDivisor(SPI_BUS_CLOCK_DIVISOR);
 
     printf("Driver is initialised!\n");
-}
\ No newline at end of file
+}
+
+void sleep_in_st7789V(spi_loop *loop) {
+    QUEUE_CONTROL_SPI_TRANSFER(SPI_CONTROL_ASAP, 0x10 /*SLPIN: Sleep In*/);
+}
+
+void sleep_out_st7789V(spi_loop *loop) {
+    QUEUE_CONTROL_SPI_TRANSFER(SPI_CONTROL_ASAP, 0x11 /*SLPOUT: Sleep Out*/);
+}
+
+void display_off_st7789V(spi_loop *loop) {
+    QUEUE_CONTROL_SPI_TRANSFER(SPI_CONTROL_AT_FRAME_BOUNDARY, 0x28 /*DISPOFF: Display Off*/);
+}
+
+void display_on_st7789V(spi_loop *loop) {
+    QUEUE_CONTROL_SPI_TRANSFER(SPI_CONTROL_ASAP, 0x29 /*DISPON: Display On*/);
+}
+
+void set_brightness_st7789V(spi_loop *loop, uint8_t brightness) {
+    QUEUE_CONTROL_SPI_TRANSFER(SPI_CONTROL_ASAP, 0x51 /*WRDISBV: Write Display Brightness*/, brightness);
+}
+
+void set_madctl_st7789V(spi_loop *loop, uint8_t madctl) {
+    QUEUE_CONTROL_SPI_TRANSFER(SPI_CONTROL_AT_FRAME_BOUNDARY, 0x36 /*MADCTL: Memory Access Control*/, madctl);
+}
@@ -1,3 +1,7 @@
+#pragma once
+
+#include <stdint.h>
+
 #define DISPLAY_NATIVE_WIDTH 240
 #define DISPLAY_NATIVE_HEIGHT 320
 
@@ -9,4 +13,17 @@
 #define DISPLAY_SET_CURSOR_Y 0x2B
 #define DISPLAY_WRITE_PIXELS 0x2C
 
-void init_st7789V();
\ No newline at end of file
+struct spi_loop;
+
+// Initializes the panel of the given loop. The reset line is shared by all panels, so it is toggled by InitSPI()
+// before any of them are initialized.
+void init_st7789V(spi_loop *loop);
+
+// Runtime mode changes. These go through the SPI control lane, so they reach the bus in between pixel tasks
+// instead of waiting behind the frames that are already queued up.
+void sleep_in_st7789V(spi_loop *loop);
+void sleep_out_st7789V(spi_loop *loop); // N.B. the panel needs 120msecs after this before it accepts sleep in again
+void display_off_st7789V(spi_loop *loop); // Blanks the panel after the frame that is being sent, GRAM is kept
+void display_on_st7789V(spi_loop *loop);
+void set_brightness_st7789V(spi_loop *loop, uint8_t brightness);
+void set_madctl_st7789V(spi_loop *loop, uint8_t madctl); // Applied at a frame boundary to avoid tearing a frame in half
\ No newline at end of file
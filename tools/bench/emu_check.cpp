@@ -0,0 +1,171 @@
+// Pushes synthetic frames through the Gpu and the SPI thread into an emulated ST7789 (src/spi/st7789_emulator.h), and
+// checks after every frame that the emulated GRAM holds exactly the frame that was posted. Reports what each workload
+// cost on the bus, so that changes to createSpans, optimizeSpans or the task packing can be checked to stay pixel exact
+// and compared by their bytes and commands per frame. Usage:
+//
+//   emu_check [frames] [--png <directory>]
+//
+// --png writes what the panel shows at the end of each workload to <directory>/<workload>.png.
+// Exits with 1 if a frame did not reach GRAM intact, or if the bytes that the Gpu accounted for differ from the bytes
+// that the panel received.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Gpu.hpp"
+#include "spi.h"
+#include "util.h"
+#include "emulator_transport.h"
+
+volatile bool programRunning = true;
+void MarkProgramQuitting() { programRunning = false; }
+
+static EmulatorTransport *emulator = 0;
+static int canvasW, canvasH;
+
+static SpiTransport *CreateEmulator() {
+  return emulator = new EmulatorTransport(DISPLAY_NATIVE_WIDTH, DISPLAY_NATIVE_HEIGHT);
+}
+
+static uint32_t randomState = 1;
+static uint32_t Random() {
+  randomState = randomState * 1664525u + 1013904223u;
+  return randomState >> 8;
+}
+
+// Every pixel changes every frame
+static void DrawFull(uint16_t *frame, int f) {
+  for(int i = 0; i < canvasW*canvasH; ++i) frame[i] = (uint16_t)(i * 7 + f * 0x0841);
+}
+
+// A sprite moves over a static background
+static void DrawSprite(uint16_t *frame, int f) {
+  for(int y = 0; y < canvasH; ++y)
+    for(int x = 0; x < canvasW; ++x)
+      frame[y*canvasW + x] = ((x >> 4) + (y >> 4)) & 1 ? 0x39E7 : 0x18C3;
+  int x0 = (f * 7) % (canvasW - 32), y0 = (f * 3) % (canvasH - 32);
+  for(int y = 0; y < 32; ++y)
+    for(int x = 0; x < 32; x += 2)
+      frame[(y0 + y)*canvasW + x0 + x] = 0xFFE0;
+}
+
+// A few hundred scattered pixels change, producing many short spans and window updates
+static void DrawNoise(uint16_t *frame, int) {
+  for(int i = 0; i < 300; ++i) frame[Random() % (canvasW*canvasH)] = (uint16_t)Random();
+}
+
+// The whole image moves up by a line every frame
+static void DrawScroll(uint16_t *frame, int f) {
+  for(int y = 0; y < canvasH; ++y)
+    for(int x = 0; x < canvasW; ++x)
+      frame[y*canvasW + x] = (uint16_t)(((y + f) * 37) ^ (x * 11));
+}
+
+// The emulated panel is written in the portrait scan order of the Gpu: canvas pixel (cx, cy) lands on column
+// canvasH-1-cy, row canvasW-1-cx of the MCU address space
+static int FirstMismatch(const uint16_t *frame, int *px, int *py) {
+  St7789Emulator *panel = emulator->panel(0);
+  for(int y = 0; y < canvasW; ++y)
+    for(int x = 0; x < canvasH; ++x)
+      if (panel->pixelAt(x, y) != frame[(canvasH - 1 - x)*canvasW + canvasW - 1 - y])
+      {
+        *px = x;
+        *py = y;
+        return 1;
+      }
+  return 0;
+}
+
+static bool RunWorkload(Gpu& gpu, const char *name, void (*draw)(uint16_t*, int), int frames, const char *pngDirectory) {
+  uint16_t *frame = (uint16_t*)malloc(canvasW*canvasH*sizeof(uint16_t));
+  memset(frame, 0, canvasW*canvasH*sizeof(uint16_t));
+  gpu.waitFence(gpu.post(frame));
+  while(spi_bus_bytes_queued(spiBus) > 0) usleep(100);
+
+  St7789Emulator *panel = emulator->panel(0);
+  panel->resetStats();
+  uint64_t bytes0 = spiBus->panels[0]->bytesSent;
+  int posts = 0, settled = 0, mismatches = 0;
+  for(int f = 0; f < frames; ++f)
+  {
+    draw(frame, f);
+    gpu.waitFence(gpu.post(frame));
+    ++posts;
+    int x, y;
+    if (FirstMismatch(frame, &x, &y))
+    {
+      // An interlaced update sends every second row of the frame only, so the frame is complete after one more post
+      gpu.waitFence(gpu.post(frame));
+      ++posts;
+      ++settled;
+      if (FirstMismatch(frame, &x, &y))
+      {
+        if (!mismatches) printf("%s: frame %d differs at column %d, row %d: 0x%04x in GRAM, 0x%04x posted\n", name, f, x, y,
+          panel->pixelAt(x, y), frame[(canvasH - 1 - x)*canvasW + canvasW - 1 - y]);
+        ++mismatches;
+      }
+    }
+  }
+  while(spi_bus_bytes_queued(spiBus) > 0) usleep(100);
+
+  const St7789Stats &s = panel->stats;
+  uint64_t panelBytes = s.commands + s.dataBytes, gpuBytes = spiBus->panels[0]->bytesSent - bytes0;
+  printf("%-8s %4d frames %4d posts %10.1f bytes/post %7.1f commands/post %7.1f CASET/RASET/post %9.1f pixels/post %5.1f%% unchanged",
+    name, frames, posts, (double)panelBytes / posts, (double)s.commands / posts, (double)s.windowCommands / posts,
+    (double)s.pixelWrites / posts, s.unchangedPixelWrites * 100.0 / MAX(s.pixelWrites, 1));
+  if (settled) printf(", %d interlaced", settled);
+  printf(mismatches ? ", %d frames WRONG\n" : ", pixel exact\n", mismatches);
+  bool ok = !mismatches;
+  if (panelBytes != gpuBytes)
+  {
+    printf("%s: the panel received %llu bytes, but %llu were accounted as sent\n", name, (unsigned long long)panelBytes, (unsigned long long)gpuBytes);
+    ok = false;
+  }
+  if (s.outOfRangePixelWrites || s.unsupportedCommands)
+  {
+    printf("%s: %llu pixel writes outside of GRAM, %llu unsupported commands\n", name, (unsigned long long)s.outOfRangePixelWrites, (unsigned long long)s.unsupportedCommands);
+    ok = false;
+  }
+  if (pngDirectory)
+  {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s.png", pngDirectory, name);
+    if (!panel->writePng(path)) printf("Could not write %s\n", path);
+  }
+  free(frame);
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  int frames = 60;
+  const char *pngDirectory = 0;
+  for(int i = 1; i < argc; ++i)
+  {
+    if (!strcmp(argv[i], "--png") && i + 1 < argc) pngDirectory = argv[++i];
+    else if (atoi(argv[i]) > 0) frames = atoi(argv[i]);
+    else
+    {
+      fprintf(stderr, "Usage: %s [frames] [--png <directory>]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  Gpu gpu;
+  gpu.init(CreateEmulator);
+  canvasW = gpu.canvasWidth();
+  canvasH = gpu.canvasHeight();
+
+  St7789Emulator *panel = emulator->panel(0);
+  if (!panel->displayOn()) printf("The display was not switched on by the init sequence\n");
+  bool ok = panel->displayOn();
+  ok = RunWorkload(gpu, "full", DrawFull, frames, pngDirectory) && ok;
+  ok = RunWorkload(gpu, "sprite", DrawSprite, frames, pngDirectory) && ok;
+  ok = RunWorkload(gpu, "noise", DrawNoise, frames, pngDirectory) && ok;
+  ok = RunWorkload(gpu, "scroll", DrawScroll, frames, pngDirectory) && ok;
+
+  programRunning = false;
+  spi_wake_thread(spiBus);
+  gpu.deinit();
+  return ok ? 0 : 1;
+}
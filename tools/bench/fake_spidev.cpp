@@ -0,0 +1,101 @@
+#include <errno.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+#include <linux/spi/spidev.h>
+
+#include "config.h"
+#include "display.h"
+#include "fake_spidev.h"
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static uint64_t NowNsecs() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+FakeSpidev::FakeSpidev(uint32_t bufsiz, bool simulateBusTime): bufsiz(bufsiz), simulateBusTime(simulateBusTime), nextFd(1000), dataControlFd(-1), dataControlLevel(1) {
+  resetCounters();
+}
+
+void FakeSpidev::resetCounters() {
+  spiMessages = spiTransfers = gpioWrites = commandBytes = dataBytes = 0;
+  streamHash = FNV_OFFSET_BASIS;
+}
+
+int FakeSpidev::open(const char *, int) {
+  return nextFd++;
+}
+
+int FakeSpidev::close(int) {
+  return 0;
+}
+
+uint32_t FakeSpidev::maxMessageSize() {
+  return bufsiz;
+}
+
+int FakeSpidev::ioctl(int fd, unsigned long request, void *arg) {
+  if (request == GPIO_GET_LINEHANDLE_IOCTL)
+  {
+    struct gpiohandle_request *req = (struct gpiohandle_request*)arg;
+    req->fd = nextFd++;
+    if (req->lineoffsets[0] == GPIO_TFT_DATA_CONTROL)
+    {
+      dataControlFd = req->fd;
+      dataControlLevel = req->default_values[0];
+    }
+    return 0;
+  }
+
+  if (request == GPIOHANDLE_SET_LINE_VALUES_IOCTL)
+  {
+    ++gpioWrites;
+    if (fd == dataControlFd) dataControlLevel = ((struct gpiohandle_data*)arg)->values[0];
+    return 0;
+  }
+
+  if (request == SPI_IOC_WR_MODE || request == SPI_IOC_WR_BITS_PER_WORD)
+    return 0;
+
+  if (_IOC_TYPE(request) == SPI_IOC_MAGIC && _IOC_NR(request) == 0) // SPI_IOC_MESSAGE(n)
+  {
+    uint32_t n = _IOC_SIZE(request) / sizeof(struct spi_ioc_transfer);
+    struct spi_ioc_transfer *xfers = (struct spi_ioc_transfer*)arg;
+
+    // Like the kernel driver, refuse messages that do not fit in the bounce buffer
+    uint64_t total = 0;
+    for(uint32_t i = 0; i < n; ++i) total += xfers[i].len;
+    if (total > bufsiz)
+    {
+      errno = EMSGSIZE;
+      return -1;
+    }
+
+    uint64_t busNsecs = 0;
+    for(uint32_t i = 0; i < n; ++i)
+    {
+      const uint8_t *bytes = (const uint8_t*)(uintptr_t)xfers[i].tx_buf;
+      for(uint32_t j = 0; j < xfers[i].len; ++j)
+        streamHash = (streamHash ^ (bytes[j] | (dataControlLevel << 8))) * FNV_PRIME;
+      if (dataControlLevel) dataBytes += xfers[i].len;
+      else commandBytes += xfers[i].len;
+      if (xfers[i].speed_hz) busNsecs += xfers[i].len * 8ULL * 1000000000ULL / xfers[i].speed_hz;
+    }
+    ++spiMessages;
+    spiTransfers += n;
+
+    if (simulateBusTime)
+    {
+      uint64_t end = NowNsecs() + busNsecs;
+      while(NowNsecs() < end) /*wait for the bytes to clock out*/;
+    }
+    return (int)total;
+  }
+
+  errno = ENOTTY;
+  return -1;
+}
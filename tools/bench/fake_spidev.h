@@ -0,0 +1,35 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "spidev_transport.h"
+
+// Stand-in for the spidev and GPIO character device drivers, for running the spidev transport on hosts without
+// SPI hardware. Enforces the same bufsiz message limit as the kernel driver, tracks the D/C line, and counts the
+// bytes and the ioctls that reach the "kernel".
+class FakeSpidev : public SpidevSyscalls {
+    public:
+        // If simulateBusTime is set, each message takes as long as it would take on the wire at its speed_hz
+        FakeSpidev(uint32_t bufsiz, bool simulateBusTime);
+
+        int open(const char *path, int flags) override;
+        int ioctl(int fd, unsigned long request, void *arg) override;
+        int close(int fd) override;
+        uint32_t maxMessageSize() override;
+
+        void resetCounters();
+
+        uint64_t spiMessages; // SPI_IOC_MESSAGE ioctls
+        uint64_t spiTransfers; // spi_ioc_transfers in those messages
+        uint64_t gpioWrites; // GPIOHANDLE_SET_LINE_VALUES ioctls
+        uint64_t commandBytes; // Bytes sent with D/C low
+        uint64_t dataBytes; // Bytes sent with D/C high
+        uint64_t streamHash; // FNV-1a hash of the bytes and their D/C levels, to check that two runs sent the same stream
+
+    private:
+        uint32_t bufsiz;
+        bool simulateBusTime;
+        int nextFd;
+        int dataControlFd;
+        uint8_t dataControlLevel;
+};
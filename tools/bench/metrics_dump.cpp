@@ -0,0 +1,60 @@
+// Prints the metrics page that fbcp exports with METRICS_EXPORT, as an example of a reader of it. Usage:
+//
+//   metrics_dump [--watch]
+//
+// --watch prints it again every time it is updated, until interrupted.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "metrics_export.h"
+
+static void Print(const MetricsPage *page) {
+  printf("update %llu at %.3f s\n", (unsigned long long)page->updateCount, page->updateTimeUsecs / 1e6);
+  for (uint32_t i = 0; i < page->numPanels && i < METRICS_PAGE_MAX_PANELS; ++i)
+    printf("  panel %u: %llu bytes, %llu frames\n", i, (unsigned long long)page->panelBytesSent[i], (unsigned long long)page->panelFramesSent[i]);
+  printf("  frames: %llu progressive, %llu interlaced, %llu skipped\n", (unsigned long long)page->progressiveFrames,
+    (unsigned long long)page->interlacedFrames, (unsigned long long)page->skippedFrames);
+  printf("  spi thread: %.3f s transmitting, %.3f s polling, %.3f s stalled, %.3f s sleeping\n", page->spiThreadUsecs[0] / 1e6,
+    page->spiThreadUsecs[1] / 1e6, page->spiThreadUsecs[2] / 1e6, page->spiThreadUsecs[3] / 1e6);
+  printf("  spi: %.1f%% busy, bus %.1f%% busy, %.2f Mbit/s, %.1f MHz; cpu %d MHz, core %d MHz, %.1f C, gpu polling wasted %d%%\n",
+    page->spiUtilization * 100.0, page->spiBusDutyCycle * 100.0, page->spiBusDataRateBitsPerSec / 1e6, page->spiBusSpeedMhz, page->cpuFrequencyMhz,
+    page->coreFrequencyMhz, page->cpuTemperatureCelsius, page->gpuPollingWastedPercent);
+  for (uint32_t i = 0; i < page->numHistograms && i < METRICS_PAGE_MAX_HISTOGRAMS; ++i) {
+    const MetricsPageHistogram *h = &page->histograms[i];
+    printf("  %-22s %8llu samples, p50 %8llu, p90 %8llu, p99 %8llu, p99.9 %8llu, max %8llu\n", h->name, (unsigned long long)h->count,
+      (unsigned long long)h->p50, (unsigned long long)h->p90, (unsigned long long)h->p99, (unsigned long long)h->p999, (unsigned long long)h->max);
+  }
+}
+
+int main(int argc, char **argv) {
+  bool watch = argc > 1 && !strcmp(argv[1], "--watch");
+  int fd = shm_open(METRICS_SHM_NAME, O_RDONLY, 0);
+  if (fd < 0) {
+    fprintf(stderr, "Could not open %s, is fbcp running with METRICS_EXPORT?\n", METRICS_SHM_NAME);
+    return 1;
+  }
+  const volatile MetricsPage *page = (const volatile MetricsPage *)mmap(0, sizeof(MetricsPage), PROT_READ, MAP_SHARED, fd, 0);
+  if (page == MAP_FAILED) {
+    fprintf(stderr, "Could not map %s\n", METRICS_SHM_NAME);
+    return 1;
+  }
+
+  uint64_t lastUpdate = 0;
+  do {
+    MetricsPage copy;
+    if (!ReadMetricsPage(page, &copy)) {
+      fprintf(stderr, "No consistent metrics page, is it of another version?\n");
+      return 1;
+    }
+    if (copy.updateCount != lastUpdate) {
+      Print(&copy);
+      lastUpdate = copy.updateCount;
+    }
+    if (watch) usleep(METRICS_PAGE_INTERVAL_USECS / 4);
+  } while (watch);
+  return 0;
+}
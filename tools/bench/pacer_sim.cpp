@@ -0,0 +1,135 @@
+// Runs the FramePacer against the virtual tick() clock, with a vsync grid like the one that the TE pulses give and
+// synthetic frame costs, and checks where the frames land. Nothing sleeps for real and the costs come from a fixed
+// seed, so the results are the same on every run and every machine. Usage:
+//
+//   pacer_sim [frames]
+//
+// Each scenario renders the frames the way main's render loop does: it waits for a vsync tick, has the pacer pick
+// the deadline and the start time, and then renders, posts and sends the frame by advancing the virtual clock by
+// what those cost. Exits with 1 if a deadline is off the grid, a frame misses a deadline it should have made, or a
+// frame that made its deadline was not started just in time for it.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "FramePacer.hpp"
+#include "tick.h"
+
+volatile bool programRunning = true;
+void MarkProgramQuitting() { programRunning = false; }
+
+// Every fourth TE pulse of a 111hz panel, TE_DELAY_USECS after the pulse
+#define SIM_PERIOD_USECS 36036
+#define SIM_PHASE_USECS 1500
+// Frames before the pacer has enough history to predict costs with
+#define SIM_WARMUP_FRAMES 8
+
+static uint64_t gridOrigin;
+
+// The first tick at or after t
+static uint64_t NextTick(uint64_t t) {
+  if (t <= gridOrigin) return gridOrigin;
+  return gridOrigin + (t - gridOrigin + SIM_PERIOD_USECS - 1) / SIM_PERIOD_USECS * SIM_PERIOD_USECS;
+}
+
+static uint32_t randomState;
+static uint32_t Random() {
+  randomState = randomState * 1664525u + 1013904223u;
+  return randomState >> 8;
+}
+
+// A cost of base usecs, give or take up to jitter usecs
+static uint64_t Cost(uint64_t base, uint64_t jitter) {
+  return base - jitter + Random() % (2 * jitter + 1);
+}
+
+struct Scenario {
+  const char *name;
+  uint64_t renderUsecs, postUsecs, transferUsecs; // Average costs of a frame
+  uint64_t jitterUsecs; // How far the transfer cost strays from the average
+  int spikeEvery; // Every spikeEvery'th frame takes a whole period longer to send, and misses its deadline
+};
+
+static const Scenario scenarios[] = {
+  { "steady", 3000, 800, 14000, 1000, 0 },
+  { "spikes", 3000, 800, 14000, 1000, 40 },
+  { "over a period", 12000, 1500, 38000, 1000, 0 },
+};
+
+static bool RunScenario(const Scenario &s, int numFrames) {
+  randomState = 1;
+  gridOrigin = tick() + SIM_PHASE_USECS;
+  FramePacer pacer([]() { VsyncGrid grid = { gridOrigin, SIM_PERIOD_USECS }; return grid; });
+
+  int failures = 0, lateFrames = 0;
+  uint64_t prevDeadline = 0, lastTick = 0, totalSlack = 0, maxSlack = 0, framesOnTime = 0;
+  for(int f = 0; f < numFrames; ++f)
+  {
+    // Wait for the next tick, unless one went by while the previous frame was being sent
+    uint64_t nextTick = NextTick(lastTick + 1);
+    if (nextTick > tick()) AdvanceVirtualClock(nextTick - tick());
+    lastTick = NextTick(tick() + 1) - SIM_PERIOD_USECS;
+
+    PacedFrame frame = pacer.beginFrame();
+    AdvanceVirtualClock(Cost(s.renderUsecs, s.jitterUsecs / 4));
+    frame.postTime = tick();
+    AdvanceVirtualClock(Cost(s.postUsecs, s.jitterUsecs / 4));
+    frame.postedTime = tick();
+    bool spike = s.spikeEvery && f % s.spikeEvery == s.spikeEvery - 1;
+    AdvanceVirtualClock(Cost(s.transferUsecs, s.jitterUsecs) + (spike ? SIM_PERIOD_USECS : 0));
+    uint64_t onGlass = tick();
+    pacer.endFrame(frame, onGlass);
+
+    if ((frame.deadline - gridOrigin) % SIM_PERIOD_USECS != 0) {
+      printf("  frame %d: deadline %+lldus off the grid\n", f, (long long)((frame.deadline - gridOrigin) % SIM_PERIOD_USECS));
+      ++failures;
+    }
+    if (frame.deadline <= prevDeadline) {
+      printf("  frame %d: deadline is not after the previous frame's\n", f);
+      ++failures;
+    }
+    prevDeadline = frame.deadline;
+
+    if (onGlass > frame.deadline) {
+      ++lateFrames;
+      if (f >= SIM_WARMUP_FRAMES && !spike) {
+        printf("  frame %d: on glass %lluus after its deadline\n", f, (unsigned long long)(onGlass - frame.deadline));
+        ++failures;
+      }
+    } else if (f >= SIM_WARMUP_FRAMES) {
+      // Started just in time: the frame arrives no earlier than the margin plus the spread of the costs allows
+      uint64_t slack = frame.deadline - onGlass;
+      if (slack > FRAME_PACER_MARGIN_USECS + 3 * s.jitterUsecs) {
+        printf("  frame %d: on glass %lluus before its deadline\n", f, (unsigned long long)slack);
+        ++failures;
+      }
+      totalSlack += slack;
+      maxSlack = slack > maxSlack ? slack : maxSlack;
+      ++framesOnTime;
+    } else if (spike) {
+      ++failures; // A spike in the warm up would not test anything
+    }
+  }
+
+  FramePacerStatistics stats;
+  pacer.statistics(stats);
+  printf("%s: %d frames, %d late, %llu skipped deadlines, predicted cost %.2fms, on glass %.2fms before the deadline on average (%.2fms at most)%s\n",
+    s.name, numFrames, lateFrames, (unsigned long long)stats.skippedDeadlines, stats.predictedCostUsecs / 1000.0,
+    framesOnTime ? totalSlack / 1000.0 / framesOnTime : 0.0, maxSlack / 1000.0, failures ? " FAILED" : "");
+  if (stats.missedDeadlines != (uint64_t)lateFrames) {
+    printf("  the pacer counted %llu missed deadlines\n", (unsigned long long)stats.missedDeadlines);
+    ++failures;
+  }
+  return failures == 0;
+}
+
+int main(int argc, char **argv) {
+  int numFrames = argc > 1 ? atoi(argv[1]) : 1000;
+  if (numFrames <= SIM_WARMUP_FRAMES) numFrames = SIM_WARMUP_FRAMES + 1;
+  SetTickClock(TICK_CLOCK_VIRTUAL);
+
+  bool ok = true;
+  for(size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); ++i)
+    ok = RunScenario(scenarios[i], numFrames) && ok;
+  return ok ? 0 : 1;
+}
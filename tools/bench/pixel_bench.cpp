@@ -0,0 +1,301 @@
+// Times the pixel hot paths one by one on real frame pairs: the consecutive frames of the animations in res/ (of the
+// source tree, unless --res is given). Needs no display and no SPI bus, so it runs the same on a development machine
+// and on the Pi. Usage:
+//
+//   pixel_bench [--res <directory>] [--frames <per clip, 0: all>] [--repeat <n>] [--out <file.json>]
+//
+// Prints a JSON report (to --out, or stdout) in a format that stays stable from release to release, so that reports
+// can be diffed and tracked over time:
+//
+//   { "format": "fbcp-pixel-bench", "version": 1, "machine": ..., "cpu_mhz": ..., "compiler": ...,
+//     "corpus": { "clips": [...], "frames": n, "frame_pairs": n },
+//     "benchmarks": [ { "name": ..., "calls": n, "ns_per_frame": x, "bytes_per_frame": x, "bytes_per_cycle": x }, ... ] }
+//
+// bytes_per_frame is what the path reads from its input: both framebuffers for the diffs, the source frame for the
+// rotations, the spans for optimizeSpans, the packed pixels for the packer, the glyph cells for DrawText and the
+// histogram for EstimateFrameRateInterval. bytes_per_cycle divides it by ns_per_frame at the current CPU clock, and is
+// null if the clock is not known (or the path could not run, such as EstimateFrameRateInterval, which needs the
+// system timer, in -DSPI_TRANSPORT=bcm2835 builds).
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "Gpu.hpp"
+#include "FrameSource.hpp"
+#include "gpu.h"
+#include "text.h"
+#include "util.h"
+
+// Set by CMake to the root of the source tree
+#ifndef FBCP_SOURCE_DIR
+#define FBCP_SOURCE_DIR "."
+#endif
+
+volatile bool programRunning = true;
+void MarkProgramQuitting() { programRunning = false; }
+
+#define NUM_BENCHMARKS 9
+
+struct BenchmarkResult {
+  const char *name;
+  uint64_t calls;
+  uint64_t nsecs;
+  uint64_t bytes;
+  bool ran;
+};
+
+static BenchmarkResult results[NUM_BENCHMARKS] = {
+  { "Gpu::countChangedPixels", 0, 0, 0, false }, { "Gpu::createSpans", 0, 0, 0, false },
+  { "Gpu::optimizeSpans", 0, 0, 0, false }, { "Gpu::packSpan", 0, 0, 0, false },
+  { "Gpu::transposeCanvas", 0, 0, 0, false }, { "RotateFrame", 0, 0, 0, false }, { "DrawText", 0, 0, 0, false },
+  { "IsNewFramebuffer", 0, 0, 0, false }, { "EstimateFrameRateInterval", 0, 0, 0, false }
+};
+enum { COUNT_CHANGED, CREATE_SPANS, OPTIMIZE_SPANS, PACK_SPAN, TRANSPOSE_CANVAS, ROTATE_FRAME, DRAW_TEXT, IS_NEW_FRAMEBUFFER, ESTIMATE_INTERVAL };
+
+static int repeat = 5;
+
+static uint64_t Nsecs() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+// Runs fn repeat times, and adds the time and the bytes that it processed to the result
+template<typename F>
+static void Time(int benchmark, uint64_t bytes, F&& fn) {
+  uint64_t t0 = Nsecs();
+  for(int r = 0; r < repeat; ++r) fn();
+  results[benchmark].nsecs += Nsecs() - t0;
+  results[benchmark].calls += repeat;
+  results[benchmark].bytes += bytes * repeat;
+  results[benchmark].ran = true;
+}
+
+// Drives the private Gpu stages directly, on a Gpu that is not connected to a bus
+class GpuBenchmark {
+    public:
+        GpuBenchmark() {
+          loop.chipSelect = 0;
+          spi_loop *loops[1] = { &loop };
+          gpu.init(loops, 1, GPU_LAYOUT_SPLIT);
+          packed = (uint16_t*)malloc(gpu.gpuFramebufferSizeBytes);
+          // IsNewFramebuffer() compares gpuFramebufferSizeBytes of the two framebuffers
+          ::gpuFramebufferSizeBytes = gpu.gpuFramebufferSizeBytes;
+        }
+        ~GpuBenchmark() {
+          free(packed);
+          gpu.deinit();
+        }
+
+        int frameBytes() const { return gpu.gpuFramebufferSizeBytes; }
+
+        // Makes prev the frame on the display and cur the new one
+        void load(const uint16_t *prev, const uint16_t *cur) {
+          gpu.transposeCanvas(prev);
+          memcpy(gpu.framebuffer[1], gpu.framebuffer[0], gpu.gpuFramebufferSizeBytes);
+          gpu.transposeCanvas(cur);
+        }
+
+        void run(const uint16_t *cur) {
+          uint16_t *fb = gpu.framebuffer[0], *prevFb = gpu.framebuffer[1];
+          Time(COUNT_CHANGED, 2 * frameBytes(), [&] { gpu.countChangedPixels(fb, prevFb); });
+
+          Span *head = 0;
+          int numSpans = 0;
+          Time(CREATE_SPANS, 2 * frameBytes(), [&] { numSpans = gpu.createSpans(head, fb, prevFb, false, 0); });
+          if (!numSpans) head = 0;
+
+          // optimizeSpans merges the list in place, so it gets a fresh one on every run
+          uint64_t t = 0;
+          for(int r = 0; r < repeat; ++r)
+          {
+            if (numSpans) gpu.createSpans(head, fb, prevFb, false, 0);
+            uint64_t t0 = Nsecs();
+            if (numSpans) gpu.optimizeSpans(head);
+            t += Nsecs() - t0;
+          }
+          results[OPTIMIZE_SPANS].nsecs += t;
+          results[OPTIMIZE_SPANS].calls += repeat;
+          results[OPTIMIZE_SPANS].bytes += (uint64_t)numSpans * sizeof(Span) * repeat;
+          results[OPTIMIZE_SPANS].ran = true;
+
+          uint64_t packedBytes = 0;
+          for(Span *i = head; i; i = i->next) packedBytes += i->size * sizeof(uint16_t);
+          Time(PACK_SPAN, packedBytes, [&] {
+            uint16_t *out = packed;
+            for(Span *i = head; i; i = i->next) {
+              gpu.packSpan(i, out);
+              out += i->size;
+            }
+          });
+
+          Time(TRANSPOSE_CANVAS, frameBytes(), [&] { gpu.transposeCanvas(cur); });
+          Time(IS_NEW_FRAMEBUFFER, 2 * frameBytes(), [&] { IsNewFramebuffer(fb, fb); }); // An unchanged frame is read through to the end
+        }
+
+    private:
+        Gpu gpu;
+        spi_loop loop{};
+        uint16_t *packed;
+};
+
+typedef uint16_t Frame[FRAME_SOURCE_HEIGHT][FRAME_SOURCE_WIDTH];
+typedef uint16_t Canvas[FRAME_SOURCE_WIDTH][FRAME_SOURCE_HEIGHT];
+
+static void BenchmarkText(uint16_t *framebuffer) {
+  // The lines of the statistics overlay
+  static const char *lines[] = { "60.0fps 12.34MB/s 62.5MHz 45.1C 3%", "SPI 87%/64% 1.2ms", "CPU 12.5MB GPU 3.2MB", "p50 8.1ms p99 14.6ms" };
+  uint64_t bytes = 0;
+  for(const char *line : lines) bytes += strlen(line) * (MONACO_WIDTH + 2) * (MONACO_HEIGHT + 1) * sizeof(uint16_t);
+  Time(DRAW_TEXT, bytes, [&] {
+    for(int i = 0; i < 4; ++i)
+      DrawText(framebuffer, FRAME_SOURCE_HEIGHT, FRAME_SOURCE_HEIGHT * sizeof(uint16_t), FRAME_SOURCE_WIDTH, lines[i], 1, 1 + 9 * i, 0xFFFF, 0);
+  });
+}
+
+static void BenchmarkFrameRateEstimate() {
+  // On the virtual clock, so that the estimate sees the same histogram at the same time on every run
+  SetTickClock(TICK_CLOCK_VIRTUAL);
+  // A histogram of frames that arrived at about 60fps, up until now
+  uint64_t now = tick();
+  for(int i = HISTOGRAM_SIZE; i > 0; --i) AddHistogramSample(now - i * 16667 + (i * 7919) % 2000);
+  Time(ESTIMATE_INTERVAL, histogramSize * sizeof(uint64_t), [] { EstimateFrameRateInterval(); });
+  SetTickClock(TICK_CLOCK_MONOTONIC);
+}
+
+static double CpuMhz() {
+  FILE *handle = fopen("/sys/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq", "r");
+  if (handle) {
+    double khz = 0;
+    int n = fscanf(handle, "%lf", &khz);
+    fclose(handle);
+    if (n == 1 && khz > 0) return khz / 1000.0;
+  }
+  handle = fopen("/proc/cpuinfo", "r");
+  if (!handle) return 0;
+  char line[256];
+  double mhz = 0;
+  while(fgets(line, sizeof(line), handle))
+    if (sscanf(line, "cpu MHz : %lf", &mhz) == 1) break;
+  fclose(handle);
+  return mhz;
+}
+
+// Frame files of a clip are named frame_<n>.png, numbered from 0
+static int LoadClip(const std::string& directory, int maxFrames, std::vector<Canvas*>& canvases) {
+  Frame *frame = (Frame*)malloc(sizeof(Frame));
+  for(int n = 0; maxFrames <= 0 || n < maxFrames; ++n) {
+    std::string path = directory + "/frame_" + std::to_string(n) + ".png";
+    if (!LoadFrameImage(path.c_str(), *frame)) break;
+    Canvas *canvas = (Canvas*)malloc(sizeof(Canvas));
+    uint64_t t0 = Nsecs();
+    RotateFrame(*frame, *canvas);
+    results[ROTATE_FRAME].nsecs += Nsecs() - t0;
+    results[ROTATE_FRAME].calls += 1;
+    results[ROTATE_FRAME].bytes += sizeof(Frame);
+    results[ROTATE_FRAME].ran = true;
+    canvases.push_back(canvas);
+  }
+  free(frame);
+  return (int)canvases.size();
+}
+
+static void PrintNumber(FILE *out, double value, bool valid) {
+  if (valid) fprintf(out, "%.3f", value);
+  else fprintf(out, "null");
+}
+
+int main(int argc, char **argv) {
+  std::string res = FBCP_SOURCE_DIR "/res";
+  const char *outPath = 0;
+  int maxFrames = 60;
+  for(int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--res") && i + 1 < argc) res = argv[++i];
+    else if (!strcmp(argv[i], "--frames") && i + 1 < argc) maxFrames = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--repeat") && i + 1 < argc) repeat = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--out") && i + 1 < argc) outPath = argv[++i];
+    else {
+      fprintf(stderr, "Usage: %s [--res <directory>] [--frames <per clip, 0: all>] [--repeat <n>] [--out <file.json>]\n", argv[0]);
+      return 1;
+    }
+  }
+  repeat = MAX(repeat, 1);
+
+  // The pipeline code logs to stdout, so the report goes to the original stdout and everything else to stderr
+  int reportFd = dup(1);
+  dup2(2, 1);
+
+  std::vector<std::string> clips;
+  DIR *dir = opendir(res.c_str());
+  if (!dir) {
+    fprintf(stderr, "Could not open %s, pass the res/ directory of the repository with --res\n", res.c_str());
+    return 1;
+  }
+  while(struct dirent *e = readdir(dir))
+    if (e->d_name[0] != '.') clips.push_back(e->d_name);
+  closedir(dir);
+  std::sort(clips.begin(), clips.end());
+
+  GpuBenchmark bench;
+  uint16_t *textFramebuffer = (uint16_t*)calloc(FRAME_SOURCE_WIDTH * FRAME_SOURCE_HEIGHT, sizeof(uint16_t));
+  std::vector<std::string> loadedClips;
+  int totalFrames = 0, totalPairs = 0;
+  for(const std::string& clip : clips) {
+    std::vector<Canvas*> canvases;
+    int frames = LoadClip(res + "/" + clip, maxFrames, canvases);
+    if (frames == 0) continue;
+    fprintf(stderr, "%s: %d frames\n", clip.c_str(), frames);
+    loadedClips.push_back(clip);
+    totalFrames += frames;
+    for(int f = 1; f < frames; ++f) {
+      bench.load(&(*canvases[f-1])[0][0], &(*canvases[f])[0][0]);
+      bench.run(&(*canvases[f])[0][0]);
+      BenchmarkText(textFramebuffer);
+      ++totalPairs;
+    }
+    for(Canvas *c : canvases) free(c);
+  }
+  free(textFramebuffer);
+  if (!totalPairs) {
+    fprintf(stderr, "No frame pairs found under %s\n", res.c_str());
+    return 1;
+  }
+  BenchmarkFrameRateEstimate();
+
+  FILE *out = outPath ? fopen(outPath, "w") : fdopen(reportFd, "w");
+  if (!out) {
+    fprintf(stderr, "Could not open %s for writing\n", outPath);
+    return 1;
+  }
+  struct utsname name;
+  uname(&name);
+  double mhz = CpuMhz();
+  fprintf(out, "{\n  \"format\": \"fbcp-pixel-bench\",\n  \"version\": 1,\n  \"machine\": \"%s\",\n  \"cpu_mhz\": ", name.machine);
+  PrintNumber(out, mhz, mhz > 0);
+  fprintf(out, ",\n  \"compiler\": \"%s\",\n  \"corpus\": { \"clips\": [", __VERSION__);
+  for(size_t i = 0; i < loadedClips.size(); ++i) fprintf(out, "%s\"%s\"", i ? ", " : "", loadedClips[i].c_str());
+  fprintf(out, "], \"frames\": %d, \"frame_pairs\": %d },\n  \"benchmarks\": [\n", totalFrames, totalPairs);
+  for(int i = 0; i < NUM_BENCHMARKS; ++i) {
+    const BenchmarkResult& r = results[i];
+    double nsPerFrame = r.calls ? (double)r.nsecs / r.calls : 0;
+    double bytesPerFrame = r.calls ? (double)r.bytes / r.calls : 0;
+    fprintf(out, "    { \"name\": \"%s\", \"calls\": %llu, \"ns_per_frame\": ", r.name, (unsigned long long)r.calls);
+    PrintNumber(out, nsPerFrame, r.ran);
+    fprintf(out, ", \"bytes_per_frame\": ");
+    PrintNumber(out, bytesPerFrame, r.ran);
+    fprintf(out, ", \"bytes_per_cycle\": ");
+    PrintNumber(out, nsPerFrame > 0 ? bytesPerFrame / (nsPerFrame * mhz / 1000.0) : 0, r.ran && mhz > 0 && nsPerFrame > 0);
+    fprintf(out, " }%s\n", i + 1 < NUM_BENCHMARKS ? "," : "");
+  }
+  fprintf(out, "  ]\n}\n");
+  fclose(out);
+  return 0;
+}
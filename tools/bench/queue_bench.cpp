@@ -0,0 +1,148 @@
+// Measures the post-to-run latency of the main thread's task queue, against the mutex + condition variable +
+// std::queue<std::function> queue that it replaced. Usage:
+//
+//   queue_bench [posts] [--producers N] [--interval USECS]
+//
+// Each producer posts a task every interval (0 = as fast as it can), and the consumer records how long after the post
+// each task ran. Heap allocations made while posting and running are counted too.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include "TaskQueue.hpp"
+
+static std::atomic<uint64_t> heapAllocations{0};
+
+// Every throwing form of new and every form of delete is replaced, so that each allocation is counted and each
+// release pairs with the malloc() that made it.
+static void *countedAlloc(size_t size) {
+  heapAllocations.fetch_add(1, std::memory_order_relaxed);
+  void *p = malloc(size ? size : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+void *operator new(size_t size) { return countedAlloc(size); }
+void *operator new[](size_t size) { return countedAlloc(size); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+static uint64_t nowNsecs() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+// What a task carries: when it was posted, and where to record its latency. Larger than the 16 bytes that
+// std::function stores in place.
+struct Sample {
+  uint64_t postTime;
+  uint64_t *latencies;
+  uint32_t index;
+};
+
+class MutexQueue {
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::queue<std::function<void()>> q;
+public:
+  template<typename F> void post(F&& f) {
+    std::unique_lock<std::mutex> lock(mtx);
+    q.push(std::forward<F>(f));
+    cv.notify_one();
+  }
+  void runOne() {
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait(lock, [this] { return !q.empty(); });
+    std::function<void()> cb = q.front();
+    q.pop();
+    lock.unlock();
+    cb();
+  }
+};
+
+class LockFreeQueue {
+  TaskQueue<1024> q;
+public:
+  template<typename F> void post(F&& f) {
+    while (!q.post(std::forward<F>(f))) sched_yield(); // Only full when the consumer is far behind
+  }
+  void runOne() {
+    InlineTask task;
+    while (!q.tryPop(task)) q.wait();
+    task();
+  }
+};
+
+template<typename Queue>
+static void Run(const char *name, int posts, int producers, int intervalUsecs) {
+  Queue *queue = new Queue();
+  std::vector<uint64_t> latencies(posts);
+  uint64_t *lat = latencies.data();
+  const int postsPerProducer = posts / producers;
+  posts = postsPerProducer * producers;
+
+  std::atomic<bool> go{false};
+  std::atomic<bool> *goFlag = &go;
+  std::vector<std::thread> threads;
+  threads.reserve(producers);
+  for (int p = 0; p < producers; ++p) {
+    threads.emplace_back([=] {
+      while (!goFlag->load()) sched_yield();
+      uint64_t next = nowNsecs();
+      for (int i = 0; i < postsPerProducer; ++i) {
+        if (intervalUsecs) {
+          next += intervalUsecs * 1000ULL;
+          struct timespec t = { (time_t)(next / 1000000000ULL), (long)(next % 1000000000ULL) };
+          clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, 0);
+        }
+        Sample s = { nowNsecs(), lat, (uint32_t)(p * postsPerProducer + i) };
+        queue->post([s] { s.latencies[s.index] = nowNsecs() - s.postTime; });
+      }
+    });
+  }
+  // Starting the threads allocates, so only count from when they start posting
+  uint64_t allocations0 = heapAllocations.load();
+  uint64_t t0 = nowNsecs();
+  go.store(true);
+  for (int i = 0; i < posts; ++i) queue->runOne();
+  double secs = (nowNsecs() - t0) / 1e9;
+  uint64_t allocations = heapAllocations.load() - allocations0;
+  for (auto &t : threads) t.join();
+
+  std::sort(latencies.begin(), latencies.begin() + posts);
+  printf("%-10s %8d tasks %3d producers %8.0f tasks/s | post to run p50 %7.1fus p99 %7.1fus max %8.1fus | %.2f heap allocations/task\n",
+    name, posts, producers, posts / secs, latencies[posts / 2] / 1000.0, latencies[posts * 99 / 100] / 1000.0, latencies[posts - 1] / 1000.0,
+    (double)allocations / posts);
+  delete queue;
+}
+
+int main(int argc, char **argv) {
+  int posts = (argc > 1 && argv[1][0] != '-') ? atoi(argv[1]) : 20000;
+  int producers = 1, intervalUsecs = 100;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--producers") && i + 1 < argc) producers = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--interval") && i + 1 < argc) intervalUsecs = atoi(argv[++i]);
+  }
+  if (posts < producers || producers < 1) {
+    fprintf(stderr, "Need at least one task per producer\n");
+    return 1;
+  }
+
+  Run<MutexQueue>("mutex+cv", posts, producers, intervalUsecs);
+  Run<LockFreeQueue>("TaskQueue", posts, producers, intervalUsecs);
+  return 0;
+}
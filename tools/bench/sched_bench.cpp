@@ -0,0 +1,78 @@
+// Measures how late a periodic thread wakes up, as the vsync thread does, with and without realtime scheduling, while
+// other threads load all cores. Usage:
+//
+//   sched_bench [seconds] [--load N] [--cpu C] [--priority P]
+//
+// --load N starts N busy threads (default: one per core), --cpu C pins the realtime run to core C (default 2, or the
+// last core if there are fewer), and --priority P is its SCHED_FIFO priority (default 70). The realtime run needs root
+// or CAP_SYS_NICE.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "realtime.h"
+
+#define WAKEUP_INTERVAL_USECS 1000
+
+static uint64_t nowNsecs() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static void Measure(SchedLatency *latency, int seconds, int policy, int priority, int cpu) {
+  std::thread measurer([=] {
+    SetThreadScheduling("sched-bench", policy, priority, cpu);
+    uint64_t deadline = nowNsecs();
+    uint64_t end = deadline + seconds * 1000000000ULL;
+    while (deadline < end) {
+      deadline += WAKEUP_INTERVAL_USECS * 1000ULL;
+      struct timespec t = { (time_t)(deadline / 1000000000ULL), (long)(deadline % 1000000000ULL) };
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, 0);
+      uint64_t now = nowNsecs();
+      AddSchedLatencySample(latency, now > deadline ? (now - deadline) / 1000 : 0);
+    }
+  });
+  measurer.join();
+}
+
+static void Print(SchedLatency *l) {
+  printf("%-10s %8llu wakeups | p50 <%5lluus p99 <%6lluus p99.9 <%6lluus max %7lluus\n", l->name, (unsigned long long)l->samples,
+    (unsigned long long)SchedLatencyPercentile(l, 0.5), (unsigned long long)SchedLatencyPercentile(l, 0.99),
+    (unsigned long long)SchedLatencyPercentile(l, 0.999), (unsigned long long)l->maxUsecs);
+}
+
+int main(int argc, char **argv) {
+  int seconds = (argc > 1 && argv[1][0] != '-') ? atoi(argv[1]) : 5;
+  int load = (int)std::thread::hardware_concurrency();
+  int cpu = load > 2 ? 2 : load - 1, priority = 70;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--load") && i + 1 < argc) load = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--cpu") && i + 1 < argc) cpu = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--priority") && i + 1 < argc) priority = atoi(argv[++i]);
+  }
+
+  std::atomic<bool> loadRunning{true};
+  std::vector<std::thread> loadThreads;
+  for (int i = 0; i < load; ++i)
+    loadThreads.emplace_back([&] { volatile uint64_t x = 0; while (loadRunning.load(std::memory_order_relaxed)) ++x; });
+  printf("%d busy threads, %dus wake up interval, %ds per run\n", load, WAKEUP_INTERVAL_USECS, seconds);
+
+  static SchedLatency other = { "SCHED_OTHER", {}, 0, 0 };
+  static SchedLatency fifo = { "SCHED_FIFO", {}, 0, 0 };
+  Measure(&other, seconds, SCHED_OTHER, 0, -1);
+  Measure(&fifo, seconds, SCHED_FIFO, priority, cpu);
+
+  loadRunning.store(false);
+  for (auto &t : loadThreads) t.join();
+
+  Print(&other);
+  Print(&fifo);
+  return 0;
+}
@@ -0,0 +1,195 @@
+// Pushes synthetic frames through the full Gpu -> SPI task ring -> SPI thread -> transport pipeline, and reports the
+// throughput of each transport. Usage:
+//
+//   spi_bench <transport> [frames] [--bus-time] [--panels 2] [--layout separate|split|mirrored]
+//
+// where transport is one of
+//   polled       the polled BCM2835 SPI0 transport (needs a -DSPI_TRANSPORT=bcm2835 build and root on a Pi)
+//   spidev       the spidev transport on /dev/spidev0.0 and /dev/gpiochip0
+//   fake-spidev  the spidev transport against an in-process fake spidev driver, runs anywhere
+//   recording    the in-memory recording transport, runs anywhere
+//
+// --bus-time makes the fake spidev driver take as long as the bytes would take on the wire.
+// --panels 2 drives two panels (CE0 and CE1) on the same bus, and reports them separately. With --layout separate
+// (the default) each panel has its own Gpu that is posted the same frame. With split, a single Gpu drives both panels
+// from a canvas twice as wide. With mirrored, a single Gpu sends the same frame to both panels, diffing it only once.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Gpu.hpp"
+#include "spi.h"
+#include "bcm2835_transport.h"
+#include "spidev_transport.h"
+#include "recording_transport.h"
+#include "fake_spidev.h"
+
+volatile bool programRunning = true;
+void MarkProgramQuitting() { programRunning = false; }
+
+#define FRAME_HEIGHT 240
+#define SPRITE_SIZE 32
+
+// Counts the bytes that a transport puts on the bus, for any backend
+class CountingTransport : public SpiTransport {
+    public:
+        CountingTransport(SpiTransport *inner): inner(inner), commandBytes(0), dataBytes(0), chipSelectSwitches(0) {}
+        ~CountingTransport() { delete inner; }
+        void begin() override { inner->begin(); }
+        void command(uint8_t cmd) override { ++commandBytes; inner->command(cmd); }
+        void data(const uint8_t *bytes, uint32_t size) override { dataBytes += size; inner->data(bytes, size); }
+        void end() override { inner->end(); }
+        void flush() override { inner->flush(); }
+        void selectChip(uint8_t chipSelect) override { ++chipSelectSwitches; inner->selectChip(chipSelect); }
+        void setClockDivisor(uint32_t divisor) override { inner->setClockDivisor(divisor); }
+        void resetDisplay() override { inner->resetDisplay(); }
+
+        SpiTransport *inner;
+        volatile uint64_t commandBytes;
+        volatile uint64_t dataBytes;
+        volatile uint64_t chipSelectSwitches;
+};
+
+static CountingTransport *counter = 0;
+static FakeSpidev *fakeSpidev = 0;
+static bool simulateBusTime = false;
+static int frameWidth = 320; // The canvas spans all panels in the split layout
+
+static SpiTransport *CreatePolled() {
+#ifdef USE_VIDEOCORE
+  return counter = new CountingTransport(new Bcm2835Transport(spi, gpio));
+#else
+  fprintf(stderr, "The polled transport needs a -DSPI_TRANSPORT=bcm2835 build\n");
+  exit(1);
+#endif
+}
+
+static SpiTransport *CreateSpidev() {
+  return counter = new CountingTransport(new SpidevTransport("/dev/spidev0.0", "/dev/gpiochip0"));
+}
+
+static SpiTransport *CreateFakeSpidev() {
+  fakeSpidev = new FakeSpidev(4096, simulateBusTime);
+  return counter = new CountingTransport(new SpidevTransport("fake-spidev", "fake-gpiochip", fakeSpidev));
+}
+
+static SpiTransport *CreateRecording() {
+  return counter = new CountingTransport(new RecordingTransport(DISPLAY_WIDTH*DISPLAY_HEIGHT*SPI_BYTESPERPIXEL*4));
+}
+
+// Every pixel changes every frame, to a color that it did not have in any recent frame, so that an interlaced update
+// leaves no field that is already up to date for the next frame
+static void DrawFullFrame(uint16_t *frame, int f) {
+  for(int i = 0; i < frameWidth*FRAME_HEIGHT; ++i) frame[i] = (uint16_t)(i * 7 + f * 0x0841);
+}
+
+// A small sprite moves over a static background, producing many short spans
+static void DrawSpriteFrame(uint16_t *frame, int f) {
+  memset(frame, 0, frameWidth*FRAME_HEIGHT*sizeof(uint16_t));
+  int x0 = (f * 7) % (frameWidth - SPRITE_SIZE);
+  int y0 = (f * 3) % (FRAME_HEIGHT - SPRITE_SIZE);
+  for(int y = 0; y < SPRITE_SIZE; ++y)
+    for(int x = 0; x < SPRITE_SIZE; x += 2) // Every second pixel, so that the diff produces many spans
+      frame[(y0 + y) * frameWidth + x0 + x] = 0xFFFF;
+}
+
+// Posts every frame to each of the Gpus
+static void RunWorkload(Gpu *gpus, int numGpus, int numPanels, const char *name, void (*draw)(uint16_t*, int), int frames) {
+  uint16_t *frame = (uint16_t*)malloc(frameWidth*FRAME_HEIGHT*sizeof(uint16_t));
+  uint32_t fences[SPI_MAX_PANELS] = {};
+  uint64_t panelBytes0[SPI_MAX_PANELS];
+
+  // Start from a known screen, and don't count that in
+  memset(frame, 0, frameWidth*FRAME_HEIGHT*sizeof(uint16_t));
+  for(int g = 0; g < numGpus; ++g) fences[g] = gpus[g].post(frame);
+  for(int g = 0; g < numGpus; ++g) gpus[g].waitFence(fences[g]);
+  uint64_t commandBytes0 = counter->commandBytes, dataBytes0 = counter->dataBytes, chipSelectSwitches0 = counter->chipSelectSwitches;
+  for(int p = 0; p < numPanels; ++p) panelBytes0[p] = spiBus->panels[p]->bytesSent;
+  if (fakeSpidev) fakeSpidev->resetCounters();
+
+  uint64_t t0 = tick();
+  for(int f = 0; f < frames; ++f)
+  {
+    draw(frame, f);
+    for(int g = 0; g < numGpus; ++g) fences[g] = gpus[g].post(frame);
+  }
+  for(int g = 0; g < numGpus; ++g) gpus[g].waitFence(fences[g]);
+  double secs = (tick() - t0) / 1000000.0;
+
+  uint64_t bytes = counter->commandBytes - commandBytes0 + counter->dataBytes - dataBytes0;
+  printf("%-8s %6d frames %8.3f s %8.1f fps %8.3f MB/s on bus", name, frames, secs, frames / secs, bytes / secs / 1000000.0);
+  if (numPanels > 1)
+  {
+    for(int p = 0; p < numPanels; ++p) printf(" | panel %d %8.3f MB/s", p, (spiBus->panels[p]->bytesSent - panelBytes0[p]) / secs / 1000000.0);
+    printf(" | %6.1f chip select switches/frame", (double)(counter->chipSelectSwitches - chipSelectSwitches0) / frames);
+  }
+  if (fakeSpidev)
+    printf(" | %6.1f SPI messages/frame, %6.1f transfers/message, %6.1f GPIO writes/frame, stream hash %016llx",
+      (double)fakeSpidev->spiMessages / frames, (double)fakeSpidev->spiTransfers / MAX(fakeSpidev->spiMessages, 1),
+      (double)fakeSpidev->gpioWrites / frames, (unsigned long long)fakeSpidev->streamHash);
+  printf("\n");
+  free(frame);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2)
+  {
+    fprintf(stderr, "Usage: %s <polled|spidev|fake-spidev|recording> [frames] [--bus-time] [--panels 2] [--layout separate|split|mirrored]\n", argv[0]);
+    return 1;
+  }
+  int frames = (argc > 2 && argv[2][0] != '-') ? atoi(argv[2]) : 300;
+  int numPanels = 1;
+  const char *layout = "separate";
+  for(int i = 2; i < argc; ++i)
+  {
+    if (!strcmp(argv[i], "--bus-time")) simulateBusTime = true;
+    else if (!strcmp(argv[i], "--panels") && i + 1 < argc) numPanels = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--layout") && i + 1 < argc) layout = argv[++i];
+  }
+  if (numPanels < 1 || numPanels > SPI_MAX_PANELS)
+  {
+    fprintf(stderr, "--panels must be between 1 and %d\n", SPI_MAX_PANELS);
+    return 1;
+  }
+
+  SpiTransport *(*createTransport)() = 0;
+  if (!strcmp(argv[1], "polled")) createTransport = CreatePolled;
+  else if (!strcmp(argv[1], "spidev")) createTransport = CreateSpidev;
+  else if (!strcmp(argv[1], "fake-spidev")) createTransport = CreateFakeSpidev;
+  else if (!strcmp(argv[1], "recording")) createTransport = CreateRecording;
+  else
+  {
+    fprintf(stderr, "Unknown transport %s\n", argv[1]);
+    return 1;
+  }
+
+  InitSPI(numPanels, createTransport);
+  Gpu gpus[SPI_MAX_PANELS];
+  int numGpus = 1;
+  if (!strcmp(layout, "separate"))
+  {
+    numGpus = numPanels;
+    for(int p = 0; p < numPanels; ++p) gpus[p].init(spiBus->panels[p]);
+  }
+  else if (!strcmp(layout, "split") || !strcmp(layout, "mirrored"))
+  {
+    gpus[0].init(spiBus->panels, numPanels, !strcmp(layout, "split") ? GPU_LAYOUT_SPLIT : GPU_LAYOUT_MIRRORED);
+    frameWidth = gpus[0].canvasWidth();
+  }
+  else
+  {
+    fprintf(stderr, "Unknown layout %s\n", layout);
+    return 1;
+  }
+
+  printf("Transport: %s, %d panel(s), %s layout\n", argv[1], numPanels, layout);
+  RunWorkload(gpus, numGpus, numPanels, "full", DrawFullFrame, frames);
+  RunWorkload(gpus, numGpus, numPanels, "sprite", DrawSpriteFrame, frames);
+
+  programRunning = false;
+  spi_wake_thread(spiBus);
+  for(int g = 0; g < numGpus; ++g) gpus[g].deinit();
+  DeinitSPI();
+  return 0;
+}
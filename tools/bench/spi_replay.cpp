@@ -0,0 +1,184 @@
+// Replays an SPI command stream that was captured with -DSPI_CAPTURE=ON (see src/display/spi_capture.h) through the
+// task rings, the SPI thread and a transport, and reports how long the SPI thread took for it. Usage:
+//
+//   spi_replay <capture> [--transport recording|fake-spidev|spidev|polled] [--bus-time] [--max-speed]
+//
+// By default the tasks are posted at the times they were captured at, which reproduces the load that the SPI thread
+// saw in the field. --max-speed posts them all at once, to benchmark the consumer side deterministically: the same
+// capture always puts the same bytes on the bus in the same tasks. The transports are those of spi_bench, and
+// --bus-time makes the fake spidev driver take as long as the bytes would take on the wire.
+//
+// Control tasks go through the pixel task ring of their panel, in the order they were captured in.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#include "spi.h"
+#include "spi_capture.h"
+#include "metrics.h"
+#include "util.h"
+#include "bcm2835_transport.h"
+#include "spidev_transport.h"
+#include "recording_transport.h"
+#include "fake_spidev.h"
+
+volatile bool programRunning = true;
+void MarkProgramQuitting() { programRunning = false; }
+
+struct ReplayTask {
+  SpiCaptureRecord record;
+  uint32_t dataOffset;
+};
+
+static bool simulateBusTime = false;
+
+static SpiTransport *CreatePolled() {
+#ifdef USE_VIDEOCORE
+  return new Bcm2835Transport(spi, gpio);
+#else
+  fprintf(stderr, "The polled transport needs a -DSPI_TRANSPORT=bcm2835 build\n");
+  exit(1);
+#endif
+}
+
+static SpiTransport *CreateSpidev() {
+  return new SpidevTransport("/dev/spidev0.0", "/dev/gpiochip0");
+}
+
+static SpiTransport *CreateFakeSpidev() {
+  return new SpidevTransport("fake-spidev", "fake-gpiochip", new FakeSpidev(4096, simulateBusTime));
+}
+
+static SpiTransport *CreateRecording() {
+  return new RecordingTransport(DISPLAY_WIDTH*DISPLAY_HEIGHT*SPI_BYTESPERPIXEL*4);
+}
+
+static void SleepUntil(uint64_t usecs) {
+  uint64_t now = tick();
+  if (usecs > now) usleep(usecs - now);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2)
+  {
+    fprintf(stderr, "Usage: %s <capture> [--transport recording|fake-spidev|spidev|polled] [--bus-time] [--max-speed]\n", argv[0]);
+    return 1;
+  }
+  const char *transport = "recording";
+  bool maxSpeed = false;
+  for(int i = 2; i < argc; ++i)
+  {
+    if (!strcmp(argv[i], "--transport") && i + 1 < argc) transport = argv[++i];
+    else if (!strcmp(argv[i], "--bus-time")) simulateBusTime = true;
+    else if (!strcmp(argv[i], "--max-speed")) maxSpeed = true;
+  }
+  SpiTransport *(*createTransport)() = 0;
+  if (!strcmp(transport, "polled")) createTransport = CreatePolled;
+  else if (!strcmp(transport, "spidev")) createTransport = CreateSpidev;
+  else if (!strcmp(transport, "fake-spidev")) createTransport = CreateFakeSpidev;
+  else if (!strcmp(transport, "recording")) createTransport = CreateRecording;
+  else
+  {
+    fprintf(stderr, "Unknown transport %s\n", transport);
+    return 1;
+  }
+
+  // Read the whole capture up front, so that the disk does not pace the replay
+  FILE *handle = fopen(argv[1], "rb");
+  SpiCaptureHeader header;
+  if (!handle || !ReadSpiCaptureHeader(handle, &header))
+  {
+    fprintf(stderr, "%s is not an SPI capture of version %d\n", argv[1], SPI_CAPTURE_VERSION);
+    return 1;
+  }
+  if (header.displayWidth != DISPLAY_WIDTH || header.displayHeight != DISPLAY_HEIGHT)
+    printf("Warning: captured on a %dx%d display, replaying on a %dx%d one\n", header.displayWidth, header.displayHeight, DISPLAY_WIDTH, DISPLAY_HEIGHT);
+  if (header.numPanels < 1 || header.numPanels > SPI_MAX_PANELS)
+  {
+    fprintf(stderr, "Unsupported number of panels %d in the capture\n", header.numPanels);
+    return 1;
+  }
+
+  std::vector<ReplayTask> tasks;
+  std::vector<uint8_t> data;
+  uint8_t buffer[SPI_CAPTURE_MAX_DATA_SIZE];
+  SpiCaptureRecord record = {};
+  uint64_t capturedBusyUsecs = 0, gaps = 0;
+  while(ReadSpiCaptureRecord(handle, &record, buffer))
+  {
+    if (record.flags & SPI_CAPTURE_GAP)
+    {
+      gaps += record.size;
+      continue;
+    }
+    if (record.chipSelect >= header.numPanels || record.size > MAX_SPI_TASK_SIZE + sizeof(SPIWindow))
+    {
+      fprintf(stderr, "Malformed task in the capture\n");
+      return 1;
+    }
+    ReplayTask task = { record, (uint32_t)data.size() };
+    data.insert(data.end(), buffer, buffer + record.size);
+    tasks.push_back(task);
+    capturedBusyUsecs += record.duration;
+  }
+  fclose(handle);
+  if (tasks.empty())
+  {
+    fprintf(stderr, "No tasks in %s\n", argv[1]);
+    return 1;
+  }
+  uint64_t capturedUsecs = tasks.back().record.start + tasks.back().record.duration - tasks[0].record.start;
+  printf("Capture: %zu tasks, %.3f s, SPI thread busy %.1f%%, CDIV %u, %d panel(s)", tasks.size(), capturedUsecs / 1000000.0,
+    capturedBusyUsecs * 100.0 / MAX(capturedUsecs, 1), header.busClockDivisor, header.numPanels);
+  if (gaps) printf(", %llu tasks were dropped from it", (unsigned long long)gaps);
+  printf("\n");
+
+  InitSPI(header.numPanels, createTransport);
+  uint64_t bytes0[SPI_MAX_PANELS];
+  for(int p = 0; p < spiBus->numPanels; ++p) bytes0[p] = spiBus->panels[p]->bytesSent;
+  MetricsSnapshot latencies0;
+  MetricsTakeSnapshot(&frameLatencyMetric, &latencies0);
+
+  uint32_t lastFence[SPI_MAX_PANELS] = {};
+  uint64_t frames = 0;
+  uint64_t t0 = tick();
+  for(size_t i = 0; i < tasks.size(); ++i)
+  {
+    const SpiCaptureRecord &r = tasks[i].record;
+    if (!maxSpeed) SleepUntil(t0 + r.start - tasks[0].record.start);
+    spi_loop *loop = spiBus->panels[r.chipSelect];
+    SPITask *task = spi_create_task(loop, r.size);
+    task->cmd = r.cmd;
+    task->flags = r.flags & (SPI_TASK_FRAME_END | SPI_TASK_WINDOW);
+    memcpy(task->data, &data[tasks[i].dataOffset], r.size);
+    if (task->flags & SPI_TASK_FRAME_END)
+    {
+      task->fence = lastFence[r.chipSelect] = spi_issue_fence(loop, tick());
+      ++frames;
+    }
+    spi_commit_task(loop, task);
+  }
+  for(int p = 0; p < spiBus->numPanels; ++p)
+    if (lastFence[p]) spi_fence_wait(spiBus->panels[p], lastFence[p]);
+  while(spi_bus_bytes_queued(spiBus) > 0) usleep(100);
+  double secs = (tick() - t0) / 1000000.0;
+
+  uint64_t bytes = 0;
+  for(int p = 0; p < spiBus->numPanels; ++p) bytes += spiBus->panels[p]->bytesSent - bytes0[p];
+  MetricsSnapshot latencies;
+  MetricsTakeSnapshot(&frameLatencyMetric, &latencies);
+  MetricsSubtract(&latencies, &latencies0);
+  printf("Replay: %s, %s, %.3f s, %llu frames, %.3f MB/s on bus", transport, maxSpeed ? "max speed" : "captured pace", secs,
+    (unsigned long long)frames, bytes / secs / 1000000.0);
+  if (latencies.count)
+    printf(", frame latency p50 %llu us, p99 %llu us", (unsigned long long)MetricsPercentile(&latencies, 0.5), (unsigned long long)MetricsPercentile(&latencies, 0.99));
+  printf("\n");
+
+  programRunning = false;
+  spi_wake_thread(spiBus);
+  DeinitSPI();
+  return 0;
+}
@@ -0,0 +1,68 @@
+// Runs a Vsync locked on a simulated TE source, and reports how well it follows the edges. Usage:
+//
+//   vsync_sim [seconds] [--drop N] [--jitter USECS] [--overrun N]
+//
+// --drop N leaves out every Nth TE pulse, --jitter USECS moves the pulses randomly by up to that much, and
+// --overrun N makes every Nth callback run for three frames.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <thread>
+
+#include "Vsync.hpp"
+
+#define SIM_REFRESH_RATE 111.0
+#define SIM_EDGES_PER_TICK 4
+
+static uint64_t nowNsecs() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+  int seconds = (argc > 1 && argv[1][0] != '-') ? atoi(argv[1]) : 3;
+  int dropEvery = 0, jitterUsecs = 0, overrunEvery = 0;
+  for(int i = 1; i < argc; ++i)
+  {
+    if (!strcmp(argv[i], "--drop") && i + 1 < argc) dropEvery = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--jitter") && i + 1 < argc) jitterUsecs = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--overrun") && i + 1 < argc) overrunEvery = atoi(argv[++i]);
+  }
+
+  SimulatedVsyncSource source(SIM_REFRESH_RATE);
+  // The simulated panel runs 0.5% fast, which the phase-locked loop has to follow
+  const uint64_t edgePeriod = (uint64_t)(1000000000.0 / (SIM_REFRESH_RATE * 1.005));
+  const int numEdges = (int)(seconds * SIM_REFRESH_RATE * 1.005);
+  uint64_t firstEdge = nowNsecs() + 50000000ULL;
+  for(int e = 0; e < numEdges; ++e)
+  {
+    if (dropEvery && e % dropEvery == dropEvery - 1) continue;
+    int64_t jitter = jitterUsecs ? (rand() % (2 * jitterUsecs + 1) - jitterUsecs) * 1000LL : 0;
+    source.pushEdge(firstEdge + e * edgePeriod + jitter);
+  }
+
+  // Distance of each tick from the nearest true edge
+  uint64_t maxPhaseError = 0, totalPhaseError = 0, numTicks = 0;
+  Vsync vsync(&source, SIM_EDGES_PER_TICK, 0);
+  vsync.callback([&]{
+    uint64_t now = nowNsecs();
+    uint64_t offset = (now - firstEdge) % edgePeriod;
+    uint64_t phaseError = offset < edgePeriod / 2 ? offset : edgePeriod - offset;
+    maxPhaseError = phaseError > maxPhaseError ? phaseError : maxPhaseError;
+    totalPhaseError += phaseError;
+    ++numTicks;
+    if (overrunEvery && numTicks % overrunEvery == 0) usleep(3 * 1000000 / TARGET_FRAME_RATE);
+  });
+  vsync.start();
+  usleep(seconds * 1000000 + 50000);
+  vsync.stop();
+
+  printf("%d TE pulses at %.2fhz, every %d dropped, %dus jitter\n", numEdges, 1000000000.0 / edgePeriod, dropEvery, jitterUsecs);
+  vsync.printStatistics();
+  if (numTicks) printf("Tick to TE pulse: avg %.1fus, max %.1fus\n", totalPhaseError / 1000.0 / numTicks, maxPhaseError / 1000.0);
+  return 0;
+}
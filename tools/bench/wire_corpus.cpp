@@ -0,0 +1,246 @@
+// Plays every clip in res/ through Gpu::post into a transport that only counts what would go on the bus, and compares
+// the totals of each clip against a checked-in baseline, so that a change that quietly makes the panels cost more bus
+// traffic shows up before it ships. Usage:
+//
+//   wire_corpus [--res <directory>] [--baseline <file>] [--update]
+//
+// The clips default to res/ and the baseline to tools/bench/wire_baseline.txt in the source tree that the tool was
+// built from, so it runs from any directory. For every clip it holds the number of frames, the payload
+// bytes (all that is sent with D/C high: pixels and command parameters), the command bytes, the SPI transfers (tasks),
+// the spans (RAMWR commands) and the CASET/RASET updates.
+// Exits with 1 if any of these grew for any clip; a clip that got cheaper is reported as such, and --update rewrites
+// the baseline with the new numbers.
+//
+// The frames are posted one by one, each after the previous one has left the queue, so the numbers do not depend on
+// the speed of the machine: whether Gpu::post falls back to an interlaced update only depends on the frame and on
+// spiUsecsPerByte, which the baseline records along with the display size.
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "Gpu.hpp"
+#include "FrameSource.hpp"
+#include "spi.h"
+
+// Set by CMake to the root of the source tree
+#ifndef FBCP_SOURCE_DIR
+#define FBCP_SOURCE_DIR "."
+#endif
+
+volatile bool programRunning = true;
+void MarkProgramQuitting() { programRunning = false; }
+
+#define NUM_COUNTERS 6
+static const char *const counterNames[NUM_COUNTERS] = { "frames", "payload_bytes", "command_bytes", "tasks", "spans", "window_commands" };
+
+struct WireCounts {
+  uint64_t counters[NUM_COUNTERS]; // In the order of counterNames
+};
+
+// Counts the bytes and commands that would go on the bus, and sends them nowhere
+class WireCounter : public SpiTransport {
+    public:
+        void begin() override { ++transfers; }
+        void command(uint8_t cmd) override {
+          ++commandBytes;
+          if (cmd == DISPLAY_WRITE_PIXELS) ++pixelWrites;
+          else if (cmd == DISPLAY_SET_CURSOR_X || cmd == DISPLAY_SET_CURSOR_Y) ++windowCommands;
+        }
+        void data(const uint8_t *, uint32_t size) override { dataBytes += size; }
+        void end() override {}
+        void flush() override {}
+        void selectChip(uint8_t) override {}
+        void setClockDivisor(uint32_t) override {}
+        void resetDisplay() override {}
+
+        volatile uint64_t transfers = 0;
+        volatile uint64_t commandBytes = 0;
+        volatile uint64_t dataBytes = 0;
+        volatile uint64_t pixelWrites = 0;
+        volatile uint64_t windowCommands = 0;
+};
+
+static WireCounter *counter = 0;
+
+static SpiTransport *CreateCounter() {
+  return counter = new WireCounter();
+}
+
+static void PostAndDrain(Gpu& gpu, uint16_t *canvas) {
+  gpu.waitFence(gpu.post(canvas));
+  while(spi_bus_bytes_queued(spiBus) > 0) usleep(100);
+}
+
+// Plays the frames res/<clip>/frame_<n>.png from a black screen, and returns what they cost on the bus
+static WireCounts PlayClip(Gpu& gpu, const std::string& directory) {
+  static uint16_t source[FRAME_SOURCE_HEIGHT][FRAME_SOURCE_WIDTH];
+  static uint16_t canvas[FRAME_SOURCE_WIDTH][FRAME_SOURCE_HEIGHT];
+  memset(canvas, 0, sizeof(canvas));
+  PostAndDrain(gpu, &canvas[0][0]);
+
+  WireCounts c = {};
+  uint64_t transfers0 = counter->transfers, commandBytes0 = counter->commandBytes, dataBytes0 = counter->dataBytes;
+  uint64_t pixelWrites0 = counter->pixelWrites, windowCommands0 = counter->windowCommands;
+  for(int n = 0; ; ++n) {
+    std::string path = directory + "/frame_" + std::to_string(n) + ".png";
+    if (!LoadFrameImage(path.c_str(), source)) break;
+    RotateFrame(source, canvas);
+    PostAndDrain(gpu, &canvas[0][0]);
+    ++c.counters[0];
+  }
+  c.counters[1] = counter->dataBytes - dataBytes0;
+  c.counters[2] = counter->commandBytes - commandBytes0;
+  c.counters[3] = counter->transfers - transfers0;
+  c.counters[4] = counter->pixelWrites - pixelWrites0;
+  c.counters[5] = counter->windowCommands - windowCommands0;
+  return c;
+}
+
+static bool ReadBaseline(const char *path, std::string& header, std::map<std::string, WireCounts>& clips) {
+  FILE *handle = fopen(path, "r");
+  if (!handle) return false;
+  char line[512];
+  while(fgets(line, sizeof(line), handle)) {
+    if (line[0] == '#') {
+      if (!strncmp(line, "# config: ", 10)) header = std::string(line + 10, strcspn(line + 10, "\n"));
+      continue;
+    }
+    char name[256];
+    WireCounts c = {};
+    unsigned long long v[NUM_COUNTERS];
+    if (sscanf(line, "%255s %llu %llu %llu %llu %llu %llu", name, &v[0], &v[1], &v[2], &v[3], &v[4], &v[5]) != 1 + NUM_COUNTERS) continue;
+    for(int i = 0; i < NUM_COUNTERS; ++i) c.counters[i] = v[i];
+    clips[name] = c;
+  }
+  fclose(handle);
+  return true;
+}
+
+static bool WriteBaseline(const char *path, const std::string& config, const std::vector<std::string>& names, const std::map<std::string, WireCounts>& clips) {
+  FILE *handle = fopen(path, "w");
+  if (!handle) return false;
+  fprintf(handle, "# Bus traffic of the clips in res/, as played by tools/bench/wire_corpus. Regenerate with wire_corpus --update\n");
+  fprintf(handle, "# after a change that is meant to change it, and commit it along with the change.\n");
+  fprintf(handle, "# config: %s\n", config.c_str());
+  fprintf(handle, "# clip");
+  for(int i = 0; i < NUM_COUNTERS; ++i) fprintf(handle, " %s", counterNames[i]);
+  fprintf(handle, "\n");
+  for(const std::string& name : names) {
+    fprintf(handle, "%s", name.c_str());
+    for(int i = 0; i < NUM_COUNTERS; ++i) fprintf(handle, " %llu", (unsigned long long)clips.at(name).counters[i]);
+    fprintf(handle, "\n");
+  }
+  fclose(handle);
+  return true;
+}
+
+int main(int argc, char **argv) {
+  std::string res = FBCP_SOURCE_DIR "/res";
+  const char *baselinePath = FBCP_SOURCE_DIR "/tools/bench/wire_baseline.txt";
+  bool update = false;
+  for(int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--res") && i + 1 < argc) res = argv[++i];
+    else if (!strcmp(argv[i], "--baseline") && i + 1 < argc) baselinePath = argv[++i];
+    else if (!strcmp(argv[i], "--update")) update = true;
+    else {
+      fprintf(stderr, "Usage: %s [--res <directory>] [--baseline <file>] [--update]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  std::vector<std::string> names;
+  DIR *dir = opendir(res.c_str());
+  if (!dir) {
+    fprintf(stderr, "Could not open %s, pass the res/ directory of the repository with --res\n", res.c_str());
+    return 1;
+  }
+  while(struct dirent *e = readdir(dir))
+    if (e->d_name[0] != '.') names.push_back(e->d_name);
+  closedir(dir);
+  std::sort(names.begin(), names.end());
+
+  std::string baselineConfig;
+  std::map<std::string, WireCounts> baseline;
+  bool haveBaseline = ReadBaseline(baselinePath, baselineConfig, baseline);
+  if (!haveBaseline && !update) {
+    fprintf(stderr, "Could not read the baseline %s, pass it with --baseline, or --update to create it\n", baselinePath);
+    return 1;
+  }
+
+  Gpu gpu;
+  gpu.init(CreateCounter);
+  char config[256];
+  snprintf(config, sizeof(config), "display %dx%d, SPI_BUS_CLOCK_DIVISOR %d, spiUsecsPerByte %.6f", DISPLAY_WIDTH, DISPLAY_HEIGHT,
+    SPI_BUS_CLOCK_DIVISOR, spiUsecsPerByte);
+
+  std::map<std::string, WireCounts> clips;
+  std::vector<std::string> played;
+  for(const std::string& name : names) {
+    WireCounts c = PlayClip(gpu, res + "/" + name);
+    if (!c.counters[0]) continue;
+    clips[name] = c;
+    played.push_back(name);
+  }
+  programRunning = false;
+  spi_wake_thread(spiBus);
+  gpu.deinit();
+  if (played.empty()) {
+    fprintf(stderr, "No clips found under %s\n", res.c_str());
+    return 1;
+  }
+
+  if (haveBaseline && baselineConfig != config)
+    printf("Warning: the baseline was made with %s, this build has %s, so the numbers may differ for that reason alone\n",
+      baselineConfig.c_str(), config);
+
+  printf("%-10s %6s %12s %10s %10s %10s %10s %12s\n", "clip", "frames", "payload/f", "cmd/f", "tasks/f", "spans/f", "window/f", "vs baseline");
+  int regressions = 0, improvements = 0;
+  for(const std::string& name : played) {
+    const WireCounts& c = clips[name];
+    double frames = (double)c.counters[0];
+    printf("%-10s %6llu %12.1f %10.1f %10.1f %10.1f %10.1f ", name.c_str(), (unsigned long long)c.counters[0], c.counters[1] / frames,
+      c.counters[2] / frames, c.counters[3] / frames, c.counters[4] / frames, c.counters[5] / frames);
+    auto b = baseline.find(name);
+    if (b == baseline.end()) {
+      printf("%12s\n", haveBaseline ? "new" : "-");
+      continue;
+    }
+    bool worse = false, better = false;
+    for(int i = 0; i < NUM_COUNTERS; ++i) {
+      worse = worse || c.counters[i] > b->second.counters[i];
+      better = better || c.counters[i] < b->second.counters[i];
+    }
+    if (!worse && !better) {
+      printf("%12s\n", "same");
+      continue;
+    }
+    printf("%12s\n", worse ? "MORE" : "less");
+    for(int i = 0; i < NUM_COUNTERS; ++i)
+      if (c.counters[i] != b->second.counters[i])
+        printf("           %s: %llu -> %llu (%+.2f%%)\n", counterNames[i], (unsigned long long)b->second.counters[i], (unsigned long long)c.counters[i],
+          (c.counters[i] - (double)b->second.counters[i]) * 100.0 / (b->second.counters[i] ? b->second.counters[i] : 1));
+    if (worse) ++regressions;
+    else ++improvements;
+  }
+
+  if (update) {
+    if (!WriteBaseline(baselinePath, config, played, clips)) {
+      fprintf(stderr, "Could not write %s\n", baselinePath);
+      return 1;
+    }
+    printf("Wrote %s\n", baselinePath);
+    return 0;
+  }
+  if (improvements) printf("%d clip(s) got cheaper on the bus, run with --update to lock that in\n", improvements);
+  if (regressions) {
+    printf("%d clip(s) put more on the bus than the baseline\n", regressions);
+    return 1;
+  }
+  return 0;
+}